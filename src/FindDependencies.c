@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
@@ -15,6 +16,9 @@
 #include <errno.h>
 #include <sys/utsname.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <ctype.h>
@@ -33,6 +37,7 @@ static void PrintVersion(struct version *version) __attribute__((unused));
 static void PrintRange(struct range *range) __attribute__((unused));
 
 static inline struct utsname *RunningKernelInfo();
+static char *strip(char *src);
 
 static const char *GetOperatorString(operator_t op)
 {
@@ -97,12 +102,8 @@ static int VersionCmp(char *_candidate, char *_specified)
 	char *candidate = candidatestring;
 	char *specified = specifiedstring;
 	char *ptr;
-	int c_len, s_len;
 	int c, s, ret=0;
 
-	c_len = strlen(candidate);
-	s_len = strlen(specified);
-
 	// find and remove arguments such as [!cross]. 
 	// we need to take care of them later.
 	ptr = strstr(specified, "[");
@@ -120,13 +121,13 @@ static int VersionCmp(char *_candidate, char *_specified)
 	while (*candidate && *specified) {
 		c = 0;
 		s = 0;
-		// consume strings until a '.' is found
-		while (c<c_len && candidate[c] != '.')
+		// consume strings until a '.' or the end of the string is found
+		while (candidate[c] && candidate[c] != '.')
 			c++;
-		while (s<s_len && specified[s] != '.')
+		while (specified[s] && specified[s] != '.')
 			s++;
 
-		if (c == c_len || s == s_len) {
+		if (candidate[c] == '\0' || specified[s] == '\0') {
 			// return a comparison of the major numbers
 			int a = atoi(candidate);
 			int b = atoi(specified);
@@ -170,6 +171,118 @@ static int VersionCmp(char *_candidate, char *_specified)
 	return ret;
 }
 
+/*
+ * Version keys reproduce VersionCmp() without copying and rescanning the
+ * strings on every comparison. Each dot-separated segment keeps what
+ * VersionCmp() derives from it: its atoi() value, the revision number that
+ * follows a dash, and where the first letter at or after it is. Versions that
+ * VersionCmp() treats in unusual ways (requirements such as [!cross], a
+ * segment ending in a dash, non-ASCII characters or too many segments) are
+ * flagged as inexact and compared through VersionCmp() itself.
+ */
+#define SEGMENT_LAST     0x1  // no dots follow this segment
+#define SEGMENT_EMPTY    0x2  // the version ends where this segment starts
+#define SEGMENT_REVISION 0x4  // segment contains "-r"
+#define SEGMENT_DASH     0x8  // segment contains a dash; rev is valid
+
+/* Same as atoi(), but fails rather than overflowing */
+static bool VersionKeyInt(const char *str, int *value)
+{
+	int digits = 0, sign = 1;
+
+	*value = 0;
+	while (isspace(*str))
+		str++;
+	if (*str == '-' || *str == '+')
+		sign = *str++ == '-' ? -1 : 1;
+	for (; *str >= '0' && *str <= '9'; str++) {
+		if (++digits > 9)
+			return false;
+		*value = *value * 10 + (*str - '0');
+	}
+	*value *= sign;
+	return true;
+}
+
+static void VersionKeyParse(struct version_key *key, const char *version)
+{
+	const char *ptr = version;
+	int i;
+
+	key->source = version;
+	key->exact = false;
+	key->alphastart = isalpha(version[0]);
+	for (i=0; ; i++) {
+		typeof(key->seg[0]) *seg = &key->seg[i];
+		if (i == VERSION_KEY_SEGMENTS)
+			return;
+		seg->flags = *ptr == '\0' ? SEGMENT_EMPTY : 0;
+		seg->rev = 0;
+		seg->alpha = -1;
+		if (! VersionKeyInt(ptr, &seg->num))
+			return;
+		for (; *ptr && *ptr != '.'; ptr++) {
+			if ((unsigned char) *ptr >= 0x80 || *ptr == '[')
+				return;
+			if (*ptr == '-') {
+				if (ptr[1] == 'r')
+					seg->flags |= SEGMENT_REVISION;
+				if (! (seg->flags & SEGMENT_DASH)) {
+					if (ptr[1] == '\0' || ptr[1] == '.')
+						return;
+					seg->flags |= SEGMENT_DASH;
+					if (! VersionKeyInt(ptr + 2, &seg->rev))
+						return;
+				}
+			} else if (seg->alpha < 0 && isalpha(*ptr)) {
+				seg->alpha = ptr - version;
+			}
+		}
+		if (*ptr == '\0') {
+			seg->flags |= SEGMENT_LAST;
+			break;
+		}
+		ptr++;
+	}
+	if (ptr - version > SHRT_MAX)
+		return;
+	key->numsegs = i + 1;
+	/* VersionCmp() looks for letters up to the end of the string */
+	for (i=key->numsegs-2; i>=0; i--)
+		if (key->seg[i].alpha < 0)
+			key->seg[i].alpha = key->seg[i+1].alpha;
+	key->exact = true;
+}
+
+#define INT_CMP(a,b) ((a) == (b) ? 0 : (a) > (b) ? 1 : -1)
+
+/* Same as VersionCmp(candidate->source, specified->source) */
+static int VersionKeyCmp(const struct version_key *candidate, const struct version_key *specified)
+{
+	int i, ret;
+
+	if (! candidate->exact || ! specified->exact)
+		return VersionCmp((char *) candidate->source, (char *) specified->source);
+	if (candidate->alphastart && specified->alphastart)
+		return strcmp(candidate->source, specified->source);
+
+	for (i=0; ; i++) {
+		const typeof(candidate->seg[0]) *c = &candidate->seg[i], *s = &specified->seg[i];
+		if ((c->flags | s->flags) & SEGMENT_EMPTY)
+			return 0;
+		if ((c->flags | s->flags) & SEGMENT_LAST) {
+			if (c->num == s->num && c->alpha >= 0 && s->alpha >= 0)
+				return strcmp(candidate->source + c->alpha, specified->source + s->alpha);
+			return INT_CMP(c->num, s->num);
+		}
+		ret = INT_CMP(c->num, s->num);
+		if (ret == 0 && ((c->flags | s->flags) & SEGMENT_REVISION) && (s->flags & SEGMENT_DASH))
+			ret = INT_CMP(c->rev, s->rev);
+		if (ret)
+			return ret;
+	}
+}
+
 static bool StringEndsWith(const char *candidate, const char *suffix)
 {
 	size_t candidate_len = strlen(candidate);
@@ -189,25 +302,22 @@ static bool IsVersionDirectory(char *candidate)
 			 StringEndsWith(candidate, "-Disabled")));
 }
 
-static bool MatchRule(char *candidate, struct version *v)
+/* Tells whether a comparison that returned @cmp satisfies @op */
+static bool OperatorHolds(operator_t op, int cmp)
 {
-	if (! IsVersionDirectory(candidate))
-		return false;
-	if (!v->version || strlen(v->version) == 0) 
-		return true;
-	switch (v->op) {
+	switch (op) {
 		case GREATER_THAN:
-			return VersionCmp(candidate, v->version) > 0 ? true : false;
+			return cmp > 0 ? true : false;
 		case GREATER_THAN_OR_EQUAL:
-			return VersionCmp(candidate, v->version) >= 0 ? true : false;
+			return cmp >= 0 ? true : false;
 		case EQUAL: 
-			return VersionCmp(candidate, v->version) == 0 ? true : false;
+			return cmp == 0 ? true : false;
 		case NOT_EQUAL: 
-			return VersionCmp(candidate, v->version) != 0 ? true : false;
+			return cmp != 0 ? true : false;
 		case LESS_THAN: 
-			return VersionCmp(candidate, v->version) < 0 ? true : false;
+			return cmp < 0 ? true : false;
 		case LESS_THAN_OR_EQUAL:
-			return VersionCmp(candidate, v->version) <= 0 ? true : false;
+			return cmp <= 0 ? true : false;
 		case NONE:
 			return true;
 		default:
@@ -215,16 +325,45 @@ static bool MatchRule(char *candidate, struct version *v)
 	}
 }
 
+static bool MatchRule(char *candidate, struct version *v)
+{
+	if (! IsVersionDirectory(candidate))
+		return false;
+	if (!v->version || strlen(v->version) == 0) 
+		return true;
+	if (v->op == NONE)
+		return true;
+	return OperatorHolds(v->op, VersionCmp(candidate, v->version));
+}
+
+/* Same as MatchRule(), for a candidate known to be a version directory */
+static bool MatchRuleKey(const struct version_key *candidate, const struct version *v)
+{
+	if (!v->version || v->version[0] == '\0' || v->op == NONE)
+		return true;
+	return OperatorHolds(v->op, VersionKeyCmp(candidate, &v->key));
+}
+
 static bool VersionMatchRange(char *bufversion, struct range *range) 
 {
 	return (MatchRule(bufversion, &range->low) && MatchRule(bufversion, &range->high));
 }
 
-static bool VersionMatchRangeList(char *bufversion, struct list_head *rangelist)
+/* Parses the limits of the ranges once they are final */
+static void PrepareRangeKeys(struct list_head *rangelist)
+{
+	struct range *rangeentry;
+	list_for_each_entry(rangeentry, rangelist, list) {
+		VersionKeyParse(&rangeentry->low.key, rangeentry->low.version ? rangeentry->low.version : "");
+		VersionKeyParse(&rangeentry->high.key, rangeentry->high.version ? rangeentry->high.version : "");
+	}
+}
+
+static bool VersionKeyMatchRangeList(const struct version_key *candidate, struct list_head *rangelist)
 {
 	struct range *rangeentry;
 	list_for_each_entry(rangeentry, rangelist, list) {
-		if (VersionMatchRange(bufversion, rangeentry))
+		if (MatchRuleKey(candidate, &rangeentry->low) && MatchRuleKey(candidate, &rangeentry->high))
 			return true;
 	}
 	return false;
@@ -240,13 +379,6 @@ static struct range *VersionInRangeList(struct version *version, struct list_hea
 	return NULL;
 }
 
-static bool RuleBestThanLatest(char *candidate, char *latest)
-{
-	if (latest[0] == '\0')
-		return true;
-	// If both versions are valid, the more recent one is taken
-	return VersionCmp(candidate, latest) >= 0;
-}
 
 
 static FILE *GetManagerRulesFromAlien(struct parse_data *data, struct search_options *options)
@@ -333,39 +465,6 @@ static char **GetVersionsFromAlien(struct parse_data *data, struct search_option
   return versions;
 }
 
-static bool GetCurrentVersion(struct parse_data *data, struct search_options *options)
-{
-	ssize_t ret;
-	char buf[PATH_MAX], path[PATH_MAX];
-
-    if (strchr(data->depname, ':'))
-    {
-      char **vers = GetVersionsFromAlien(data, options);
-      if (!vers || !vers[0]) {
-        WARN(options, "WARNING: %s is uninstalled Alien\n", data->depname);
-        return false;
-      }
-      strncpy(data->fversion, vers[0], sizeof(data->fversion)-1);
-      data->fversion[sizeof(data->fversion)-1] = 0;
-      {
-        int ii;
-        for (ii = 0; vers[ii]; ++ii) free(vers[ii]);
-        free(vers);
-      }
-      return true;
-    }
-	snprintf(path, sizeof(path)-1, "%s/%s/Current", options->goboPrograms, data->depname);
-	ret = readlink(path, buf, sizeof(buf));
-	if (ret < 0) {
-		WARN(options, "WARNING: %s: %s, ignoring dependency.\n", path, strerror(errno));
-		return false;
-	}
-	buf[ret] = '\0';
-	data->fversion[sizeof(data->fversion)-1] = '\0';
-	strncpy(data->fversion, buf, sizeof(data->fversion)-1);
-	return true;
-}
-
 static inline struct utsname *RunningKernelInfo()
 {
 	static struct utsname *uts = NULL;
@@ -383,40 +482,673 @@ static inline struct utsname *RunningKernelInfo()
 	return uts;
 }
 
-static bool SupportedArchitecture(const char *depname, const char *version, struct search_options *options)
+/* Reads the first @size-1 bytes of @path into @buf, without the trailing newline */
+static bool ReadSmallFile(const char *path, char *buf, size_t size)
 {
-	char arch[PATH_MAX], line[256];
-	struct utsname *uts;
 	ssize_t n;
 	int fd;
 
-	uts = RunningKernelInfo();
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	memset(buf, 0, size);
+	n = read(fd, buf, size-1);
+	close(fd);
+	if (n < 0)
+		return false;
+	if (n > 0 && buf[n-1] == '\n')
+		buf[n-1] = '\0';
+	return true;
+}
+
+/* Reads Resources/Architecture of @depname @version into @arch. Returns false if there is none */
+static bool ReadArchitecture(const char *depname, const char *version, char *arch, size_t size, struct search_options *options)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path)-1, "%s/%s/%s/Resources/Architecture", options->goboPrograms, depname, version);
+	if (! ReadSmallFile(path, arch, size))
+		return false;
+	if (strstr(arch, "i386"))
+		snprintf(arch, size, "i686");
+	return true;
+}
+
+static bool ArchitectureMatches(const char *arch, const char *depname, const char *version, struct search_options *options)
+{
+	struct utsname *uts = RunningKernelInfo();
+
 	if (!uts)
 		return true;
+	if (options->wantedArch)
+		return strcmp(arch, options->wantedArch) == 0 || strcmp(arch, "noarch") == 0;
+	else if (strcmp(arch, uts->machine)) {
+		WARN(options, "WARNING: architecture %s differs from %s, ignoring %s version %s\n",
+				arch, uts->machine, depname, version);
+		return false;
+	}
+	return true;
+}
 
-	snprintf(arch, sizeof(arch)-1, "%s/%s/%s/Resources/Architecture", options->goboPrograms, depname, version);
-	fd = open(arch, O_RDONLY);
-	if (fd < 0)
-		return true;
+static bool SupportedArchitecture(const char *depname, const char *version, struct search_options *options)
+{
+	char arch[256];
 
-	memset(line, 0, sizeof(line));
-	n = read(fd, line, sizeof(line)-1);
-	if (n < 0)
+	if (! RunningKernelInfo())
+		return true;
+	if (! ReadArchitecture(depname, version, arch, sizeof(arch), options))
 		return true;
-	if (line[n-1] == '\n')
-		line[n-1] = '\0';
+	return ArchitectureMatches(arch, depname, version, options);
+}
+
+/*
+ * Catalog of $goboPrograms. For each program it holds the target of Current
+ * and, for each version directory, its Resources/Architecture, its
+ * Resources/Revision and whether it is -Disabled or -failed. It saves
+ * ParseDependencies() from listing program directories and reading metadata
+ * files on every run: a lookup costs a stat() of $goboPrograms/<App>, whose
+ * modification time tells whether the program must be rescanned.
+ *
+ * The file ($catalogDir/Programs.catalog) is mmap()ed and used as is:
+ *   struct catalog_header
+ *   struct catalog_app     apps[numapps]          sorted by name
+ *   struct catalog_version versions[numversions]  grouped by program
+ *   char                   strings[stringsize]    NUL-terminated, offset 0 is ""
+ */
+#define CATALOG_MAGIC    "GoboCat"
+#define CATALOG_VERSION  2
+#define CATALOG_FILE     "Programs.catalog"
+
+#define CATALOG_DISABLED 0x1  // version directory ends in -Disabled
+#define CATALOG_FAILED   0x2  // version directory ends in -failed
+#define CATALOG_HAS_ARCH 0x4  // version has a Resources/Architecture file
+
+struct catalog_header {
+	char magic[8];            // CATALOG_MAGIC
+	uint32_t version;         // CATALOG_VERSION
+	uint32_t programs;        // $goboPrograms this catalog describes
+	int64_t sec, nsec;        // modification time of $goboPrograms when it was scanned
+	uint32_t numapps;         // number of entries in the program table
+	uint32_t numversions;     // number of entries in the version table
+	uint32_t stringsize;      // size of the string table
+	uint32_t reserved;
+};
+
+struct catalog_app {
+	int64_t sec, nsec;        // modification time of $goboPrograms/<name> when it was scanned
+	uint32_t name;            // name of the program directory
+	uint32_t current;         // target of the Current symlink, 0 if there is none
+	uint32_t first;           // index of its first version
+	uint32_t num;             // number of versions
+};
+
+struct catalog_version {
+	uint32_t version;         // name of the version directory
+	uint32_t arch;            // contents of Resources/Architecture
+	uint32_t revision;        // contents of Resources/Revision
+	uint32_t flags;           // CATALOG_* flags
+};
+
+struct catalog {
+	char *data;                              // the catalog, as laid out on disk
+	size_t size;                             // size of data
+	bool mapped;                             // data is mmap()ed rather than malloc()ed
+	const struct catalog_header *header;
+	const struct catalog_app *apps;
+	const struct catalog_version *versions;
+	const char *strings;
+};
+
+/* Used to build a new catalog in memory */
+struct catalog_builder {
+	struct catalog_header header;
+	struct catalog_app *apps;
+	struct catalog_version *versions;
+	char *strings;
+	uint32_t maxapps, maxversions, maxstrings;
+	bool failed;              // ran out of memory?
+};
+
+static struct catalog *catalog = NULL;
+static char *catalogUnusable = NULL;  // $goboPrograms whose catalog can neither be loaded nor saved
+static pthread_mutex_t catalogLock = PTHREAD_MUTEX_INITIALIZER;  // taken around lookups, which may replace the catalog
+
+static const struct catalog_app *CatalogFind(const struct catalog *cat, const char *name)
+{
+	int low = 0, high = (int) cat->header->numapps - 1;
+
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		int cmp = strcmp(name, cat->strings + cat->apps[mid].name);
+		if (cmp == 0)
+			return &cat->apps[mid];
+		if (cmp < 0)
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+	return NULL;
+}
+
+static void CatalogFree(struct catalog *cat)
+{
+	if (! cat)
+		return;
+	if (cat->mapped)
+		munmap(cat->data, cat->size);
+	else
+		free(cat->data);
+	free(cat);
+}
+
+/* Points the tables of @cat at its data, checking that they are consistent */
+static bool CatalogSetup(struct catalog *cat, struct search_options *options)
+{
+	const struct catalog_header *hdr = (const struct catalog_header *) cat->data;
+	uint32_t i;
+
+	if (cat->size < sizeof(*hdr) || memcmp(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic)) ||
+		hdr->version != CATALOG_VERSION || hdr->stringsize == 0 ||
+		cat->size != sizeof(*hdr) + (uint64_t) hdr->numapps * sizeof(struct catalog_app) +
+			(uint64_t) hdr->numversions * sizeof(struct catalog_version) + hdr->stringsize)
+		return false;
+	cat->header = hdr;
+	cat->apps = (const struct catalog_app *) (cat->data + sizeof(*hdr));
+	cat->versions = (const struct catalog_version *) &cat->apps[hdr->numapps];
+	cat->strings = (const char *) &cat->versions[hdr->numversions];
+	if (cat->strings[hdr->stringsize-1] != '\0' || hdr->programs >= hdr->stringsize ||
+		strcmp(cat->strings + hdr->programs, options->goboPrograms))
+		return false;
+	for (i=0; i<hdr->numapps; i++) {
+		const struct catalog_app *app = &cat->apps[i];
+		if (app->name >= hdr->stringsize || app->current >= hdr->stringsize ||
+			(uint64_t) app->first + app->num > hdr->numversions)
+			return false;
+	}
+	for (i=0; i<hdr->numversions; i++) {
+		const struct catalog_version *v = &cat->versions[i];
+		if (v->version >= hdr->stringsize || v->arch >= hdr->stringsize || v->revision >= hdr->stringsize)
+			return false;
+	}
+	return true;
+}
+
+static struct catalog *CatalogLoad(struct search_options *options)
+{
+	struct catalog *cat;
+	struct stat statbuf;
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path)-1, "%s/%s", options->catalogDir, CATALOG_FILE);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	/* Only trust catalogs written with our own privileges */
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_uid != geteuid() || statbuf.st_size < (off_t) sizeof(struct catalog_header)) {
+		close(fd);
+		return NULL;
+	}
+	cat = calloc(1, sizeof(struct catalog));
+	if (! cat) {
+		close(fd);
+		return NULL;
+	}
+	cat->size = statbuf.st_size;
+	cat->data = mmap(NULL, cat->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	cat->mapped = true;
 	close(fd);
+	if (cat->data == MAP_FAILED) {
+		free(cat);
+		return NULL;
+	}
+	if (! CatalogSetup(cat, options)) {
+		CatalogFree(cat);
+		return NULL;
+	}
+	return cat;
+}
+
+static void CatalogSave(const struct catalog *cat, struct search_options *options)
+{
+	char path[PATH_MAX], tmppath[PATH_MAX+8];
+	ssize_t n;
+	int fd;
 
-	if (strstr(line, "i386"))
-		sprintf(line, "i686");
+	mkdir(options->catalogDir, 0755);
+	snprintf(path, sizeof(path)-1, "%s/%s", options->catalogDir, CATALOG_FILE);
+	snprintf(tmppath, sizeof(tmppath)-1, "%s.XXXXXX", path);
+	fd = mkstemp(tmppath);
+	if (fd < 0)
+		return;
+	fchmod(fd, 0644);
+	n = write(fd, cat->data, cat->size);
+	if (close(fd) != 0 || n != (ssize_t) cat->size || rename(tmppath, path) < 0)
+		unlink(tmppath);
+}
 
-	if (options->wantedArch)
-		return strcmp(line, options->wantedArch) == 0 || strcmp(line, "noarch") == 0;
-	else if (strcmp(line, uts->machine)) {
-		WARN(options, "WARNING: architecture %s differs from %s, ignoring %s version %s\n",
-				line, uts->machine, depname, version);
+static uint32_t BuilderAddString(struct catalog_builder *b, const char *str)
+{
+	size_t len = str ? strlen(str) : 0;
+	uint32_t offset;
+
+	if (len == 0 || b->failed)
+		return 0;
+	if (b->header.stringsize + len + 1 > b->maxstrings) {
+		uint32_t max = (b->maxstrings + len + 1) * 2;
+		char *strings = realloc(b->strings, max);
+		if (! strings) {
+			b->failed = true;
+			return 0;
+		}
+		b->strings = strings;
+		b->maxstrings = max;
+	}
+	offset = b->header.stringsize;
+	memcpy(b->strings + offset, str, len + 1);
+	b->header.stringsize += len + 1;
+	return offset;
+}
+
+static struct catalog_app *BuilderAddApp(struct catalog_builder *b, const char *name, int64_t sec, int64_t nsec)
+{
+	struct catalog_app *app;
+
+	if (b->failed)
+		return NULL;
+	if (b->header.numapps == b->maxapps) {
+		uint32_t max = b->maxapps ? b->maxapps * 2 : 256;
+		struct catalog_app *apps = realloc(b->apps, max * sizeof(struct catalog_app));
+		if (! apps) {
+			b->failed = true;
+			return NULL;
+		}
+		b->apps = apps;
+		b->maxapps = max;
+	}
+	app = &b->apps[b->header.numapps];
+	memset(app, 0, sizeof(*app));
+	app->sec = sec;
+	app->nsec = nsec;
+	app->name = BuilderAddString(b, name);
+	app->first = b->header.numversions;
+	if (b->failed)
+		return NULL;
+	b->header.numapps++;
+	return app;
+}
+
+/* Adds a version to the program added last */
+static void BuilderAddVersion(struct catalog_builder *b, const char *version, const char *arch, const char *revision, uint32_t flags)
+{
+	struct catalog_version *v;
+
+	if (b->failed || b->header.numapps == 0)
+		return;
+	if (b->header.numversions == b->maxversions) {
+		uint32_t max = b->maxversions ? b->maxversions * 2 : 1024;
+		struct catalog_version *versions = realloc(b->versions, max * sizeof(struct catalog_version));
+		if (! versions) {
+			b->failed = true;
+			return;
+		}
+		b->versions = versions;
+		b->maxversions = max;
+	}
+	v = &b->versions[b->header.numversions];
+	v->version = BuilderAddString(b, version);
+	v->arch = BuilderAddString(b, arch);
+	v->revision = BuilderAddString(b, revision);
+	v->flags = flags;
+	if (b->failed)
+		return;
+	b->header.numversions++;
+	b->apps[b->header.numapps-1].num++;
+}
+
+/* Copies the entry of a program that has not changed from @cat */
+static void BuilderCopyApp(struct catalog_builder *b, const struct catalog *cat, const struct catalog_app *app)
+{
+	struct catalog_app *copy = BuilderAddApp(b, cat->strings + app->name, app->sec, app->nsec);
+	uint32_t i;
+
+	if (! copy)
+		return;
+	copy->current = BuilderAddString(b, cat->strings + app->current);
+	for (i=app->first; i<app->first+app->num; i++) {
+		const struct catalog_version *v = &cat->versions[i];
+		BuilderAddVersion(b, cat->strings + v->version, cat->strings + v->arch, cat->strings + v->revision, v->flags);
+	}
+}
+
+/* Scans $goboPrograms/<name>, whose stat() is @statbuf */
+static void BuilderScanApp(struct catalog_builder *b, struct search_options *options, const char *name, const struct stat *statbuf)
+{
+	char path[PATH_MAX], target[PATH_MAX], arch[256], revision[256];
+	struct catalog_app *app;
+	struct dirent *entry;
+	struct stat vstat;
+	uint32_t flags;
+	ssize_t len;
+	DIR *dp;
+
+	app = BuilderAddApp(b, name, statbuf->st_mtim.tv_sec, statbuf->st_mtim.tv_nsec);
+	if (! app)
+		return;
+	snprintf(path, sizeof(path)-1, "%s/%s/Current", options->goboPrograms, name);
+	len = readlink(path, target, sizeof(target)-1);
+	if (len > 0) {
+		target[len] = '\0';
+		app->current = BuilderAddString(b, target);
+	}
+
+	snprintf(path, sizeof(path)-1, "%s/%s", options->goboPrograms, name);
+	dp = opendir(path);
+	if (! dp)
+		return;
+	while ((entry = readdir(dp))) {
+		if (entry->d_name[0] == '.' ||
+			! strcmp(entry->d_name, "Current") ||
+			! strcmp(entry->d_name, "Settings") ||
+			! strcmp(entry->d_name, "Variable") ||
+			! strcmp(entry->d_name, "Headers"))
+			continue;
+		snprintf(path, sizeof(path)-1, "%s/%s/%s", options->goboPrograms, name, entry->d_name);
+		if (stat(path, &vstat) < 0 || ! S_ISDIR(vstat.st_mode))
+			continue;
+		flags = 0;
+		if (StringEndsWith(entry->d_name, "-Disabled"))
+			flags |= CATALOG_DISABLED;
+		if (StringEndsWith(entry->d_name, "-failed"))
+			flags |= CATALOG_FAILED;
+		if (ReadArchitecture(name, entry->d_name, arch, sizeof(arch), options))
+			flags |= CATALOG_HAS_ARCH;
+		else
+			arch[0] = '\0';
+		snprintf(path, sizeof(path)-1, "%s/%s/%s/Resources/Revision", options->goboPrograms, name, entry->d_name);
+		if (! ReadSmallFile(path, revision, sizeof(revision)))
+			revision[0] = '\0';
+		BuilderAddVersion(b, entry->d_name, arch, strip(revision), flags);
+	}
+	closedir(dp);
+}
+
+static struct catalog *BuilderFinish(struct catalog_builder *b, struct search_options *options)
+{
+	size_t appsize = b->header.numapps * sizeof(struct catalog_app);
+	size_t versize = b->header.numversions * sizeof(struct catalog_version);
+	struct catalog *cat = NULL;
+
+	if (! b->failed)
+		cat = calloc(1, sizeof(struct catalog));
+	if (cat) {
+		cat->size = sizeof(b->header) + appsize + versize + b->header.stringsize;
+		cat->data = malloc(cat->size);
+	}
+	if (cat && cat->data) {
+		memcpy(cat->data, &b->header, sizeof(b->header));
+		memcpy(cat->data + sizeof(b->header), b->apps, appsize);
+		memcpy(cat->data + sizeof(b->header) + appsize, b->versions, versize);
+		memcpy(cat->data + sizeof(b->header) + appsize + versize, b->strings, b->header.stringsize);
+		if (! CatalogSetup(cat, options)) {
+			CatalogFree(cat);
+			cat = NULL;
+		}
+	} else if (cat) {
+		free(cat);
+		cat = NULL;
+	}
+	free(b->apps);
+	free(b->versions);
+	free(b->strings);
+	return cat;
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Builds a new catalog out of @old. Only the program @onlyapp is rescanned
+ * if it is given; otherwise all of $goboPrograms is listed again and the
+ * programs whose modification time changed are rescanned. Sets @changed if
+ * the result differs from @old.
+ */
+static struct catalog *CatalogRebuild(const struct catalog *old, struct search_options *options, const char *onlyapp, bool *changed)
+{
+	struct catalog_builder builder;
+	const struct catalog_app *app;
+	struct stat statbuf, appstat;
+	char path[PATH_MAX], **names = NULL;
+	struct dirent *entry;
+	int i, num = 0;
+	uint32_t j;
+	DIR *dp;
+
+	memset(&builder, 0, sizeof(builder));
+	memcpy(builder.header.magic, CATALOG_MAGIC, sizeof(builder.header.magic));
+	builder.header.version = CATALOG_VERSION;
+	builder.header.stringsize = 1;
+	builder.strings = calloc(1, 1024);
+	builder.maxstrings = 1024;
+	if (! builder.strings)
+		return NULL;
+	builder.header.programs = BuilderAddString(&builder, options->goboPrograms);
+	*changed = old == NULL;
+
+	if (old && onlyapp) {
+		bool added = false;
+		builder.header.sec = old->header->sec;
+		builder.header.nsec = old->header->nsec;
+		snprintf(path, sizeof(path)-1, "%s/%s", options->goboPrograms, onlyapp);
+		bool exists = stat(path, &appstat) == 0 && S_ISDIR(appstat.st_mode);
+		for (j=0; j<old->header->numapps; j++) {
+			int cmp = strcmp(old->strings + old->apps[j].name, onlyapp);
+			if (cmp >= 0 && ! added) {
+				if (exists)
+					BuilderScanApp(&builder, options, onlyapp, &appstat);
+				added = true;
+			}
+			if (cmp != 0)
+				BuilderCopyApp(&builder, old, &old->apps[j]);
+		}
+		if (! added && exists)
+			BuilderScanApp(&builder, options, onlyapp, &appstat);
+		*changed = true;
+		return BuilderFinish(&builder, options);
+	}
+
+	if (stat(options->goboPrograms, &statbuf) < 0 || (dp = opendir(options->goboPrograms)) == NULL) {
+		CatalogFree(BuilderFinish(&builder, options));
+		return NULL;
+	}
+	builder.header.sec = statbuf.st_mtim.tv_sec;
+	builder.header.nsec = statbuf.st_mtim.tv_nsec;
+	if (old && (old->header->sec != builder.header.sec || old->header->nsec != builder.header.nsec))
+		*changed = true;
+	while ((entry = readdir(dp))) {
+		char **newnames;
+		if (! strcmp(entry->d_name, ".") || ! strcmp(entry->d_name, ".."))
+			continue;
+		newnames = realloc(names, (num+1) * sizeof(char *));
+		if (! newnames || ! (newnames[num] = strdup(entry->d_name))) {
+			builder.failed = true;
+			names = newnames ? newnames : names;
+			break;
+		}
+		names = newnames;
+		num++;
+	}
+	closedir(dp);
+	qsort(names, num, sizeof(char *), CompareNames);
+
+	for (i=0; i<num; i++) {
+		snprintf(path, sizeof(path)-1, "%s/%s", options->goboPrograms, names[i]);
+		if (stat(path, &appstat) < 0 || ! S_ISDIR(appstat.st_mode))
+			continue;
+		app = old ? CatalogFind(old, names[i]) : NULL;
+		if (app && app->sec == appstat.st_mtim.tv_sec && app->nsec == appstat.st_mtim.tv_nsec) {
+			BuilderCopyApp(&builder, old, app);
+		} else {
+			BuilderScanApp(&builder, options, names[i], &appstat);
+			*changed = true;
+		}
+	}
+	if (old && builder.header.numapps != old->header->numapps)
+		*changed = true;
+	for (i=0; i<num; i++)
+		free(names[i]);
+	free(names);
+	return BuilderFinish(&builder, options);
+}
+
+/* Replaces the catalog in use by a rebuilt one, saving it if it changed */
+static void UpdateCatalog(struct search_options *options, const char *onlyapp)
+{
+	struct catalog *cat;
+	bool changed;
+
+	cat = CatalogRebuild(catalog, options, onlyapp, &changed);
+	if (! cat)
+		return;
+	if (changed && options->catalogDir)
+		CatalogSave(cat, options);
+	CatalogFree(catalog);
+	catalog = cat;
+}
+
+/*
+ * Returns the catalog of $goboPrograms, or NULL if none is in use. A catalog
+ * that cannot be loaded is only built if it can be saved: building it costs
+ * more than the per-program lookups it saves in a single run.
+ */
+static struct catalog *GetCatalog(struct search_options *options)
+{
+	if (! options->catalogDir || options->repository != LOCAL_PROGRAMS || ! options->goboPrograms)
+		return NULL;
+	if (catalog && ! strcmp(catalog->strings + catalog->header->programs, options->goboPrograms))
+		return catalog;
+	if (catalogUnusable && ! strcmp(catalogUnusable, options->goboPrograms))
+		return NULL;
+	CatalogFree(catalog);
+	catalog = CatalogLoad(options);
+	if (catalog)
+		return catalog;
+	mkdir(options->catalogDir, 0755);
+	if (faccessat(AT_FDCWD, options->catalogDir, W_OK|X_OK, AT_EACCESS) == 0)
+		UpdateCatalog(options, NULL);
+	if (! catalog) {
+		free(catalogUnusable);
+		catalogUnusable = strdup(options->goboPrograms);
+	}
+	return catalog;
+}
+
+/* Brings the list of programs up to date if $goboPrograms was modified */
+static void RefreshCatalog(struct search_options *options)
+{
+	struct stat statbuf;
+
+	if (catalog && stat(options->goboPrograms, &statbuf) == 0 &&
+		(statbuf.st_mtim.tv_sec != catalog->header->sec || statbuf.st_mtim.tv_nsec != catalog->header->nsec))
+		UpdateCatalog(options, NULL);
+}
+
+/* Returns the entry of @name, rescanning it first if $goboPrograms/<name> changed since */
+static const struct catalog_app *CatalogLookup(struct search_options *options, const char *name)
+{
+	const struct catalog_app *app;
+	struct stat statbuf;
+	char path[PATH_MAX];
+
+	if (! catalog)
+		return NULL;
+	app = CatalogFind(catalog, name);
+	snprintf(path, sizeof(path)-1, "%s/%s", options->goboPrograms, name);
+	if (stat(path, &statbuf) < 0 || ! S_ISDIR(statbuf.st_mode)) {
+		if (app)
+			UpdateCatalog(options, name);
+		return NULL;
+	}
+	if (app && app->sec == statbuf.st_mtim.tv_sec && app->nsec == statbuf.st_mtim.tv_nsec)
+		return app;
+	UpdateCatalog(options, name);
+	return catalog ? CatalogFind(catalog, name) : NULL;
+}
+
+static char **GetVersionsFromCatalog(struct parse_data *data, struct search_options *options)
+{
+	const struct catalog_app *app = CatalogLookup(options, data->depname);
+	char **versions;
+	uint32_t i;
+	int num = 0;
+
+	if (! app) {
+		WARN(options, "WARNING: %s/%s: %s, ignoring dependency.\n", options->goboPrograms, data->depname, strerror(ENOENT));
+		return NULL;
+	}
+	versions = (char **) calloc(app->num+1, sizeof(char*));
+	if (! versions) {
+		perror("malloc");
+		return NULL;
+	}
+	for (i=app->first; i<app->first+app->num; i++) {
+		const struct catalog_version *v = &catalog->versions[i];
+		char *name = (char *) catalog->strings + v->version;
+		if (! IsVersionDirectory(name))
+			continue;
+		if ((v->flags & CATALOG_HAS_ARCH) && ! ArchitectureMatches(catalog->strings + v->arch, data->depname, name, options))
+			continue;
+		versions[num++] = strdup(name);
+	}
+	return versions;
+}
+
+static bool GetCurrentVersion(struct parse_data *data, struct search_options *options)
+{
+	ssize_t ret;
+	char buf[PATH_MAX], path[PATH_MAX];
+
+    if (strchr(data->depname, ':'))
+    {
+      char **vers = GetVersionsFromAlien(data, options);
+      if (!vers || !vers[0]) {
+        WARN(options, "WARNING: %s is uninstalled Alien\n", data->depname);
+        return false;
+      }
+      strncpy(data->fversion, vers[0], sizeof(data->fversion)-1);
+      data->fversion[sizeof(data->fversion)-1] = 0;
+      {
+        int ii;
+        for (ii = 0; vers[ii]; ++ii) free(vers[ii]);
+        free(vers);
+      }
+      return true;
+    }
+	pthread_mutex_lock(&catalogLock);
+	if (GetCatalog(options)) {
+		const struct catalog_app *app = CatalogLookup(options, data->depname);
+		if (app && app->current) {
+			data->fversion[sizeof(data->fversion)-1] = '\0';
+			strncpy(data->fversion, catalog->strings + app->current, sizeof(data->fversion)-1);
+			pthread_mutex_unlock(&catalogLock);
+			return true;
+		}
+		pthread_mutex_unlock(&catalogLock);
+		WARN(options, "WARNING: %s/%s/Current: %s, ignoring dependency.\n", options->goboPrograms, data->depname, strerror(ENOENT));
 		return false;
 	}
+	pthread_mutex_unlock(&catalogLock);
+	snprintf(path, sizeof(path)-1, "%s/%s/Current", options->goboPrograms, data->depname);
+	ret = readlink(path, buf, sizeof(buf));
+	if (ret < 0) {
+		WARN(options, "WARNING: %s: %s, ignoring dependency.\n", path, strerror(errno));
+		return false;
+	}
+	buf[ret] = '\0';
+	data->fversion[sizeof(data->fversion)-1] = '\0';
+	strncpy(data->fversion, buf, sizeof(data->fversion)-1);
 	return true;
 }
 
@@ -431,6 +1163,14 @@ static char **GetVersionsFromReadDir(struct parse_data *data, struct search_opti
     if (strchr(data->depname, ':'))
       return GetVersionsFromAlien(data, options);
 
+	pthread_mutex_lock(&catalogLock);
+	if (GetCatalog(options)) {
+		versions = GetVersionsFromCatalog(data, options);
+		pthread_mutex_unlock(&catalogLock);
+		return versions;
+	}
+	pthread_mutex_unlock(&catalogLock);
+
 	snprintf(path, sizeof(path)-1, "%s/%s", options->goboPrograms, data->depname);
 	dp = opendir(path);
 	if (! dp) {
@@ -558,6 +1298,7 @@ static char *GetCompatible(struct parse_data *data, struct search_options *optio
 
 	char *dependency_x = NULL;
 	char *is_satisfiable_by = NULL;
+	char *saveptr = NULL;
 
 	if (fp == NULL)
 	{
@@ -566,11 +1307,11 @@ static char *GetCompatible(struct parse_data *data, struct search_options *optio
 	}
 
 	while ((read = getline(&line, &len, fp)) != -1) {
-		dependency_x = strip(strtok(line, ":"));
+		dependency_x = strip(strtok_r(line, ":", &saveptr));
 		if (dependency_x == NULL) {
 			continue;
 		}
-		is_satisfiable_by = strip(strtok(NULL, ":"));
+		is_satisfiable_by = strip(strtok_r(NULL, ":", &saveptr));
 		if (is_satisfiable_by == NULL) {
 			continue;
 		}
@@ -619,12 +1360,13 @@ static bool GetBestVersion(struct parse_data *data, struct search_options *optio
 	int i, latestindex = -1;
 	char *entry, **versions = NULL;
 	char latest[NAME_MAX];
+	struct version_key candidatekey, latestkey;
 	char *compatible = GetCompatible(data, options);
-	char *iter = NULL;
+	char *iter = NULL, *saveptr = NULL;
 	char *initial_depname = data->depname;
 
 	/* prefer compatible */
-	iter = strip(strtok(compatible, " "));
+	iter = strip(strtok_r(compatible, " ", &saveptr));
 	while (iter != NULL) 
 	{
 		data->depname = iter;
@@ -634,7 +1376,7 @@ static bool GetBestVersion(struct parse_data *data, struct search_options *optio
 			break;
 		}
 
-		iter = strip(strtok(NULL, " "));
+		iter = strip(strtok_r(NULL, " ", &saveptr));
 	}
 
 
@@ -665,10 +1407,17 @@ static bool GetBestVersion(struct parse_data *data, struct search_options *optio
 	}
 
 	memset(latest, 0, sizeof(latest));
+	PrepareRangeKeys(data->ranges);
 	for (i=0; versions[i]; i++) {
 		entry = versions[i];
-		if (VersionMatchRangeList(entry,data->ranges) && RuleBestThanLatest(entry, latest)) {
+		if (! IsVersionDirectory(entry))
+			continue;
+		VersionKeyParse(&candidatekey, entry);
+		// If both versions are valid, the more recent one is taken
+		if (VersionKeyMatchRangeList(&candidatekey, data->ranges) &&
+			(latest[0] == '\0' || VersionKeyCmp(&candidatekey, &latestkey) >= 0)) {
 			latestindex = i;
+			latestkey = candidatekey;
 			strcpy(latest, entry);
 			strcpy(data->fversion, entry);
 			continue;
@@ -1063,7 +1812,29 @@ struct list_head *ParseDependencies(struct search_options *options)
 
 
 	/* Append other programs if spawning an executable built for a different architecture */
-	if (options->wantedArch && uts && strcmp(options->wantedArch, uts->machine) != 0) {
+	if (options->wantedArch && uts && strcmp(options->wantedArch, uts->machine) != 0 && GetCatalog(options)) {
+		/* Lookups may replace the catalog, so take a copy of the names first */
+		char **names;
+		uint32_t i, num;
+		pthread_mutex_lock(&catalogLock);
+		RefreshCatalog(options);
+		num = catalog ? catalog->header->numapps : 0;
+		names = calloc(num+1, sizeof(char *));
+		for (i=0; names && i<num; i++)
+			names[i] = strdup(catalog->strings + catalog->apps[i].name);
+		pthread_mutex_unlock(&catalogLock);
+		for (i=0; names && i<num; i++) {
+			struct parse_data *data = (struct parse_data*) calloc(1, sizeof(struct parse_data));
+			if (data && names[i]) {
+				data->workbuf = names[i];
+				DoParseDependencies(head, data, options, -1);
+			} else {
+				free(data);
+				free(names[i]);
+			}
+		}
+		free(names);
+	} else if (options->wantedArch && uts && strcmp(options->wantedArch, uts->machine) != 0) {
 		DIR *dp = opendir(options->goboPrograms);
 		struct dirent *entry;
 		while ((entry = readdir(dp))) {
@@ -1091,10 +1862,413 @@ void FreeDependencies(struct list_head **deps)
 	}
 }
 
+/*
+ * Transitive closure of a Dependencies file. Each program picked is itself
+ * expanded through its own Resources/Dependencies, until no new programs show
+ * up. Programs are expanded by a pool of threads; a Dependencies line that was
+ * already resolved by some other program is not resolved again.
+ */
+#define CLOSURE_BUCKETS     1024
+#define CLOSURE_MAX_THREADS 16
+
+struct closure_node {
+	struct closure_node *next;    // next node on the same hash bucket
+	struct closure_node *queued;  // next node waiting to be expanded
+	char *path;                   // $goboPrograms/Name/Version or #Alien=Version
+	char **children;              // dependencies of this node, in the order they are listed
+	int numchildren;
+	int state;                    // CLOSURE_* state while sorting
+};
+
+struct closure_memo {
+	struct closure_memo *next;    // next memo on the same hash bucket
+	char *line;                   // Dependencies line, with blanks collapsed
+	char **paths;                 // what that line resolved to
+	int numpaths;
+};
+
+struct closure {
+	struct search_options *options;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct closure_node *nodes[CLOSURE_BUCKETS];
+	struct closure_memo *memo[CLOSURE_BUCKETS];
+	struct closure_node *queue;   // nodes waiting to be expanded
+	struct closure_node *tail;
+	int busy;                     // threads currently expanding a node
+};
+
+enum { CLOSURE_NEW, CLOSURE_VISITING, CLOSURE_DONE };
+
+static unsigned int ClosureHash(const char *str)
+{
+	unsigned int hash = 2166136261u;
+	for (; *str; str++)
+		hash = (hash ^ (unsigned char) *str) * 16777619u;
+	return hash % CLOSURE_BUCKETS;
+}
+
+/* Must be called with closure->lock held */
+static struct closure_node *ClosureNode(struct closure *closure, const char *path, bool *created)
+{
+	unsigned int hash = ClosureHash(path);
+	struct closure_node *node;
+
+	*created = false;
+	for (node = closure->nodes[hash]; node; node = node->next)
+		if (! strcmp(node->path, path))
+			return node;
+	node = (struct closure_node *) calloc(1, sizeof(struct closure_node));
+	if (! node || ! (node->path = strdup(path))) {
+		perror("malloc");
+		free(node);
+		return NULL;
+	}
+	node->next = closure->nodes[hash];
+	closure->nodes[hash] = node;
+	*created = true;
+	return node;
+}
+
+/* Adds a dependency to a node's children, queueing it if it has not been seen before. Must be called with closure->lock held */
+static void ClosureAddChild(struct closure *closure, struct closure_node *parent, const char *path)
+{
+	struct closure_node *child;
+	char **children;
+	bool created;
+	int i;
+
+	for (i=0; i<parent->numchildren; i++)
+		if (! strcmp(parent->children[i], path))
+			return;
+	child = ClosureNode(closure, path, &created);
+	if (! child)
+		return;
+	children = realloc(parent->children, (parent->numchildren+1) * sizeof(char *));
+	if (! children) {
+		perror("realloc");
+		return;
+	}
+	parent->children = children;
+	parent->children[parent->numchildren++] = child->path;
+
+	/* Alien dependencies have no Resources/Dependencies to follow */
+	if (created && child->path[0] != '#') {
+		if (closure->tail)
+			closure->tail->queued = child;
+		else
+			closure->queue = child;
+		closure->tail = child;
+		pthread_cond_signal(&closure->cond);
+	}
+}
+
+static void ClosureFreeMemo(struct closure_memo *memo)
+{
+	int i;
+
+	for (i=0; i<memo->numpaths; i++)
+		free(memo->paths[i]);
+	free(memo->paths);
+	free(memo->line);
+	free(memo);
+}
+
+/* Collapses runs of blanks, so that equivalent lines share the same memo entry */
+static char *ClosureNormalizeLine(const char *line)
+{
+	char *normalized = malloc(strlen(line)+1), *out = normalized;
+
+	if (! normalized)
+		return NULL;
+	for (; *line; line++) {
+		if (isspace((unsigned char) *line)) {
+			if (out != normalized && out[-1] != ' ')
+				*out++ = ' ';
+		} else
+			*out++ = *line;
+	}
+	if (out != normalized && out[-1] == ' ')
+		out--;
+	*out = '\0';
+	return normalized;
+}
+
+/*
+ * Resolves a single Dependencies line, going through the memo first. Lines
+ * filtered by -d resolve differently, so they never reach the memo; the
+ * caller owns the result in that case.
+ */
+static struct closure_memo *ClosureResolveLine(struct closure *closure, struct search_options *options, char *line, int lineno)
+{
+	struct closure_memo *memo = NULL, *other = NULL;
+	struct list_data *entry, *aux;
+	struct list_head head;
+	struct parse_data *data;
+	unsigned int hash = ClosureHash(line);
+	int i;
+
+	if (! options->dependency) {
+		pthread_mutex_lock(&closure->lock);
+		for (memo = closure->memo[hash]; memo; memo = memo->next)
+			if (! strcmp(memo->line, line))
+				break;
+		pthread_mutex_unlock(&closure->lock);
+		if (memo) {
+			free(line);
+			return memo;
+		}
+	}
+
+	memo = (struct closure_memo *) calloc(1, sizeof(struct closure_memo));
+	data = (struct parse_data *) calloc(1, sizeof(struct parse_data));
+	if (! memo || ! data) {
+		perror("malloc");
+		free(memo);
+		free(data);
+		free(line);
+		return NULL;
+	}
+	memo->line = line;
+
+	/* ParseName() tokenizes the work buffer, so hand it a copy of the line */
+	INIT_LIST_HEAD(&head);
+	data->workbuf = strdup(line);
+	if (data->workbuf) {
+		char *workbuf = data->workbuf;
+		DoParseDependencies(&head, data, options, lineno);
+		free(workbuf);
+	} else
+		free(data);
+
+	list_for_each_entry(entry, &head, list)
+		memo->numpaths++;
+	memo->paths = calloc(memo->numpaths+1, sizeof(char *));
+	i = 0;
+	list_for_each_entry_safe(entry, aux, &head, list) {
+		if (memo->paths)
+			memo->paths[i++] = strdup(entry->path);
+		free(entry);
+	}
+	memo->numpaths = memo->paths ? i : 0;
+
+	if (options->dependency)
+		return memo;
+
+	/* Another thread may have resolved the same line in the meantime */
+	pthread_mutex_lock(&closure->lock);
+	for (other = closure->memo[hash]; other; other = other->next)
+		if (! strcmp(other->line, line))
+			break;
+	if (! other) {
+		memo->next = closure->memo[hash];
+		closure->memo[hash] = memo;
+	}
+	pthread_mutex_unlock(&closure->lock);
+	if (other) {
+		ClosureFreeMemo(memo);
+		memo = other;
+	}
+	return memo;
+}
+
+/* Resolves every line of a Dependencies file, recording the results as children of the given node */
+static void ClosureExpand(struct closure *closure, struct search_options *options, struct closure_node *node)
+{
+	char depsfile[PATH_MAX], buf[LINE_MAX];
+	int i, lineno = 0;
+	FILE *fp;
+
+	if (options->depsfile == NULL) {
+		/* Programs without a Dependencies file may still have BuildInformation */
+		snprintf(depsfile, sizeof(depsfile), "%s/Resources/Dependencies", node->path);
+		if (access(depsfile, R_OK) != 0)
+			snprintf(depsfile, sizeof(depsfile), "%s/Resources/BuildInformation", node->path);
+		options->depsfile = depsfile;
+	}
+	fp = fopen(options->depsfile, "r");
+	if (! fp) {
+		/* Not an error: most programs depend on nothing but the base system */
+		options->depsfile = NULL;
+		return;
+	}
+	while (ReadLine(buf, sizeof(buf), fp)) {
+		if (! EmptyLine(buf)) {
+			char *line = ClosureNormalizeLine(buf);
+			struct closure_memo *memo = line ? ClosureResolveLine(closure, options, line, lineno) : NULL;
+			if (memo) {
+				pthread_mutex_lock(&closure->lock);
+				for (i=0; i<memo->numpaths; i++)
+					if (memo->paths[i] && strcmp(memo->paths[i], node->path))
+						ClosureAddChild(closure, node, memo->paths[i]);
+				pthread_mutex_unlock(&closure->lock);
+				if (options->dependency)
+					ClosureFreeMemo(memo);
+			}
+		}
+		lineno++;
+	}
+	fclose(fp);
+	options->depsfile = NULL;
+}
+
+static void *ClosureWorker(void *arg)
+{
+	struct closure *closure = (struct closure *) arg;
+	struct search_options options = *closure->options;
+	struct closure_node *node;
+
+	/* -d applies to the file given by the user, not to the dependencies of what it pulls in */
+	options.dependency = NULL;
+	options.depsfile = NULL;
+
+	pthread_mutex_lock(&closure->lock);
+	while (true) {
+		while (! closure->queue && closure->busy > 0)
+			pthread_cond_wait(&closure->cond, &closure->lock);
+		if (! closure->queue)
+			break;
+		node = closure->queue;
+		closure->queue = node->queued;
+		if (! closure->queue)
+			closure->tail = NULL;
+		closure->busy++;
+		pthread_mutex_unlock(&closure->lock);
+
+		ClosureExpand(closure, &options, node);
+
+		pthread_mutex_lock(&closure->lock);
+		closure->busy--;
+		if (! closure->queue && closure->busy == 0)
+			pthread_cond_broadcast(&closure->cond);
+	}
+	pthread_mutex_unlock(&closure->lock);
+	return NULL;
+}
+
+/* Appends a node after everything it depends on, warning about the edges that close a cycle */
+static void ClosureSort(struct closure *closure, struct closure_node *node, struct list_head *head)
+{
+	struct list_data *ldata;
+	bool created;
+	int i;
+
+	node->state = CLOSURE_VISITING;
+	for (i=0; i<node->numchildren; i++) {
+		struct closure_node *child = ClosureNode(closure, node->children[i], &created);
+		if (! child)
+			continue;
+		if (child->state == CLOSURE_VISITING)
+			WARN(closure->options, "WARNING: %s depends on %s, which closes a dependency cycle; ignoring that dependency.\n", node->path, child->path);
+		else if (child->state == CLOSURE_NEW)
+			ClosureSort(closure, child, head);
+	}
+	node->state = CLOSURE_DONE;
+
+	ldata = (struct list_data *) calloc(1, sizeof(struct list_data));
+	if (! ldata) {
+		perror("malloc");
+		return;
+	}
+	snprintf(ldata->path, sizeof(ldata->path), "%s", node->path);
+	list_add_tail(&ldata->list, head);
+}
+
+static void ClosureFree(struct closure *closure)
+{
+	int i;
+
+	for (i=0; i<CLOSURE_BUCKETS; i++) {
+		while (closure->nodes[i]) {
+			struct closure_node *node = closure->nodes[i];
+			closure->nodes[i] = node->next;
+			free(node->children);
+			free(node->path);
+			free(node);
+		}
+		while (closure->memo[i]) {
+			struct closure_memo *memo = closure->memo[i];
+			closure->memo[i] = memo->next;
+			ClosureFreeMemo(memo);
+		}
+	}
+	pthread_mutex_destroy(&closure->lock);
+	pthread_cond_destroy(&closure->cond);
+}
+
+/*
+ * Like ParseDependencies(), but also brings in the dependencies of each
+ * program picked, recursively. The list is in topological order: every
+ * program comes after the programs it depends on.
+ */
+struct list_head *ParseDependenciesRecursive(struct search_options *options, int threads)
+{
+	pthread_t tids[CLOSURE_MAX_THREADS];
+	struct search_options rootoptions = *options;
+	struct closure_node root = { .path = "" };
+	struct list_head *head;
+	struct closure *closure;
+	int i, started = 0;
+
+	if (options->repository != LOCAL_PROGRAMS) {
+		fprintf(stderr, "Recursive resolution only works with local programs.\n");
+		return NULL;
+	}
+	if (access(options->depsfile, R_OK) != 0) {
+		WARN(options, "WARNING: %s: %s\n", options->depsfile, strerror(errno));
+		return NULL;
+	}
+	head = (struct list_head *) malloc(sizeof(struct list_head));
+	closure = (struct closure *) calloc(1, sizeof(struct closure));
+	if (! head || ! closure) {
+		perror("malloc");
+		free(head);
+		free(closure);
+		return NULL;
+	}
+	INIT_LIST_HEAD(head);
+	closure->options = options;
+	pthread_mutex_init(&closure->lock, NULL);
+	pthread_cond_init(&closure->cond, NULL);
+
+	/* Cache the kernel information before any thread asks for it */
+	RunningKernelInfo();
+
+	/* The file given by the user is expanded first, honoring -d */
+	ClosureExpand(closure, &rootoptions, &root);
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > CLOSURE_MAX_THREADS)
+		threads = CLOSURE_MAX_THREADS;
+	for (i=0; i<threads; i++) {
+		if (pthread_create(&tids[i], NULL, ClosureWorker, closure) != 0)
+			break;
+		started++;
+	}
+	if (started == 0)
+		ClosureWorker(closure);
+	for (i=0; i<started; i++)
+		pthread_join(tids[i], NULL);
+
+	/* Roots are visited in the order they are listed, which keeps the output stable */
+	for (i=0; i<root.numchildren; i++) {
+		bool created;
+		struct closure_node *node = ClosureNode(closure, root.children[i], &created);
+		if (node && node->state == CLOSURE_NEW)
+			ClosureSort(closure, node, head);
+	}
+	free(root.children);
+	ClosureFree(closure);
+	free(closure);
+	return head;
+}
+
 #ifdef BUILD_MAIN
 void usage(char *appname, int retval)
 {
 	fprintf(stderr, "Usage: %s [options] <Dependencies file>\n"
+			"       %s --list=<type> [--catalog=<dir>]\n"
 			"Available options are:\n"
 			"  -d, --dependency=<dep>     Only process dependency 'dep' from the input file\n"
 			"  -r, --repository=<repo>    Specify which repository to use: [local-programs]\n"
@@ -1102,20 +2276,63 @@ void usage(char *appname, int retval)
 			"        local-dir:<path>     look for packages/recipes under <path>\n"
 			"        package-store        look for packages in the package store\n"
 			"        recipe-store)        look for recipes in the recipe store\n"
+			"  -c, --catalog=<dir>        Keep a catalog of local programs under <dir> and resolve from it\n"
+			"  -l, --list=<type>          List local programs from the catalog and exit. <type> is one of:\n"
+			"        installed            every version, as 'Name<TAB>Version<TAB>Revision'\n"
+			"        current              the version Current points to, in the same format\n"
+			"  -R, --recursive            Also resolve the dependencies of each dependency, listing them first\n"
+			"  -j, --jobs=<n>             Resolve up to <n> programs in parallel with --recursive (default: number of CPUs)\n"
 			"  -q, --quiet                Do not warn when a dependency is not found\n"
-			"  -h, --help                 This help\n", appname);
+			"  -h, --help                 This help\n", appname, appname);
 	exit(retval);
 }
 
+/* Prints the programs in the catalog, along with their versions and revisions */
+static bool ListCatalog(struct search_options *options, bool currentOnly)
+{
+	uint32_t i, j;
+
+	/* Revalidate every program, building the catalog in memory if there is no catalog directory */
+	GetCatalog(options);
+	UpdateCatalog(options, NULL);
+	if (! catalog) {
+		fprintf(stderr, "%s: could not build the catalog\n", options->goboPrograms);
+		return false;
+	}
+	for (i=0; i<catalog->header->numapps; i++) {
+		const struct catalog_app *app = &catalog->apps[i];
+		const char *current = catalog->strings + app->current;
+		if (currentOnly && ! app->current)
+			continue;
+		if (strrchr(current, '/'))
+			current = strrchr(current, '/') + 1;
+		for (j=app->first; j<app->first+app->num; j++) {
+			const struct catalog_version *v = &catalog->versions[j];
+			if (currentOnly && strcmp(catalog->strings + v->version, current))
+				continue;
+			printf("%s\t%s\t%s\n", catalog->strings + app->name,
+				catalog->strings + v->version, catalog->strings + v->revision);
+		}
+	}
+	return true;
+}
+
 int main(int argc, char **argv)
 {
 	int c, index;
 	struct list_head *deps;
 	struct search_options options;
-	char shortopts[] = "hqd:r:";
+	const char *list = NULL;
+	bool recursive = false;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	char shortopts[] = "hqRd:r:c:l:j:";
 	struct option longopts[] = {
 		{"dependency",   1, NULL, 'd'},
 		{"repository",   1, NULL, 'r'},
+		{"catalog",      1, NULL, 'c'},
+		{"list",         1, NULL, 'l'},
+		{"recursive",    0, NULL, 'R'},
+		{"jobs",         1, NULL, 'j'},
 		{"quiet",        0, NULL, 'q'},
 		{"help",         0, NULL, 'h'},
 		{0, 0, 0, 0}
@@ -1149,6 +2366,26 @@ int main(int argc, char **argv)
 					usage(argv[0], 1);
 				}
 				break;
+			case 'c':
+				options.catalogDir = optarg;
+				break;
+			case 'l':
+				if (strcmp(optarg, "installed") && strcmp(optarg, "current")) {
+					fprintf(stderr, "Invalid value '%s' for --list.\n", optarg);
+					usage(argv[0], 1);
+				}
+				list = optarg;
+				break;
+			case 'R':
+				recursive = true;
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				if (jobs < 1) {
+					fprintf(stderr, "Invalid value '%s' for --jobs.\n", optarg);
+					usage(argv[0], 1);
+				}
+				break;
 			case 'q':
 				options.quiet = true;
 				break;
@@ -1167,6 +2404,14 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (list) {
+		if (options.repository != LOCAL_PROGRAMS || ! options.goboPrograms) {
+			fprintf(stderr, "--list only works with local programs.\n");
+			return 1;
+		}
+		return ListCatalog(&options, ! strcmp(list, "current")) ? 0 : 1;
+	}
+
 	if (optind >= argc)
 		usage(argv[0], 1);
 
@@ -1174,7 +2419,7 @@ int main(int argc, char **argv)
 		struct list_data *entry;
 		options.depsfile = argv[optind++];
 		//printf("*** %s ***\n", options.depsfile);
-		deps = ParseDependencies(&options);
+		deps = recursive ? ParseDependenciesRecursive(&options, jobs) : ParseDependencies(&options);
 		if (!deps || list_empty(deps))
 			continue;
 		list_for_each_entry(entry, deps, list) {
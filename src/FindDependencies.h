@@ -20,10 +20,27 @@ typedef enum {
 	RECIPE_STORE,
 } repository_t;
 
+#define VERSION_KEY_SEGMENTS 16
+
+// Version split at its dots, so that it can be compared without being parsed again
+struct version_key {
+	const char *source;     // version this key was parsed from
+	bool exact;             // false if comparisons must go through the string itself
+	bool alphastart;        // starts with a letter?
+	unsigned char numsegs;  // number of entries in seg
+	struct {
+		int num;            // atoi() of the segment
+		int rev;            // atoi() of what follows "-x" in the segment, 0 if there is no dash
+		short alpha;        // offset of the first letter at or after the segment, -1 if none
+		unsigned char flags;
+	} seg[VERSION_KEY_SEGMENTS];
+};
+
 struct version {
 	struct list_head list;  // link to the list on which we're inserted
 	char *version;          // version as listed in Resources/Dependencies
 	operator_t op;          // one of the operators listed above
+	struct version_key key; // parsed version, valid once the ranges are final
 };
 
 struct parse_data {
@@ -56,10 +73,12 @@ struct search_options {
 	const char *depsfile;
 	const char *searchdir;
 	const char *goboPrograms;
+	const char *catalogDir;     // where the catalog of goboPrograms is kept, or NULL
 };
 
 // Function prototypes
 struct list_head *ParseDependencies(struct search_options *options);
+struct list_head *ParseDependenciesRecursive(struct search_options *options, int threads);
 void FreeDependencies(struct list_head **deps);
 
 #endif /* __FIND_DEPENDENCIES_H */
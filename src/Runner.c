@@ -31,6 +31,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <dirent.h>
 #include <getopt.h>
 #include <limits.h>
@@ -38,24 +39,66 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <linux/version.h>
 #include <sys/utsname.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>   /* SYS_fsopen() and friends */
 #include <sys/statfs.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/time.h>      /* getrlimit() */
 #include <sys/resource.h>  /* getrlimit() */
+#include <sys/file.h>      /* flock() */
+#include <sys/prctl.h>     /* prctl() */
+#include <sys/fsuid.h>     /* setfsuid() */
+#include <sys/mman.h>      /* mmap() */
+#include <pthread.h>
 #include <time.h>
 #include <ftw.h>
+#include <mntent.h>
 #include <elf.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <linux/magic.h>   /* OVERLAYFS_SUPER_MAGIC */
+
+/* The new mount API (Linux 5.2) is only declared by glibc 2.36 onwards */
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC          0x00000001
+#define FSMOUNT_CLOEXEC         0x00000001
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#define FSCONFIG_SET_FLAG       0
+#define FSCONFIG_SET_STRING     1
+#define FSCONFIG_CMD_CREATE     6
+#endif
+
+#if defined(__has_include) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>   /* IORING_OP_STATX */
+#define HAVE_IO_URING
+#endif
 
 #include "LinuxList.h"
 #include "FindDependencies.h"
 
 #define GOBO_INDEX_DIR    "/System/Index"
 #define GOBO_PROGRAMS_DIR "/Programs"
+#define GOBO_RUNNER_CACHE_DIR   "/System/Variable/cache/Runner"
+#define GOBO_BASH_DEPENDENCIES  "/Programs/Bash/Current/Resources/Dependencies"
+#define GOBO_COMPATIBILITY_LIST "/System/Settings/Scripts/CompatibilityList"
+#define GOBO_RUNNER_RUN_DIR     "/System/Variable/run/Runner"
+#define GOBO_RUNNER_SOCKET      GOBO_RUNNER_RUN_DIR "/runnerd.socket"
+#define GOBO_RUNNER_TMPFS_DIR   GOBO_RUNNER_RUN_DIR "/tmpfs"
+#define GOBO_LD_SO_CACHE        "/etc/ld.so.cache"
+#define RUNNER_TMPFS_SIZE       "512m"
+#define RUNNER_MAX_CLOSURE_ENV  65536    /* Larger closures are not exported to RunnerRedirect */
+#define RUNNERD_POOL_SIZE       16
+#define RUNNERD_MAX_REQUEST     (1024*1024)
+#define RUNNERD_REQUEST_TIMEOUT 2000  /* ms a client has to send its whole request */
+#define RUNNER_CACHE_MAX_ENTRIES 256     /* Of each kind in GOBO_RUNNER_CACHE_DIR */
+#define RUNNER_CACHE_MIN_AGE    (24*60*60) /* Seconds an entry is kept after its last use */
 #define OVERLAYFS_MAGIC   0x794c7630
 
 #define debug_printf(msg...)   if (args.debug) fprintf(stderr, msg)
@@ -90,6 +133,34 @@
 #define ERR_MNT_WRITEDIR      6      /* Error creating write directory */
 #define ERR_BAD_ARGS          7      /* Bad arguments */
 #define ERR_WRAPPER           8      /* Error creating wrapper */
+#define ERR_CGROUP            9      /* Error creating cgroup */
+
+/* Options without a short form */
+#define OPT_PROFILE           0x100
+#define OPT_LAYER             0x101
+#define OPT_DISCARD_LAYER     0x102
+#define OPT_CGROUP            0x103
+#define OPT_CPU_WEIGHT        0x104
+#define OPT_IO_WEIGHT         0x105
+#define OPT_MEMORY_HIGH       0x106
+#define OPT_PIDS_MAX          0x107
+#define OPT_PREFETCH          0x108
+#define OPT_MINIMAL           0x109
+#define OPT_LDCACHE           0x10a
+#define OPT_TRACE_ACCESS      0x10b
+
+/* Limits applied to the sandbox's cgroup, see cgroup_files[] */
+enum {
+	CGROUP_CPU_WEIGHT,
+	CGROUP_IO_WEIGHT,
+	CGROUP_MEMORY_HIGH,
+	CGROUP_PIDS_MAX,
+	CGROUP_MAX
+};
+
+static const char *cgroup_files[CGROUP_MAX] = {
+	"cpu.weight", "io.weight", "memory.high", "pids.max"
+};
 
 struct runner_args {
 	const char *executable;    /* Executable to run */
@@ -106,17 +177,292 @@ struct runner_args {
 	bool sourceenv;            /* Source ENV at Resources/Environment? */
 	bool cleanup;              /* Cleanup work directory on exit? */
 	bool removedeps;           /* Remove conflicting dependencies from /System/Index? */
+	bool cache;                /* Use the persistent cache of resolved overlays? */
+	bool envsnapshot;          /* Apply a cached snapshot of Resources/Environment instead of a wrapper? */
+	bool daemon;               /* Run as runnerd, the namespace pool daemon? */
+	bool pooled;               /* Running in a namespace handed out by runnerd? */
+	int pool_size;             /* Maximum number of namespaces pooled by runnerd */
+	const char *tmpfs;         /* Size of the tmpfs holding the layers, or NULL to use $HOME */
+	const char *profile;       /* Where to write the per-phase profile ("-" for stderr), or NULL */
+	bool flatten;              /* Merge the dependencies into a cached symlink farm? */
+	bool userns;               /* Use an unprivileged user namespace instead of the suid bit? */
+	const char *layer;         /* Name of the persistent write layer to use, or NULL */
+	const char *discard_layer; /* Name of the persistent write layer to delete, or NULL */
+	bool cgroup;               /* Run the program in a cgroup of its own? */
+	const char *cgroup_limits[CGROUP_MAX]; /* Values given on the command line, or NULL */
+	bool prefetch;             /* Read the executable and its libraries ahead of exec()? */
+	bool minimal;              /* Only mount the library layers the executable needs? */
+	bool ldcache;              /* Bind-mount an ld.so.cache of the closure over /etc/ld.so.cache? */
+	bool ldcache_mounted;      /* Was it mounted? Then LD_LIBRARY_PATH is left alone */
+	const char *trace_access;  /* Where to write the access trace report ("-" for stderr), or NULL */
 
 	char *wrapper;             /* Wrapper file */
 	char *workdir;             /* Base work directory */
 	char *upperlayer;          /* Overlayfs' upper layer */
 	char *writelayer;          /* Overlayfs' write layer */
+	char *cgroupdir;           /* The program's cgroup */
+	char *programdir;          /* Program directory of the executable (kept for --trace-access) */
+	char *depsfile;            /* Its Resources/Dependencies file (kept for --trace-access) */
 };
 static struct runner_args args;
 
 static char *
 open_program_file(const char *programdir, const char *path);
 
+static int
+append_cache_stamp(char **key, const char *path);
+
+void
+cleanup_directory(const char *layername, char *dirname);
+
+static bool
+remove_directory_at(int parentfd, const char *name);
+
+/*
+ * Per-phase latency profiler. Phases are always timed, as that is cheap;
+ * the report is only emitted with --profile or $GOBOLINUX_RUNNER_PROFILE.
+ */
+#define PROFILE_MAX_PHASES 64
+#define PROFILE_MAX_DEPTH  8
+
+enum {
+	SYSCALL_STAT,
+	SYSCALL_OPEN,
+	SYSCALL_READDIR,
+	SYSCALL_READLINK,
+	SYSCALL_MOUNT,
+	SYSCALL_MKDIR,
+	SYSCALL_UNLINK,
+	SYSCALL_MAX
+};
+
+static const char *syscall_names[SYSCALL_MAX] = {
+	"stat", "open", "readdir", "readlink", "mount", "mkdir", "unlink"
+};
+
+/*
+ * Updated with relaxed atomics: the probe pool and the --prefetch/--trace-access
+ * threads make wrapped calls too, and are charged to the main thread's phase.
+ */
+static unsigned long syscall_count[SYSCALL_MAX];
+
+struct profile_phase {
+	char name[32];                         /* Phase name */
+	struct timespec start;                 /* Monotonic timestamp at its start */
+	long duration_us;                      /* Duration, or -1 if still running */
+	unsigned long syscalls[SYSCALL_MAX];   /* Syscalls made during the phase */
+};
+
+static struct {
+	struct timespec start;
+	struct profile_phase phases[PROFILE_MAX_PHASES];
+	int count;
+	int stack[PROFILE_MAX_DEPTH];
+	int depth;
+	int skipped;    /* Innermost phases that did not fit, ended before the ones on the stack */
+} profile;
+
+/* Resource usage of the program's cgroup, or -1 if unknown */
+static struct {
+	long long usage_usec;
+	long long user_usec;
+	long long system_usec;
+	long long memory_peak;
+} cgroup_usage = { -1, -1, -1, -1 };
+
+#ifdef RUNNER_WRAP_SYSCALLS
+/*
+ * Syscall counters. The Makefile links Runner with -Wl,--wrap=<fn> for each
+ * of these, so calls made by FindDependencies.c are accounted for as well.
+ */
+#define WRAP_SYSCALL(type, fn, counter, params, arglist) \
+	type __real_##fn params; \
+	type __wrap_##fn params { \
+		__atomic_fetch_add(&syscall_count[counter], 1, __ATOMIC_RELAXED); \
+		return __real_##fn arglist; \
+	}
+
+/* open() and openat() only take a mode argument along with O_CREAT/O_TMPFILE */
+#define WRAP_SYSCALL_MODE(fn, counter, flags) \
+	mode_t mode = 0; \
+	if (flags & (O_CREAT|O_TMPFILE)) { \
+		va_list ap; \
+		va_start(ap, flags); \
+		mode = va_arg(ap, mode_t); \
+		va_end(ap); \
+	} \
+	__atomic_fetch_add(&syscall_count[counter], 1, __ATOMIC_RELAXED)
+
+int __real_open(const char *p, int flags, ...);
+int __wrap_open(const char *p, int flags, ...)
+{
+	WRAP_SYSCALL_MODE(open, SYSCALL_OPEN, flags);
+	return __real_open(p, flags, mode);
+}
+
+int __real_openat(int d, const char *p, int flags, ...);
+int __wrap_openat(int d, const char *p, int flags, ...)
+{
+	WRAP_SYSCALL_MODE(openat, SYSCALL_OPEN, flags);
+	return __real_openat(d, p, flags, mode);
+}
+
+WRAP_SYSCALL(int, stat, SYSCALL_STAT, (const char *p, struct stat *b), (p, b))
+WRAP_SYSCALL(int, lstat, SYSCALL_STAT, (const char *p, struct stat *b), (p, b))
+WRAP_SYSCALL(int, fstatat, SYSCALL_STAT, (int d, const char *p, struct stat *b, int f), (d, p, b, f))
+WRAP_SYSCALL(int, statx, SYSCALL_STAT, (int d, const char *p, int f, unsigned int m, struct statx *b), (d, p, f, m, b))
+WRAP_SYSCALL(DIR *, opendir, SYSCALL_OPEN, (const char *p), (p))
+WRAP_SYSCALL(struct dirent *, readdir, SYSCALL_READDIR, (DIR *dp), (dp))
+WRAP_SYSCALL(ssize_t, readlink, SYSCALL_READLINK, (const char *p, char *b, size_t n), (p, b, n))
+WRAP_SYSCALL(ssize_t, readlinkat, SYSCALL_READLINK, (int d, const char *p, char *b, size_t n), (d, p, b, n))
+WRAP_SYSCALL(int, mount, SYSCALL_MOUNT, (const char *s, const char *t, const char *f, unsigned long m, const void *d), (s, t, f, m, d))
+WRAP_SYSCALL(int, umount, SYSCALL_MOUNT, (const char *t), (t))
+WRAP_SYSCALL(int, mkdir, SYSCALL_MKDIR, (const char *p, mode_t m), (p, m))
+WRAP_SYSCALL(int, unlink, SYSCALL_UNLINK, (const char *p), (p))
+WRAP_SYSCALL(int, unlinkat, SYSCALL_UNLINK, (int d, const char *p, int f), (d, p, f))
+WRAP_SYSCALL(int, rmdir, SYSCALL_UNLINK, (const char *p), (p))
+#endif /* RUNNER_WRAP_SYSCALLS */
+
+static long
+elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000L;
+}
+
+/**
+ * Marks the beginning of a phase. Phases may nest.
+ */
+static void
+profile_begin(const char *fmt, ...)
+{
+	struct profile_phase *phase;
+	va_list ap;
+	int i;
+
+	if (profile.skipped || profile.count == PROFILE_MAX_PHASES || profile.depth == PROFILE_MAX_DEPTH) {
+		/* Its profile_end() must not close the enclosing phase */
+		profile.skipped++;
+		return;
+	}
+	phase = &profile.phases[profile.count];
+	va_start(ap, fmt);
+	vsnprintf(phase->name, sizeof(phase->name), fmt, ap);
+	va_end(ap);
+	phase->duration_us = -1;
+	for (i=0; i<SYSCALL_MAX; ++i)
+		phase->syscalls[i] = __atomic_load_n(&syscall_count[i], __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &phase->start);
+	profile.stack[profile.depth++] = profile.count++;
+}
+
+/**
+ * Marks the end of the innermost running phase.
+ */
+static void
+profile_end(void)
+{
+	struct profile_phase *phase;
+	struct timespec now;
+	int i;
+
+	if (profile.skipped) {
+		profile.skipped--;
+		return;
+	}
+	if (profile.depth == 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	phase = &profile.phases[profile.stack[--profile.depth]];
+	phase->duration_us = elapsed_us(&phase->start, &now);
+	for (i=0; i<SYSCALL_MAX; ++i)
+		phase->syscalls[i] = __atomic_load_n(&syscall_count[i], __ATOMIC_RELAXED) - phase->syscalls[i];
+}
+
+static void
+json_print_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; str && *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+/**
+ * Writes a report to stderr if @dest is "-", or appends it to the file @dest.
+ */
+static void
+write_report(const char *dest, const char *data, size_t len)
+{
+	uid_t euid;
+	int fd;
+
+	if (! strcmp(dest, "-")) {
+		fwrite(data, 1, len, stderr);
+		return;
+	}
+	/* Runner is setuid: open the report file with the caller's credentials */
+	euid = geteuid();
+	if (seteuid(getuid()) < 0)
+		return;
+	fd = open(dest, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, data, len) < 0)
+		perror(dest);
+	if (fd >= 0)
+		close(fd);
+	seteuid(euid);
+}
+
+/**
+ * Emits the profile of this launch as a single JSON line, either to stderr
+ * or appended to the file given by --profile=FILE/$GOBOLINUX_RUNNER_PROFILE.
+ * Syscall counts cover every thread, which "syscalls_scope" states explicitly.
+ */
+static void
+profile_report(int exit_status)
+{
+	struct timespec now;
+	char *line = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int i, j;
+
+	if (! args.profile)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fp = open_memstream(&line, &len);
+	if (! fp)
+		return;
+	fprintf(fp, "{\"executable\":");
+	json_print_string(fp, args.executable);
+	fprintf(fp, ",\"pid\":%d,\"exit_status\":%d,\"total_us\":%ld,\"syscalls_scope\":\"all_threads\",\"phases\":[",
+		getpid(), exit_status, elapsed_us(&profile.start, &now));
+	for (i=0; i<profile.count; ++i) {
+		struct profile_phase *phase = &profile.phases[i];
+		fprintf(fp, "%s{\"name\":", i ? "," : "");
+		json_print_string(fp, phase->name);
+		fprintf(fp, ",\"start_us\":%ld,\"duration_us\":%ld,\"syscalls\":{",
+			elapsed_us(&profile.start, &phase->start), phase->duration_us);
+		for (j=0; j<SYSCALL_MAX; ++j)
+			fprintf(fp, "%s\"%s\":%lu", j ? "," : "", syscall_names[j], phase->syscalls[j]);
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "]");
+	if (args.cgroupdir)
+		fprintf(fp, ",\"cgroup\":{\"usage_usec\":%lld,\"user_usec\":%lld,\"system_usec\":%lld,\"memory_peak\":%lld}",
+			cgroup_usage.usage_usec, cgroup_usage.user_usec, cgroup_usage.system_usec, cgroup_usage.memory_peak);
+	fprintf(fp, "}\n");
+	fclose(fp);
+
+	write_report(args.profile, line, len);
+	free(line);
+}
+
 /**
  * compare_kernel_versions:
  *
@@ -282,16 +628,40 @@ which(const char *executable)
 	return NULL;
 }
 
+/**
+ * Opens the shared object or executable @path for reading, unless it is not
+ * a regular file: a FIFO or a device found through $PATH, $LD_LIBRARY_PATH or
+ * DT_RUNPATH must neither block nor be read.
+ * @return A file descriptor, with @statbuf filled, or -1.
+ */
+static int
+open_object_file(const char *path, struct stat *statbuf)
+{
+	int fd = open(path, O_RDONLY|O_CLOEXEC|O_NONBLOCK);
+
+	if (fd >= 0 && (fstat(fd, statbuf) < 0 || ! S_ISREG(statbuf->st_mode))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 char *
 get_interpreter_name(const char *executable)
 {
 	char buf[128], *start;
+	struct stat statbuf;
 	size_t n, i;
 	FILE *fp;
+	int fd;
 
-	fp = fopen(executable, "r");
-	if (fp == NULL)
+	fd = open_object_file(executable, &statbuf);
+	fp = fd >= 0 ? fdopen(fd, "r") : NULL;
+	if (fp == NULL) {
+		if (fd >= 0)
+			close(fd);
 		return NULL;
+	}
 
 	/* Try to read the first few bytes of the file */
 	n = fread(buf, sizeof(char), sizeof(buf)-1, fp);
@@ -400,6 +770,242 @@ get_program_dir(const char *executable, bool is_fallback)
 	return NULL;
 }
 
+/**
+ * Hashes a string with the 64-bit FNV-1a function.
+ */
+static uint64_t
+hash_string(const char *str)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *str; ++str) {
+		hash ^= (unsigned char) *str;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Creates @path and its parents, in the spirit of 'mkdir -p'.
+ */
+static int
+make_directory(const char *path, mode_t mode)
+{
+	char buf[PATH_MAX], *ptr;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (ptr=buf+1; *ptr; ++ptr) {
+		if (*ptr == '/') {
+			*ptr = '\0';
+			if (mkdir(buf, mode) < 0 && errno != EEXIST)
+				return -errno;
+			*ptr = '/';
+		}
+	}
+	if (mkdir(buf, mode) < 0 && errno != EEXIST)
+		return -errno;
+	return 0;
+}
+
+/**
+ * Marks the entry @path of the shared cache as used, so that
+ * evict_cache_entries() keeps it around.
+ */
+static void
+touch_cache_entry(const char *path)
+{
+	if (geteuid() == 0)
+		utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW);
+}
+
+struct cache_entry {
+	char *name;
+	time_t mtime;
+	bool is_dir;
+};
+
+static int
+compare_cache_entries(const void *a, const void *b)
+{
+	const struct cache_entry *e1 = a, *e2 = b;
+	return e1->mtime < e2->mtime ? -1 : e1->mtime > e2->mtime;
+}
+
+/**
+ * Makes room for a new entry named @prefix* in the cache directory @dir by
+ * deleting the least recently used ones once there are
+ * RUNNER_CACHE_MAX_ENTRIES of them. Entries used during the last
+ * RUNNER_CACHE_MIN_AGE seconds are kept, as a sandbox may still need them.
+ */
+static void
+evict_cache_entries(const char *dir, const char *prefix)
+{
+	struct cache_entry *entries = NULL, *newentries;
+	time_t now = time(NULL);
+	struct dirent *dirent;
+	struct stat statbuf;
+	size_t num = 0, i;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (! dp)
+		return;
+	while ((dirent = readdir(dp))) {
+		if (! strcmp(dirent->d_name, ".") || ! strcmp(dirent->d_name, "..") ||
+			strncmp(dirent->d_name, prefix, strlen(prefix)) ||
+			fstatat(dirfd(dp), dirent->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		if (num % 64 == 0) {
+			newentries = realloc(entries, (num + 64) * sizeof(struct cache_entry));
+			if (! newentries)
+				break;
+			entries = newentries;
+		}
+		entries[num].name = strdup(dirent->d_name);
+		if (! entries[num].name)
+			break;
+		entries[num].mtime = statbuf.st_mtim.tv_sec;
+		entries[num].is_dir = S_ISDIR(statbuf.st_mode);
+		num++;
+	}
+	if (num >= RUNNER_CACHE_MAX_ENTRIES) {
+		qsort(entries, num, sizeof(struct cache_entry), compare_cache_entries);
+		for (i=0; i<=num-RUNNER_CACHE_MAX_ENTRIES && entries[i].mtime < now - RUNNER_CACHE_MIN_AGE; ++i) {
+			debug_printf("cache: evicting %s/%s\n", dir, entries[i].name);
+			if (entries[i].is_dir)
+				remove_directory_at(dirfd(dp), entries[i].name);
+			else
+				unlinkat(dirfd(dp), entries[i].name, 0);
+		}
+	}
+	for (i=0; i<num; ++i)
+		free(entries[i].name);
+	free(entries);
+	closedir(dp);
+}
+
+/**
+ * Writes @contents to a /proc or /sys file.
+ */
+static int
+write_proc_file(const char *path, const char *contents)
+{
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, contents, strlen(contents)) < 0)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/**
+ * Tells if unprivileged users may create user namespaces and mount overlayfs
+ * in them, which requires Linux 5.11.
+ */
+static bool
+userns_available(void)
+{
+	const char *sysctls[] = {
+		"/proc/sys/kernel/unprivileged_userns_clone", /* Debian and Ubuntu */
+		"/proc/sys/user/max_user_namespaces",
+		NULL
+	};
+	struct utsname uts_data;
+	char buf[32];
+	FILE *fp;
+	int i;
+
+	uname(&uts_data);
+	if (compare_kernel_versions("5.11", uts_data.release) > 0)
+		return false;
+	for (i=0; sysctls[i]; ++i) {
+		fp = fopen(sysctls[i], "r");
+		if (! fp)
+			continue;
+		if (! fgets(buf, sizeof(buf), fp) || atoi(buf) <= 0) {
+			fclose(fp);
+			return false;
+		}
+		fclose(fp);
+	}
+	return true;
+}
+
+/**
+ * Moves into new user and mount namespaces owned by the caller, mapping its
+ * uid and gid onto themselves. The process keeps full capabilities over the
+ * new namespaces until it calls exec.
+ * @return 0 on success, -EAGAIN if the namespaces could not be created (the
+ * caller may then use the suid bit instead) or another negative errno if the
+ * process was left in an unusable user namespace.
+ */
+static int
+enter_user_namespace(void)
+{
+	uid_t uid = getuid(), euid = geteuid();
+	gid_t gid = getgid();
+	char map[64];
+	int ret;
+
+	verbose_printf("creating new user namespace\n");
+
+	/* The namespace must belong to the caller, not to the owner of the suid bit */
+	if (euid != uid && seteuid(uid) < 0)
+		return -EAGAIN;
+	if (unshare(CLONE_NEWUSER|CLONE_NEWNS) < 0) {
+		debug_printf("unshare(CLONE_NEWUSER|CLONE_NEWNS): %s\n", strerror(errno));
+		if (euid != uid && seteuid(euid) < 0)
+			return -EPERM;
+		return -EAGAIN;
+	}
+
+	/*
+	 * Changing the euid made /proc/self read-only to us. Only become dumpable
+	 * again now that the suid credentials can no longer be regained: doing so
+	 * before unshare() would let the caller ptrace a process that may still
+	 * go back to euid 0 on the fallback path.
+	 */
+	if (euid != uid)
+		prctl(PR_SET_DUMPABLE, 1, 0, 0, 0);
+
+	ret = write_proc_file("/proc/self/setgroups", "deny");
+	if (ret < 0 && ret != -ENOENT)
+		goto out_error;
+	snprintf(map, sizeof(map), "%u %u 1\n", (unsigned) uid, (unsigned) uid);
+	ret = write_proc_file("/proc/self/uid_map", map);
+	if (ret < 0)
+		goto out_error;
+	snprintf(map, sizeof(map), "%u %u 1\n", (unsigned) gid, (unsigned) gid);
+	ret = write_proc_file("/proc/self/gid_map", map);
+	if (ret < 0)
+		goto out_error;
+	return 0;
+
+out_error:
+	fprintf(stderr, "Failed to map ids in the user namespace: %s\n", strerror(-ret));
+	return ret;
+}
+
+/**
+ * Turns every mount of a freshly unshared namespace into a slave of its
+ * counterpart in the parent namespace. With a shared / (systemd's default)
+ * whatever Runner mounts outside /System/Index, such as the tmpfs of -T or
+ * the closure's ld.so.cache, would otherwise propagate to the host.
+ */
+static int
+isolate_mount_namespace(void)
+{
+	int ret = mount(NULL, "/", NULL, MS_REC|MS_SLAVE, NULL);
+	debug_printf("mount(rslave) = %d\n", ret);
+	if (ret < 0) {
+		ret = -errno;
+		fprintf(stderr, "Failed to stop mount propagation to the parent namespace: %s\n", strerror(errno));
+	}
+	return ret;
+}
+
 /**
  * create_mount_namespace:
  */
@@ -409,12 +1015,26 @@ create_mount_namespace()
 	int mount_count;
 	int res;
 
-	verbose_printf("creating new namespace\n");
-	res = unshare(CLONE_NEWNS);
-	if (res != 0) {
-		fprintf(stderr, "Failed to create namespace: %s\n", strerror(errno));
-		return -1;
+	if (args.userns) {
+		res = enter_user_namespace();
+		if (res == -EAGAIN && geteuid() == 0) {
+			verbose_printf("user namespaces are not available, using the suid bit\n");
+			args.userns = false;
+		} else if (res < 0) {
+			fprintf(stderr, "Failed to create user namespace\n");
+			return -1;
+		}
+	}
+	if (! args.userns) {
+		verbose_printf("creating new namespace\n");
+		res = unshare(CLONE_NEWNS);
+		if (res != 0) {
+			fprintf(stderr, "Failed to create namespace: %s\n", strerror(errno));
+			return -1;
+		}
 	}
+	if (isolate_mount_namespace() < 0)
+		return -1;
 
 	mount_count = 0;
 	res = mount(GOBO_INDEX_DIR, GOBO_INDEX_DIR,
@@ -466,981 +1086,4678 @@ destroy_namespace()
 			break;
 }
 
-static bool
-program_in_ignorelist(const char *programname)
+/*
+ * Ordered set of program directories. Entries are kept in overlay order and
+ * indexed by a hash table, so that duplicates are found in constant time and
+ * without the prefix matches (/Programs/Qt vs /Programs/QtWebKit) that a
+ * strstr() on the colon-separated string would give.
+ */
+struct path_entry {
+	struct list_head list;    /* Link to path_set.entries, in overlay order */
+	struct path_entry *next;  /* Next entry on the same hash bucket */
+	uint64_t hash;            /* hash_string(path) */
+	unsigned probe;           /* PROBE_* bits filled by probe_path_set() */
+	unsigned layers;          /* LAYER_* bits of the subdirectories to mount */
+	char path[];              /* Program directory */
+};
+
+/* Bits of path_entry.layers, in the order of mount_overlay_dirs()' sources[] */
+#define LAYER_BIN      (1 << 0)
+#define LAYER_INCLUDE  (1 << 1)
+#define LAYER_LIB      (1 << 2)
+#define LAYER_LIBEXEC  (1 << 3)
+#define LAYER_SHARE    (1 << 4)
+#define LAYER_ALL      (LAYER_BIN|LAYER_INCLUDE|LAYER_LIB|LAYER_LIBEXEC|LAYER_SHARE)
+
+struct path_set {
+	struct list_head entries; /* Entries, in overlay order */
+	struct path_entry **buckets;
+	size_t numbuckets;        /* Always a power of two */
+	size_t count;             /* Number of entries */
+};
+
+static void
+path_set_init(struct path_set *set)
 {
-	/*
-	 * We no longer ignore any programs, but it's still useful to have this
-	 * placeholder around.
-	 */
-	return false;
+	INIT_LIST_HEAD(&set->entries);
+	set->buckets = NULL;
+	set->numbuckets = 0;
+	set->count = 0;
 }
 
-static bool
-program_inlist(const char *programname, const char *currdeps)
+static void
+path_set_free(struct path_set *set)
 {
-	/*
-	 * Don't provide the same path twice to overlayfs
-	 */
-	return currdeps && strstr(currdeps, programname) ? true : false;
+	struct path_entry *entry, *aux;
+
+	list_for_each_entry_safe(entry, aux, &set->entries, list) {
+		list_del(&entry->list);
+		free(entry);
+	}
+	free(set->buckets);
+	path_set_init(set);
 }
 
-static char *
-prepare_merge_string(const char *callerprogram, const char *dependencies,
-	const char *mergedirs_program, const char *mergedirs_user, bool *needs_wrapper)
+static struct path_entry *
+path_set_find(const struct path_set *set, const char *path)
 {
-	struct search_options options;
-	struct list_data *entry;
-	struct list_head *deps;
-	char *mergedirs = NULL;
-	int mergedirs_len = callerprogram ? strlen(callerprogram) + 1: 0;
-	struct stat statbuf;
+	struct path_entry *entry;
+	uint64_t hash;
 
-	if (stat(dependencies, &statbuf) == 0 && statbuf.st_size == 0) {
-		/* nothing to parse */
+	if (! set || ! set->count)
 		return NULL;
-	}
-
-	memset(&options, 0, sizeof(options));
-	options.repository = LOCAL_PROGRAMS;
-	options.goboPrograms = GOBO_PROGRAMS_DIR;
-	options.wantedArch = args.architecture;
-	options.depsfile = dependencies;
-	options.quiet = args.quiet;
-	options.noOperator = args.strict ? EQUAL : GREATER_THAN_OR_EQUAL;
+	hash = hash_string(path);
+	for (entry=set->buckets[hash & (set->numbuckets-1)]; entry; entry=entry->next)
+		if (entry->hash == hash && ! strcmp(entry->path, path))
+			return entry;
+	return NULL;
+}
 
-	deps = ParseDependencies(&options);
-	if (!deps || list_empty(deps)) {
-		if (! args.quiet)
-			fprintf(stderr, "Could not resolve dependencies from %s\n", dependencies);
-		goto out_free;
-	}
+static bool
+path_set_contains(const struct path_set *set, const char *path)
+{
+	return path_set_find(set, path) != NULL;
+}
 
-	/* Allocate and prepare the mergedirs string */
-	list_for_each_entry(entry, deps, list)
-		mergedirs_len += strlen(entry->path) + 1;
-	mergedirs_len++;
+/**
+ * Appends @path to @set, unless it is already there.
+ * @return 1 if @path was added, 0 if it was already present or a negative
+ * errno on failure.
+ */
+static int
+path_set_add(struct path_set *set, const char *path)
+{
+	struct path_entry *entry;
+	size_t i, len = strlen(path);
 
-	mergedirs = calloc(mergedirs_len, sizeof(char));
-	if (! mergedirs) {
-		fprintf(stderr, "Not enough memory\n");
-		goto out_free;
-	}
-	list_for_each_entry(entry, deps, list) {
-		if (stat(entry->path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode) &&
-			!program_in_ignorelist(entry->path) &&
-			!program_inlist(entry->path, mergedirs_program) &&
-			!program_inlist(entry->path, mergedirs_user) &&
-			!program_inlist(entry->path, mergedirs)) {
-			verbose_printf("adding dependency %s\n", entry->path);
-			strcat(mergedirs, entry->path);
-			strcat(mergedirs, ":");
-			if (needs_wrapper && *needs_wrapper == false) {
-				char *path = open_program_file(entry->path, "/Resources/Environment");
-				*needs_wrapper = path != NULL;
-				free(path);
+	if (path_set_contains(set, path))
+		return 0;
+	if (set->count >= set->numbuckets) {
+		size_t numbuckets = set->numbuckets ? set->numbuckets * 2 : 64;
+		struct path_entry **buckets = calloc(numbuckets, sizeof(struct path_entry *));
+		if (! buckets)
+			return -ENOMEM;
+		for (i=0; i<set->numbuckets; ++i) {
+			while ((entry = set->buckets[i])) {
+				set->buckets[i] = entry->next;
+				entry->next = buckets[entry->hash & (numbuckets-1)];
+				buckets[entry->hash & (numbuckets-1)] = entry;
 			}
 		}
+		free(set->buckets);
+		set->buckets = buckets;
+		set->numbuckets = numbuckets;
 	}
-	if (callerprogram &&
-		!program_inlist(callerprogram, mergedirs_program) &&
-		!program_inlist(callerprogram, mergedirs_user) &&
-		!program_inlist(callerprogram, mergedirs)) {
-		strcat(mergedirs, callerprogram);
-		strcat(mergedirs, ":");
-		if (needs_wrapper && *needs_wrapper == false) {
-			char *path = open_program_file(callerprogram, "/Resources/Environment");
-			*needs_wrapper = path != NULL;
-			free(path);
-		}
-	}
-out_free:
-	if (deps)
-		FreeDependencies(&deps);
-	return mergedirs;
+	entry = malloc(sizeof(struct path_entry) + len + 1);
+	if (! entry)
+		return -ENOMEM;
+	memcpy(entry->path, path, len + 1);
+	entry->hash = hash_string(path);
+	entry->probe = 0;
+	entry->layers = LAYER_ALL;
+	entry->next = set->buckets[entry->hash & (set->numbuckets-1)];
+	set->buckets[entry->hash & (set->numbuckets-1)] = entry;
+	list_add_tail(&entry->list, &set->entries);
+	set->count++;
+	return 1;
 }
 
+/**
+ * Appends the entries of the colon-separated list @str to @set.
+ */
 static int
-make_path(const char *namestart, const char *subdir, char *out, bool *found)
+path_set_add_string(struct path_set *set, const char *str)
 {
-	struct stat statbuf;
-	const char *nameend;
-	int res;
+	char path[PATH_MAX];
+	const char *end;
+	int ret;
 
-	/* non-empty strings returned by prepare_merge_string() always terminate with ":" */
-	nameend = strchr(namestart, ':');
-	sprintf(out, "%.*s/%s", (int)(nameend-namestart), namestart, subdir);
-	if (stat(out, &statbuf) != 0 || program_in_ignorelist(out)) {
-		*out = '\0';
-		return 0;
+	for (; str && *str; str=end) {
+		end = strchr(str, ':');
+		if (! end)
+			end = str + strlen(str);
+		if (end - str >= PATH_MAX)
+			return -ENAMETOOLONG;
+		if (end > str) {
+			memcpy(path, str, end - str);
+			path[end - str] = '\0';
+			if ((ret = path_set_add(set, path)) < 0)
+				return ret;
+		}
+		if (*end == ':')
+			end++;
 	}
-	res = strlen(out);
-	out[res] = ':';
-	out[res+1] = '\0';
-	*found = true;
-	return res+1;
+	return 0;
+}
+
+/**
+ * Serializes @set into the colon-terminated list used by the overlay cache,
+ * by runnerd's protocol and by the environment ("/Programs/A/1:/Programs/B/2:").
+ * @return A malloc'd string or NULL on failure.
+ */
+static char *
+path_set_to_string(const struct path_set *set)
+{
+	struct path_entry *entry;
+	size_t len = 1;
+	char *str, *ptr;
+
+	list_for_each_entry(entry, &set->entries, list)
+		len += strlen(entry->path) + 1;
+	str = ptr = malloc(len);
+	if (! str)
+		return NULL;
+	*ptr = '\0';
+	list_for_each_entry(entry, &set->entries, list)
+		ptr += sprintf(ptr, "%s:", entry->path);
+	return str;
+}
+
+/*
+ * Batched metadata probing. Every path that the overlay builders would stat()
+ * one at a time is submitted at once, through io_uring when the kernel offers
+ * IORING_OP_STATX (Linux 5.6) and through a small pool of threads otherwise.
+ * This hides the latency of network-backed $goboPrograms trees.
+ */
+enum {
+	PROBE_DONE        = 1 << 0,  /* The entry has been probed */
+	PROBE_DIR         = 1 << 1,  /* The program directory exists */
+	PROBE_ENVIRONMENT = 1 << 2,  /* Resources/Environment exists */
+	PROBE_SUBDIR      = 1 << 3,  /* First bit of probe_subdirs[] */
+};
+
+static const char *probe_subdirs[] = {"bin", "sbin", "include", "lib", "lib64", "libexec", "share", NULL};
+
+#define PROBE_PATHS         9    /* Directory, Resources/Environment and probe_subdirs[] */
+#define PROBE_RING_ENTRIES  256
+#define PROBE_MAX_THREADS   8
+#define PROBE_MIN_BATCH     64   /* Smaller batches on local filesystems are probed serially */
+
+struct probe_request {
+	char *path;                /* Path to stat */
+	struct path_entry *entry;  /* Entry to update */
+	unsigned bit;              /* PROBE_* bit set if @path exists */
+	int result;                /* 0 or a negative errno */
+	struct statx stx;          /* Result */
+};
+
+struct probe_batch {
+	struct probe_request *reqs;
+	size_t num;
+	size_t next;               /* Next request to be served by a worker */
+};
+
+/**
+ * Returns the PROBE_* bit that records whether @subdir exists, or 0 if
+ * @subdir is not probed.
+ */
+static unsigned
+probe_subdir_bit(const char *subdir)
+{
+	for (int i=0; probe_subdirs[i]; ++i)
+		if (! strcmp(probe_subdirs[i], subdir))
+			return PROBE_SUBDIR << i;
+	return 0;
 }
 
+#if defined(HAVE_IO_URING) && defined(__NR_io_uring_setup)
+/**
+ * Runs the statx() calls of @reqs through an io_uring instance.
+ * @return 0 on success or a negative errno if io_uring is not available or
+ * failed, in which case the requests it did not serve keep their -EINVAL
+ * result. -EINPROGRESS means that the kernel may still write to @reqs, which
+ * must then be leaked.
+ */
 static int
-test_and_remove(char *srcdir, char *indexdir)
+probe_with_io_uring(struct probe_request *reqs, size_t num)
 {
-	int indexfd, ret = 0;
-	struct stat statbuf;
-	struct dirent *entry;
-	DIR *dp = opendir(srcdir);
-	if (!dp)
+	struct io_uring_params params;
+	struct io_uring_sqe *sqes, *sqe;
+	struct io_uring_cqe *cqes, *cqe;
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	unsigned tail, head, pending = 0;
+	size_t submitted = 0, completed = 0, ringsize, sqesize;
+	void *ring;
+	int fd, n, ret = 0;
+
+	memset(&params, 0, sizeof(params));
+	fd = syscall(__NR_io_uring_setup, num < PROBE_RING_ENTRIES ? num : PROBE_RING_ENTRIES, &params);
+	if (fd < 0)
 		return -errno;
+	if (! (params.features & IORING_FEAT_SINGLE_MMAP)) {
+		/* Predates IORING_OP_STATX anyway */
+		close(fd);
+		return -ENOSYS;
+	}
 
-	indexfd = open(indexdir, O_DIRECTORY|O_PATH);
-	if (indexfd < 0) {
+	ringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	if (ringsize < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+		ringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sqesize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring = mmap(NULL, ringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
 		ret = -errno;
-		closedir(dp);
+		close(fd);
 		return ret;
 	}
+	sqes = mmap(NULL, sqesize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		ret = -errno;
+		munmap(ring, ringsize);
+		close(fd);
+		return ret;
+	}
+	sq_tail = ring + params.sq_off.tail;
+	sq_mask = ring + params.sq_off.ring_mask;
+	sq_array = ring + params.sq_off.array;
+	cq_head = ring + params.cq_off.head;
+	cq_tail = ring + params.cq_off.tail;
+	cq_mask = ring + params.cq_off.ring_mask;
+	cqes = ring + params.cq_off.cqes;
+
+	/* Once an error is hit, only wait for the requests the kernel already took */
+	while (ret == 0 ? completed < num : completed < submitted - pending) {
+		/* Keep at most sq_entries requests in flight, so the CQ ring never overflows */
+		tail = *sq_tail;
+		for (; ret == 0 && submitted < num && submitted - completed < params.sq_entries; ++pending) {
+			sqe = &sqes[tail & *sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t) reqs[submitted].path;
+			sqe->len = STATX_TYPE;
+			sqe->off = (uintptr_t) &reqs[submitted].stx;
+			sqe->user_data = submitted;
+			sq_array[tail & *sq_mask] = tail & *sq_mask;
+			tail++;
+			submitted++;
+		}
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
 
-	while ((entry = readdir(dp))) {
-		if (fstatat(indexfd, entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
-			continue;
-
-		if (S_ISDIR(statbuf.st_mode) && (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")))
-			continue;
-
-		else if (S_ISDIR(statbuf.st_mode)) {
-			/* recurse */
-			char *new_srcdir, *new_indexdir;
-			ret = asprintf(&new_srcdir, "%s/%s", srcdir, entry->d_name);
+		/* Entries the kernel did not consume (e.g., on EINTR) are passed again */
+		n = syscall(__NR_io_uring_enter, fd, ret == 0 ? pending : 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0 && errno != EINTR) {
 			if (ret < 0) {
-				perror("asprintf");
-				goto out;
-			}
-			ret = asprintf(&new_indexdir, "%s/%s", indexdir, entry->d_name);
-			if (ret < 0) {
-				perror("asprintf");
-				free(new_srcdir);
-				goto out;
-			}
-			test_and_remove(new_srcdir, new_indexdir);
-			free(new_indexdir);
-			free(new_srcdir);
-		}
-
-		else if (S_ISLNK(statbuf.st_mode)) {
-			/* test and remove */
-			char *target = calloc(PATH_MAX, sizeof(char));
-			if (! target) {
-				perror("calloc");
-				ret = -ENOMEM;
-				goto out;
-			}
-			if (readlinkat(indexfd, entry->d_name, target, PATH_MAX-1) < 0) {
-				ret = -errno;
-				perror("readlinkat");
-				free(target);
-				goto out;
-			}
-			if (strstr(target, srcdir)) {
-				/* symlink points to conflicting dependency, so remove it */
-				//debug_printf("%s: removing %s/%s -> %s\n", __func__, indexdir, entry->d_name, target);
-				unlinkat(indexfd, entry->d_name, 0);
+				/* Cannot wait for the requests in flight: leave them their memory */
+				debug_printf("io_uring: %zu requests still in flight\n", submitted - pending - completed);
+				return -EINPROGRESS;
 			}
-			free(target);
+			ret = -errno;
+		} else if (n > 0 && ret == 0) {
+			pending -= n;
 		}
+		for (head = *cq_head; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); ++head) {
+			cqe = &cqes[head & *cq_mask];
+			/* Requests cut short by a signal are left to probe_with_threads() */
+			if (cqe->res == -ECANCELED || cqe->res == -EINTR || cqe->res == -EAGAIN)
+				reqs[cqe->user_data].result = -EINVAL;
+			else
+				reqs[cqe->user_data].result = cqe->res;
+			completed++;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
 	}
-	ret = 0;
-out:
-	close(indexfd);
-	closedir(dp);
+
+	munmap(sqes, sqesize);
+	munmap(ring, ringsize);
+	close(fd);
 	return ret;
 }
+#endif /* HAVE_IO_URING */
 
-static void
-remove_conflicting_deps(char *good_dep)
+/**
+ * Tells if $goboPrograms lives on a network filesystem, where every lookup
+ * pays for a round trip.
+ */
+static bool
+programs_on_network_fs(void)
 {
-	char *version, srcdir[PATH_MAX], indexdir[PATH_MAX];
-	struct stat statbuf;
-	struct dirent *entry;
-	DIR *dp;
-	int i;
-
-	version = strrchr(good_dep, '/');
-	if (! version)
-		return;
+	const unsigned long magics[] = {
+		0x6969,      /* NFS */
+		0x517b,      /* SMB */
+		0xff534d42,  /* CIFS */
+		0xfe534d42,  /* SMB2 */
+		0x65735546,  /* FUSE */
+		0x00c36400,  /* Ceph */
+		0x01021997,  /* 9P */
+		0x5346414f,  /* AFS */
+		0
+	};
+	struct statfs statbuf;
 
-	*version = '\0';
-	dp = opendir(good_dep);
-	if (! dp) {
-		perror(good_dep);
-		*version = '/';
-		return;
-	}
+	if (statfs(GOBO_PROGRAMS_DIR, &statbuf) < 0)
+		return false;
+	for (int i=0; magics[i]; ++i)
+		if ((unsigned long) statbuf.f_type == magics[i])
+			return true;
+	return false;
+}
 
-	while ((entry = readdir(dp))) {
-		const char *blacklist[] = { ".", "..", "Current", "Settings", "Variable", version+1, NULL };
-		const char *sources[] = {"bin", "sbin", "include", "lib",  "lib64", "libexec", "share", NULL};
-		const char *targets[] = {"bin", "bin",  "include", "lib",  "lib",   "libexec", "share", NULL};
-		bool skip = false;
+static void *
+probe_worker(void *data)
+{
+	struct probe_batch *batch = data;
+	struct probe_request *req;
+	size_t i;
 
-		for (i=0; blacklist[i]; ++i)
-			if (! strcmp(blacklist[i], entry->d_name)) {
-				skip = true;
-				break;
-			}
-		if (skip)
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->num) {
+		req = &batch->reqs[i];
+		if (req->result != -EINVAL)
 			continue;
-
-		for (i=0; sources[i]; ++i) {
-			snprintf(srcdir, sizeof(srcdir)-1, "%s/%s/%s", good_dep, entry->d_name, sources[i]);
-			snprintf(indexdir, sizeof(indexdir)-1, "%s/%s", GOBO_INDEX_DIR, targets[i]);
-			if (stat(srcdir, &statbuf) != 0)
-				continue;
-			test_and_remove(srcdir, indexdir);
-		}
+		req->result = statx(AT_FDCWD, req->path, 0, STATX_TYPE, &req->stx) < 0 ? -errno : 0;
 	}
+	return NULL;
+}
 
-	closedir(dp);
-	*version = '/';
+/**
+ * Runs the statx() calls of @reqs not served by io_uring (marked with
+ * -EINVAL) on a pool of threads.
+ */
+static void
+probe_with_threads(struct probe_request *reqs, size_t num)
+{
+	struct probe_batch batch = { .reqs = reqs, .num = num, .next = 0 };
+	pthread_t threads[PROBE_MAX_THREADS];
+	size_t pending = 0;
+	int i, numthreads;
+
+	for (i=0; i<num; ++i)
+		pending += reqs[i].result == -EINVAL;
+	if (pending == 0)
+		return;
+	numthreads = (pending + 15) / 16;
+
+	if (numthreads > PROBE_MAX_THREADS)
+		numthreads = PROBE_MAX_THREADS;
+	for (i=0; i<numthreads-1; ++i)
+		if (pthread_create(&threads[i], NULL, probe_worker, &batch) != 0)
+			break;
+	numthreads = i;
+	probe_worker(&batch);
+	for (i=0; i<numthreads; ++i)
+		pthread_join(threads[i], NULL);
 }
 
-static int
-mount_overlay_dirs(const char *mergedirs, const char *mountpoint)
+/**
+ * Probes the program directories in @set that have not been probed yet,
+ * filling their PROBE_* bits.
+ */
+static void
+probe_path_set(struct path_set *set)
 {
-	const char *sources[] = {"bin", "include", "lib",  "libexec", "share", NULL};
-	const char *aliases[] = {"sbin", NULL,     "lib64", NULL,      NULL,   NULL};
-	const char *targets[] = {"bin", "include", "lib",  "libexec", "share", NULL};
-	const char *dirptr;
-
-	char *unionfs, mp[strlen(mountpoint)+strlen("libexec")+2];
-	int i, j, res = 0, unionfs_idx = 0, dircount = 0;
-	size_t unionfs_size = 0;
-
-	for (i=0; i<strlen(mergedirs); ++i)
-		if (mergedirs[i] == ':')
-			dircount++;
-
-	unionfs_size = strlen("lowerdir=");
-	unionfs_size += (strlen(mergedirs) + dircount * (strlen("libexec")+1) + 1) * 2;
-	unionfs_size += strlen(mountpoint) + strlen("libexec") + 2;
-	unionfs_size += strlen("workdir=");
-	unionfs_size += strlen(args.writelayer) + strlen("libexec") + 2;
-	unionfs_size += strlen("upperdir=");
-	unionfs_size += strlen(args.upperlayer) + strlen("libexec") + 2;
-	unionfs = (char *) malloc(unionfs_size * sizeof(char));
-	if (! unionfs) {
-		perror("calloc");
-		return -ENOMEM;
-	}
-	/* Mount directories from sources[] as overlays on /System/Index/targets[] */
-	for (i=0; sources[i]; ++i) {
-		bool have_entries = false;
-		sprintf(unionfs, "lowerdir=");
-		for (unionfs_idx=strlen(unionfs), j=0; j<2; ++j) {
-			const char *source = j == 0 ? sources[i] : aliases[i];
-			for (dirptr=mergedirs; source && dirptr; dirptr=strchr(dirptr, ':')) {
-				if (dirptr != mergedirs) { dirptr++; }
-				if (strlen(dirptr)) { unionfs_idx += make_path(dirptr, source, &unionfs[unionfs_idx], &have_entries); }
-			}
-		}
-		if (have_entries) {
-			sprintf(mp, "%s/%s", mountpoint, targets[i]);
-			if (args.pure) {
-				char *sep = strrchr(unionfs, ':');
-				if (sep) { *sep = ','; }
-				sprintf(&unionfs[unionfs_idx], "upperdir=%s/%s,workdir=%s/%s",
-					args.upperlayer, sources[i], args.writelayer, sources[i]);
+	struct probe_request *reqs;
+	struct path_entry *entry;
+	size_t i, num = 0;
+	int j, ret = -ENOSYS;
+
+	list_for_each_entry(entry, &set->entries, list)
+		if (! (entry->probe & PROBE_DONE))
+			num += PROBE_PATHS;
+	if (num == 0)
+		return;
+	reqs = calloc(num, sizeof(struct probe_request));
+	if (! reqs)
+		return;
+
+	num = 0;
+	list_for_each_entry(entry, &set->entries, list) {
+		if (entry->probe & PROBE_DONE)
+			continue;
+		for (j=-2; j < 0 || probe_subdirs[j]; ++j) {
+			struct probe_request *req = &reqs[num];
+			if (j == -2) {
+				req->bit = PROBE_DIR;
+				req->path = strdup(entry->path);
+			} else if (j == -1) {
+				req->bit = PROBE_ENVIRONMENT;
+				if (asprintf(&req->path, "%s/Resources/Environment", entry->path) < 0)
+					req->path = NULL;
 			} else {
-				sprintf(&unionfs[unionfs_idx], "%s,upperdir=%s/%s,workdir=%s/%s",
-					mp, args.upperlayer, sources[i], args.writelayer, sources[i]);
+				req->bit = PROBE_SUBDIR << j;
+				if (asprintf(&req->path, "%s/%s", entry->path, probe_subdirs[j]) < 0)
+					req->path = NULL;
 			}
-			debug_printf("mount -t overlay none -o %s %s\n", unionfs, mp);
-			res = mount("overlay", mp, "overlay", 0, unionfs);
-			if (res != 0)
+			if (! req->path)
 				goto out_free;
+			req->entry = entry;
+			req->result = -EINVAL;
+			num++;
 		}
 	}
-	/* Do not keep other conflicting versions of dependencies on /System/Index */
-	if (args.removedeps) {
-		char *mergecopy = strdup(mergedirs);
-		if (! mergecopy) {
-			perror("strdup");
-			goto out_free;
-		}
-		char *start = mergecopy, *end;
-		while (start && strlen(start) > 0) {
-			end = strstr(start, ":");
-			if (end) { *end = '\0'; }
 
-			remove_conflicting_deps(start);
-
-			start = end ? end+1 : NULL;
-			end = start ? strstr(start, ":") : NULL;
+	profile_begin("probe");
+	if (num < PROBE_MIN_BATCH && ! programs_on_network_fs()) {
+		/* The dentry cache answers these faster than a batch can be set up */
+		struct probe_batch batch = { .reqs = reqs, .num = num, .next = 0 };
+		probe_worker(&batch);
+	} else {
+#if defined(HAVE_IO_URING) && defined(__NR_io_uring_setup)
+		ret = probe_with_io_uring(reqs, num);
+		debug_printf("probed %zu paths with io_uring: %s\n", num, ret < 0 ? strerror(-ret) : "ok");
+		if (ret == -EINPROGRESS) {
+			/* The kernel may still write to @reqs, so they are leaked and left unprobed */
+			profile_end();
+			return;
 		}
-		free(mergecopy);
+#endif
+		/* Also picks the requests io_uring could not serve (no IORING_OP_STATX) */
+		probe_with_threads(reqs, num);
 	}
-out_free:
-	if (res != 0) {
-		fprintf(stderr, "Failed to mount overlayfs\n");
-		verbose_printf("%s\n", unionfs);
+	profile_end();
+
+	for (i=0; i<num; ++i) {
+		if (reqs[i].result < 0)
+			continue;
+		if (reqs[i].bit == PROBE_DIR && ! S_ISDIR(reqs[i].stx.stx_mode))
+			continue;
+		reqs[i].entry->probe |= reqs[i].bit;
 	}
-	free(unionfs);
-	return res;
+	list_for_each_entry(entry, &set->entries, list)
+		entry->probe |= PROBE_DONE;
+
+out_free:
+	for (i=0; i<num; ++i)
+		free(reqs[i].path);
+	free(reqs);
+}
+
+static bool
+program_in_ignorelist(const char *programname)
+{
+	/*
+	 * We no longer ignore any programs, but it's still useful to have this
+	 * placeholder around.
+	 */
+	return false;
 }
 
 /**
- * Returns 0 if the wrapper has been successfully created, a negative value on
- * error, and 1 if no Resources/Environment files were available to justify the
- * creation of a wrapper.
+ * Resolves the @dependencies file and appends the resulting program
+ * directories, followed by @callerprogram, to @mergedirs. Programs already
+ * in @mergedirs or in @exclude are skipped.
+ * @return The number of programs added or -1 if @dependencies could not be
+ * resolved.
  */
 static int
-create_wrapper(const char *mergedirs)
+prepare_merge_string(struct path_set *mergedirs, const struct path_set *exclude,
+	const char *callerprogram, const char *dependencies, bool *needs_wrapper)
 {
-	int ret = 1;
-	FILE *fp = NULL;
-	bool keep_wrapper = false;
-
-	if (args.sourceenv) {
-		/* Shebang */
-		ret = asprintf(&args.wrapper, "%s/wrapper", args.workdir);
-		if (ret < 0) {
-			perror("asprintf");
-			return -ENOMEM;
-		}
-		verbose_printf("Creating wrapper %s\n", args.wrapper);
+	struct search_options options;
+	struct path_entry *candidate, *added_entry;
+	struct path_set candidates;
+	struct list_data *entry;
+	struct list_head *deps;
+	struct stat statbuf;
+	int ret, added = -1;
 
-		fp = fopen(args.wrapper, "w");
-		if (! fp) {
-			ret = -errno;
-			fprintf(stderr, "open %s: %s\n", args.wrapper, strerror(errno));
-			goto out_error;
-		}
-		fprintf(fp, "#!/bin/bash\n\n");
+	if (stat(dependencies, &statbuf) == 0 && statbuf.st_size == 0) {
+		/* nothing to parse */
+		return -1;
+	}
 
-		/* Source environment variables */
-		char *mergecopy = strdup(mergedirs);
-		if (! mergecopy) {
-			perror("strdup");
-			ret = -ENOMEM;
-			goto out_error;
-		}
-		char *start = mergecopy, *end, *env;
-		while (start && strlen(start) > 0) {
-			end = strstr(start, ":");
-			if (end) { *end = '\0'; }
+	memset(&options, 0, sizeof(options));
+	options.repository = LOCAL_PROGRAMS;
+	options.goboPrograms = GOBO_PROGRAMS_DIR;
+	options.wantedArch = args.architecture;
+	options.depsfile = dependencies;
+	options.quiet = args.quiet;
+	options.noOperator = args.strict ? EQUAL : GREATER_THAN_OR_EQUAL;
+	options.catalogDir = args.cache ? GOBO_RUNNER_CACHE_DIR "/catalog" : NULL;
 
-			if (asprintf(&env, "%s/Resources/Environment", start) > 0) {
-				struct stat statbuf;
-				if (stat(env, &statbuf) == 0) {
-					fprintf(fp, "source %s\n", env);
-					keep_wrapper = true;
-				}
-				free(env);
-			} else {
-				perror("asprintf");
-				ret = -ENOMEM;
-				goto out_error;
-			}
+	profile_begin("parse_dependencies");
+	deps = ParseDependencies(&options);
+	profile_end();
+	if (!deps || list_empty(deps)) {
+		if (! args.quiet)
+			fprintf(stderr, "Could not resolve dependencies from %s\n", dependencies);
+		goto out_free;
+	}
 
-			start = end ? end+1 : NULL;
-			end = start ? strstr(start, ":") : NULL;
+	/* Probe every new dependency at once */
+	path_set_init(&candidates);
+	list_for_each_entry(entry, deps, list) {
+		if (path_set_contains(exclude, entry->path) || path_set_contains(mergedirs, entry->path))
+			continue;
+		if (path_set_add(&candidates, entry->path) < 0) {
+			fprintf(stderr, "Not enough memory\n");
+			path_set_free(&candidates);
+			goto out_free;
 		}
-		free(mergecopy);
+	}
+	probe_path_set(&candidates);
 
-		/* Call user program */
-		if (keep_wrapper) {
-			for (int i=0; args.arguments[i]; ++i) {
-				if (strstr(args.arguments[i], " "))
-					fprintf(fp, "\"%s\"%c", args.arguments[i], args.arguments[i+1] ? ' ' : '\n');
-				else
-					fprintf(fp, "%s%c", args.arguments[i], args.arguments[i+1] ? ' ' : '\n');
+	added = 0;
+	list_for_each_entry(candidate, &candidates.entries, list) {
+		if ((candidate->probe & PROBE_DIR) && !program_in_ignorelist(candidate->path)) {
+			ret = path_set_add(mergedirs, candidate->path);
+			if (ret < 0) {
+				fprintf(stderr, "Not enough memory\n");
+				added = -1;
+				break;
 			}
-			fclose(fp);
-
-			chown(args.wrapper, getuid(), getgid());
-			chmod(args.wrapper, 0755);
-			ret = 0;
-		} else {
-			fclose(fp);
-			ret = 1;
+			added_entry = path_set_find(mergedirs, candidate->path);
+			added_entry->probe = candidate->probe;
+			verbose_printf("adding dependency %s\n", candidate->path);
+			added++;
+			if (needs_wrapper && (candidate->probe & PROBE_ENVIRONMENT))
+				*needs_wrapper = true;
 		}
 	}
-
-out_error:
-	if (ret != 0 && args.wrapper) {
-		if (args.cleanup)
-			unlink(args.wrapper);
-		free(args.wrapper);
+	path_set_free(&candidates);
+	if (added < 0)
+		goto out_free;
+	if (callerprogram && !path_set_contains(exclude, callerprogram)) {
+		ret = path_set_add(mergedirs, callerprogram);
+		if (ret < 0) {
+			fprintf(stderr, "Not enough memory\n");
+			added = -1;
+			goto out_free;
+		}
+		added += ret;
+		if (ret > 0 && needs_wrapper && *needs_wrapper == false) {
+			char *path = open_program_file(callerprogram, "/Resources/Environment");
+			*needs_wrapper = path != NULL;
+			free(path);
+		}
 	}
-	return ret;
+out_free:
+	if (deps)
+		FreeDependencies(&deps);
+	return added;
 }
 
-static char *
-parse_elf_file(const char *executable)
+/**
+ * Appends the @subdir directory of @programdir to @layers, unless it does not
+ * exist or is ignored.
+ * @param probe PROBE_* bits of @programdir, if it has been probed already
+ * @return 1 if a layer was added, 0 if not, or a negative errno.
+ */
+static int
+make_path(const char *programdir, const char *subdir, unsigned probe, char **layers, int *numlayers)
+{
+	struct stat statbuf;
+	bool probed = (probe & PROBE_DONE) && probe_subdir_bit(subdir);
+	char *path;
+
+	if (probed && ! (probe & probe_subdir_bit(subdir)))
+		return 0;
+	if (asprintf(&path, "%s/%s", programdir, subdir) < 0)
+		return -ENOMEM;
+	if ((! probed && stat(path, &statbuf) != 0) || program_in_ignorelist(path)) {
+		free(path);
+		return 0;
+	}
+	layers[(*numlayers)++] = path;
+	return 1;
+}
+
+/**
+ * Walks the /System/Index directory open at @fd and unlinks the symlinks
+ * that point into $goboPrograms/<App>/<Version> when <App> is part of
+ * @mergedirs under a different version. Takes ownership of @fd.
+ * @param apps The $goboPrograms/<App> directories of @mergedirs
+ * @return The number of symlinks removed.
+ */
+static int
+remove_conflicting_links(int fd, const struct path_set *mergedirs, const struct path_set *apps)
+{
+	const char *blacklist[] = { "Current", "Settings", "Variable", NULL };
+	char target[PATH_MAX], prefix[PATH_MAX], *start, *version, *end;
+	size_t len = strlen(GOBO_PROGRAMS_DIR "/");
+	struct dirent *entry;
+	struct stat statbuf;
+	int i, subfd, removed = 0;
+	ssize_t n;
+	DIR *dp;
+
+	dp = fdopendir(fd);
+	if (! dp) {
+		close(fd);
+		return 0;
+	}
+	while ((entry = readdir(dp))) {
+		unsigned char type = entry->d_type;
+		if (! strcmp(entry->d_name, ".") || ! strcmp(entry->d_name, ".."))
+			continue;
+		if (type == DT_UNKNOWN && fstatat(fd, entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0)
+			type = S_ISDIR(statbuf.st_mode) ? DT_DIR : S_ISLNK(statbuf.st_mode) ? DT_LNK : DT_REG;
+
+		if (type == DT_DIR) {
+			subfd = openat(fd, entry->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+			if (subfd >= 0)
+				removed += remove_conflicting_links(subfd, mergedirs, apps);
+			continue;
+		} else if (type != DT_LNK) {
+			continue;
+		}
+
+		/* Split $goboPrograms/<App>/<Version> out of the link target */
+		n = readlinkat(fd, entry->d_name, target, sizeof(target)-1);
+		if (n < 0)
+			continue;
+		target[n] = '\0';
+		start = strstr(target, GOBO_PROGRAMS_DIR "/");
+		if (! start || ! (version = strchr(start + len, '/')))
+			continue;
+		end = strchrnul(version + 1, '/');
+		snprintf(prefix, sizeof(prefix), "%.*s", (int) (version - start), start);
+		if (! path_set_contains(apps, prefix))
+			continue;
+		snprintf(prefix, sizeof(prefix), "%.*s", (int) (end - start), start);
+		if (path_set_contains(mergedirs, prefix))
+			continue;
+		for (i=0; blacklist[i]; ++i)
+			if (! strcmp(blacklist[i], &prefix[version - start + 1]))
+				break;
+		if (blacklist[i])
+			continue;
+
+		/* symlink points to conflicting dependency, so remove it */
+		if (unlinkat(fd, entry->d_name, 0) == 0)
+			removed++;
+	}
+	closedir(dp);
+	return removed;
+}
+
+/**
+ * Removes the symlinks to versions of the programs in @mergedirs other than
+ * the ones chosen from the @targets directories of @mountpoint, walking each
+ * of them once.
+ */
+static void
+remove_conflicting_deps(const struct path_set *mergedirs, const char *mountpoint, const char **targets)
+{
+	char appdir[PATH_MAX], indexdir[PATH_MAX], *version;
+	struct path_entry *entry;
+	struct path_set apps;
+	int i, fd, removed = 0;
+
+	path_set_init(&apps);
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		snprintf(appdir, sizeof(appdir), "%s", entry->path);
+		version = strrchr(appdir, '/');
+		if (! version || version == appdir)
+			continue;
+		*version = '\0';
+		if (path_set_add(&apps, appdir) < 0) {
+			perror("path_set_add");
+			goto out_free;
+		}
+	}
+	for (i=0; targets[i]; ++i) {
+		snprintf(indexdir, sizeof(indexdir), "%s/%s", mountpoint, targets[i]);
+		fd = open(indexdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (fd >= 0)
+			removed += remove_conflicting_links(fd, mergedirs, &apps);
+	}
+	debug_printf("removed %d links to conflicting dependencies\n", removed);
+out_free:
+	path_set_free(&apps);
+}
+
+struct farm_entry {
+	char *name;     /* Entry name */
+	int layer;      /* Index of the layer providing it */
+	bool is_dir;    /* Is it a real directory (as opposed to a file or symlink)? */
+};
+
+static int
+compare_farm_entries(const void *a, const void *b)
+{
+	const struct farm_entry *ea = a, *eb = b;
+	int ret = strcmp(ea->name, eb->name);
+	return ret ? ret : ea->layer - eb->layer;
+}
+
+/**
+ * Populates @dst with symlinks to the entries of @layers, giving precedence
+ * to the first layers like overlayfs does. Directories present in more than
+ * one layer are created in @dst and merged recursively.
+ * @return The number of entries created, or a negative value on error.
+ */
+static int
+flatten_directory(const char *dst, char **layers, int numlayers)
+{
+	struct farm_entry *entries = NULL;
+	size_t num = 0, size = 0, i, j;
+	struct dirent *entry;
+	struct stat statbuf;
+	int k, ret = 0;
+	DIR *dp;
+
+	for (k=0; k<numlayers; ++k) {
+		dp = opendir(layers[k]);
+		if (! dp)
+			continue;
+		while ((entry = readdir(dp))) {
+			if (! strcmp(entry->d_name, ".") || ! strcmp(entry->d_name, ".."))
+				continue;
+			if (num == size) {
+				struct farm_entry *newentries;
+				size = size ? size * 2 : 256;
+				newentries = realloc(entries, size * sizeof(struct farm_entry));
+				if (! newentries) {
+					closedir(dp);
+					ret = -ENOMEM;
+					goto out_free;
+				}
+				entries = newentries;
+			}
+			entries[num].name = strdup(entry->d_name);
+			entries[num].layer = k;
+			entries[num].is_dir = entry->d_type == DT_DIR;
+			if (entry->d_type == DT_UNKNOWN && fstatat(dirfd(dp), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0)
+				entries[num].is_dir = S_ISDIR(statbuf.st_mode);
+			num++;
+		}
+		closedir(dp);
+	}
+	if (num == 0)
+		goto out_free;
+
+	if (mkdir(dst, 0755) < 0 && errno != EEXIST) {
+		ret = -errno;
+		goto out_free;
+	}
+	qsort(entries, num, sizeof(struct farm_entry), compare_farm_entries);
+	for (i=0; i<num; i=j) {
+		char *target = NULL, *link = NULL, *sublayers[numlayers];
+		int numsublayers = 0;
+
+		/* Entries with the same name, in layer order */
+		for (j=i; j<num && ! strcmp(entries[j].name, entries[i].name); ++j) {
+			/* A non-directory hides the directories from lower layers */
+			if (entries[j].is_dir && numsublayers == j-i)
+				asprintf(&sublayers[numsublayers++], "%s/%s", layers[entries[j].layer], entries[j].name);
+		}
+		if (asprintf(&link, "%s/%s", dst, entries[i].name) < 0) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (numsublayers > 1) {
+			if (flatten_directory(link, sublayers, numsublayers) < 0)
+				ret = -1;
+		} else if (asprintf(&target, "%s/%s", layers[entries[i].layer], entries[i].name) > 0) {
+			if (symlink(target, link) < 0)
+				ret = -errno;
+			free(target);
+		}
+		for (k=0; k<numsublayers; ++k)
+			free(sublayers[k]);
+		free(link);
+		if (ret < 0)
+			break;
+	}
+	if (ret == 0)
+		ret = num;
+
+out_free:
+	for (i=0; i<num; ++i)
+		free(entries[i].name);
+	free(entries);
+	return ret;
+}
+
+/**
+ * Returns the path to a symlink farm that merges the bin, include, lib,
+ * libexec and share directories of the programs in @mergedirs, building
+ * it if needed. Farms are cached per closure under GOBO_RUNNER_CACHE_DIR,
+ * keyed by the identity of each program directory, and evicted like the
+ * other cache entries once they are no longer used.
+ * @return A malloc'd path on success or NULL on failure.
+ */
+static char *
+get_flattened_view(const struct path_set *mergedirs)
+{
+	const char *sources[] = {"bin", "include", "lib",  "libexec", "share", NULL};
+	const char *aliases[] = {"sbin", NULL,     "lib64", NULL,      NULL,   NULL};
+	char *key = NULL, *farm = NULL, *tmpfarm = NULL;
+	const char **dirs = NULL;
+	char **layers = NULL;
+	int i, j, k, numdirs = 0, numlayers;
+	struct path_entry *entry;
+	struct stat statbuf;
+
+	/* Key the farm by the identity of each program directory */
+	dirs = calloc(mergedirs->count + 1, sizeof(char *));
+	if (! dirs)
+		goto out_free;
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		dirs[numdirs++] = entry->path;
+		if (append_cache_stamp(&key, entry->path) < 0)
+			goto out_free;
+	}
+	if (! key || asprintf(&farm, "%s/farm/%016llx", GOBO_RUNNER_CACHE_DIR,
+			(unsigned long long) hash_string(key)) < 0) {
+		farm = NULL;
+		goto out_free;
+	}
+	/* Inside a user namespace, root-owned files show up as the overflow uid */
+	if (stat(farm, &statbuf) == 0 && S_ISDIR(statbuf.st_mode) && (statbuf.st_uid == 0 || args.userns)) {
+		debug_printf("using flattened view %s\n", farm);
+		touch_cache_entry(farm);
+		goto out_free;
+	}
+
+	/* Build it under a temporary name, then move it into place */
+	if (geteuid() != 0 || make_directory(GOBO_RUNNER_CACHE_DIR "/farm", 0755) < 0)
+		goto out_error;
+	evict_cache_entries(GOBO_RUNNER_CACHE_DIR "/farm", "");
+	if (asprintf(&tmpfarm, "%s.XXXXXX", farm) < 0 || ! mkdtemp(tmpfarm) ||
+		chmod(tmpfarm, 0755) < 0)
+		goto out_error;
+	layers = calloc(numdirs * 2 + 1, sizeof(char *));
+	if (! layers)
+		goto out_error;
+	for (i=0; sources[i]; ++i) {
+		char *dst = NULL;
+		numlayers = 0;
+		for (j=0; j<2; ++j) {
+			const char *source = j == 0 ? sources[i] : aliases[i];
+			for (k=0; source && k<numdirs; ++k)
+				if (asprintf(&layers[numlayers], "%s/%s", dirs[k], source) > 0)
+					numlayers++;
+		}
+		if (asprintf(&dst, "%s/%s", tmpfarm, sources[i]) > 0) {
+			k = flatten_directory(dst, layers, numlayers);
+			free(dst);
+		}
+		for (j=0; j<numlayers; ++j)
+			free(layers[j]);
+		if (k < 0)
+			goto out_error;
+	}
+	verbose_printf("created flattened view %s\n", farm);
+	if (rename(tmpfarm, farm) < 0) {
+		/* Someone else may have built it in the meantime */
+		cleanup_directory("flattened view", tmpfarm);
+		if (stat(farm, &statbuf) < 0)
+			goto out_error_cleaned;
+	}
+	goto out_free;
+
+out_error:
+	if (tmpfarm && *tmpfarm)
+		cleanup_directory("flattened view", tmpfarm);
+out_error_cleaned:
+	fprintf(stderr, "Could not create a flattened view of the dependencies\n");
+	free(farm);
+	farm = NULL;
+out_free:
+	free(layers);
+	free(tmpfarm);
+	free(dirs);
+	free(key);
+	return farm;
+}
+
+/**
+ * Mounts an overlay on @mp with the new mount API, appending the lower
+ * layers one at a time so that their number is not bound by the size of
+ * the mount options page.
+ * @return 0 on success or a negative errno.
+ */
+static int
+mount_overlay_fsconfig(const char *mp, char **layers, int numlayers,
+		const char *upperdir, const char *workdir)
+{
+#ifdef SYS_fsopen
+	int i, fsfd, mntfd, ret = 0;
+
+	fsfd = syscall(SYS_fsopen, "overlay", FSOPEN_CLOEXEC);
+	if (fsfd < 0)
+		return -errno;
+	for (i=0; i<numlayers && ret == 0; ++i)
+		if (syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, "lowerdir+", layers[i], 0) < 0)
+			ret = -errno;
+	if (ret == 0 && upperdir && syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, "upperdir", upperdir, 0) < 0)
+		ret = -errno;
+	if (ret == 0 && upperdir && syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, "workdir", workdir, 0) < 0)
+		ret = -errno;
+	if (ret == 0 && upperdir && args.tmpfs) {
+		/* Nothing on the tmpfs outlives the sandbox, so skip syncing it (Linux 5.10+) */
+		syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_FLAG, "volatile", NULL, 0);
+	}
+	if (ret == 0 && syscall(SYS_fsconfig, fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) < 0)
+		ret = -errno;
+	if (ret == 0) {
+		mntfd = syscall(SYS_fsmount, fsfd, FSMOUNT_CLOEXEC, 0);
+		if (mntfd < 0)
+			ret = -errno;
+		else {
+			if (syscall(SYS_move_mount, mntfd, "", AT_FDCWD, mp, MOVE_MOUNT_F_EMPTY_PATH) < 0)
+				ret = -errno;
+			close(mntfd);
+		}
+	}
+	close(fsfd);
+	return ret;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/**
+ * Mounts an overlay on @mp with a single mount(2) call, as supported by
+ * kernels that predate lowerdir+.
+ * @return 0 on success or a negative errno.
+ */
+static int
+mount_overlay_legacy(const char *mp, char **layers, int numlayers,
+		const char *upperdir, const char *workdir)
+{
+	size_t size = strlen("lowerdir=,upperdir=,workdir=,volatile") + 1;
+	char *unionfs, *ptr;
+	int i, ret = 0;
+
+	if (upperdir)
+		size += strlen(upperdir) + strlen(workdir);
+	for (i=0; i<numlayers; ++i)
+		size += strlen(layers[i]) + 1;
+	if (size > sysconf(_SC_PAGESIZE)) {
+		fprintf(stderr, "Too many dependencies to mount on %s with this kernel\n", mp);
+		return -E2BIG;
+	}
+	unionfs = malloc(size);
+	if (! unionfs) {
+		perror("malloc");
+		return -ENOMEM;
+	}
+	ptr = unionfs + sprintf(unionfs, "lowerdir=");
+	for (i=0; i<numlayers; ++i)
+		ptr += sprintf(ptr, "%s%s", i ? ":" : "", layers[i]);
+	if (upperdir)
+		sprintf(ptr, ",upperdir=%s,workdir=%s%s", upperdir, workdir, args.tmpfs ? ",volatile" : "");
+	debug_printf("mount -t overlay none -o %s %s\n", unionfs, mp);
+	if (mount("overlay", mp, "overlay", 0, unionfs) < 0)
+		ret = -errno;
+	if (ret == -EINVAL && upperdir && args.tmpfs) {
+		/* The volatile option requires Linux 5.10 */
+		unionfs[strlen(unionfs)-strlen(",volatile")] = '\0';
+		debug_printf("mount -t overlay none -o %s %s\n", unionfs, mp);
+		ret = mount("overlay", mp, "overlay", 0, unionfs) < 0 ? -errno : 0;
+	}
+	if (ret < 0)
+		verbose_printf("%s\n", unionfs);
+	free(unionfs);
+	return ret;
+}
+
+/**
+ * Mounts an overlay of @layers (highest priority first) on @mp, using the
+ * new mount API when the kernel supports it. The overlay is read-only if
+ * @upperdir is NULL.
+ * @return 0 on success or a negative errno.
+ */
+static int
+mount_overlay(const char *mp, char **layers, int numlayers,
+		const char *upperdir, const char *workdir)
+{
+	static bool have_fsconfig = true;
+	int ret = -ENOSYS;
+
+	if (! upperdir && numlayers == 1) {
+		/* Overlayfs wants two lower layers when there is no upper one */
+		debug_printf("mount --bind %s %s\n", layers[0], mp);
+		return mount(layers[0], mp, NULL, MS_BIND, NULL) < 0 ? -errno : 0;
+	}
+	if (have_fsconfig) {
+		debug_printf("fsmount overlay on %s with %d lower layers, upperdir=%s,workdir=%s\n",
+			mp, numlayers, upperdir ? upperdir : "(none)", workdir ? workdir : "(none)");
+		ret = mount_overlay_fsconfig(mp, layers, numlayers, upperdir, workdir);
+		if (ret == -ENOSYS || ret == -EINVAL) {
+			/* No new mount API or no lowerdir+ (Linux 6.8) */
+			debug_printf("new mount API unavailable (%s), falling back to mount(2)\n", strerror(-ret));
+			have_fsconfig = false;
+		}
+	}
+	if (! have_fsconfig)
+		ret = mount_overlay_legacy(mp, layers, numlayers, upperdir, workdir);
+	return ret;
+}
+
+/**
+ * Mounts the overlays of @mergedirs on the subdirectories of @mountpoint.
+ * They are read-only if there is no upper layer (args.upperlayer is NULL).
+ * @param mountedlayers If not NULL, receives the LAYER_* bits of the
+ * subdirectories that got an overlay
+ */
+static int
+mount_overlay_dirs(struct path_set *mergedirs, const char *mountpoint, unsigned *mountedlayers)
+{
+	const char *sources[] = {"bin", "include", "lib",  "libexec", "share", NULL};
+	const char *aliases[] = {"sbin", NULL,     "lib64", NULL,      NULL,   NULL};
+	const char *targets[] = {"bin", "include", "lib",  "libexec", "share", NULL};
+	const char *mounted[sizeof(targets)/sizeof(targets[0])] = { NULL };
+	struct path_entry *entry;
+
+	char **layers, *farm = NULL, *upperdir, *workdir, mp[strlen(mountpoint)+strlen("libexec")+2];
+	int i, j, res = 0, numlayers = 0, nummounted = 0;
+
+	if (mountedlayers)
+		*mountedlayers = 0;
+
+	/* A no-op unless the entries came from the overlay cache */
+	probe_path_set(mergedirs);
+
+	if (args.flatten) {
+		profile_begin("flatten");
+		farm = get_flattened_view(mergedirs);
+		profile_end();
+	}
+	layers = calloc(mergedirs->count * 2 + 2, sizeof(char *));
+	if (! layers) {
+		perror("calloc");
+		free(farm);
+		return -ENOMEM;
+	}
+	/* Mount directories from sources[] as overlays on /System/Index/targets[] */
+	for (i=0; sources[i] && res == 0; ++i) {
+		sprintf(mp, "%s/%s", mountpoint, targets[i]);
+		numlayers = 0;
+		if (farm) {
+			/* A single lower layer replaces the per-program ones */
+			res = make_path(farm, sources[i], 0, layers, &numlayers);
+		}
+		for (j=0; ! farm && j<2 && res >= 0; ++j) {
+			const char *source = j == 0 ? sources[i] : aliases[i];
+			if (! source)
+				continue;
+			list_for_each_entry(entry, &mergedirs->entries, list) {
+				if (! (entry->layers & (1 << i)))
+					continue;
+				res = make_path(entry->path, source, entry->probe, layers, &numlayers);
+				if (res < 0)
+					break;
+			}
+		}
+		if (res >= 0 && numlayers > 0) {
+			if (! args.pure)
+				layers[numlayers++] = strdup(mp);
+			upperdir = workdir = NULL;
+			if (args.upperlayer && asprintf(&upperdir, "%s/%s", args.upperlayer, sources[i]) < 0)
+				upperdir = NULL;
+			if (args.upperlayer && asprintf(&workdir, "%s/%s", args.writelayer, sources[i]) < 0)
+				workdir = NULL;
+			profile_begin("mount_overlay:%s", targets[i]);
+			if ((! args.upperlayer || (upperdir && workdir)) && layers[numlayers-1])
+				res = mount_overlay(mp, layers, numlayers, upperdir, workdir);
+			else
+				res = -ENOMEM;
+			profile_end();
+			free(upperdir);
+			free(workdir);
+			if (res == 0) {
+				mounted[nummounted++] = targets[i];
+				if (mountedlayers)
+					*mountedlayers |= 1 << i;
+			}
+		}
+		for (j=0; j<numlayers; ++j)
+			free(layers[j]);
+		res = res > 0 ? 0 : res;
+	}
+	if (res != 0)
+		goto out_free;
+	/* Do not keep other conflicting versions of dependencies on /System/Index.
+	 * Only the overlays are touched, as unlinking from the host's tree would
+	 * affect every other process. Read-only overlays are left to whoever
+	 * stacks a write layer on them. */
+	if (args.removedeps && args.upperlayer) {
+		profile_begin("remove_conflicting_deps");
+		remove_conflicting_deps(mergedirs, mountpoint, mounted);
+		profile_end();
+	}
+out_free:
+	if (res != 0)
+		fprintf(stderr, "Failed to mount overlayfs on %s: %s\n", mp, strerror(-res));
+	free(layers);
+	free(farm);
+	return res;
+}
+
+/**
+ * Stacks the write layer on the read-only overlays of a namespace pooled by
+ * runnerd. @pooledlayers holds the LAYER_* bits of the subdirectories of
+ * @mountpoint that runnerd mounted an overlay on.
+ */
+static int
+mount_pooled_overlay_dirs(const struct path_set *mergedirs, const char *mountpoint, unsigned pooledlayers)
+{
+	const char *sources[] = {"bin", "include", "lib",  "libexec", "share", NULL};
+	const char *mounted[sizeof(sources)/sizeof(sources[0])] = { NULL };
+	char *upperdir = NULL, *workdir = NULL, mp[strlen(mountpoint)+strlen("libexec")+2];
+	int i, res = 0, nummounted = 0;
+
+	for (i=0; sources[i] && res == 0; ++i) {
+		char *layers[] = { mp };
+		if (! (pooledlayers & (1 << i)))
+			continue;
+		sprintf(mp, "%s/%s", mountpoint, sources[i]);
+		if (asprintf(&upperdir, "%s/%s", args.upperlayer, sources[i]) < 0 ||
+			asprintf(&workdir, "%s/%s", args.writelayer, sources[i]) < 0) {
+			res = -ENOMEM;
+			break;
+		}
+		profile_begin("mount_overlay:%s", sources[i]);
+		res = mount_overlay(mp, layers, 1, upperdir, workdir);
+		profile_end();
+		free(upperdir);
+		free(workdir);
+		upperdir = workdir = NULL;
+		if (res == 0)
+			mounted[nummounted++] = sources[i];
+	}
+	free(upperdir);
+	if (res != 0) {
+		fprintf(stderr, "Failed to mount overlayfs on %s: %s\n", mp, strerror(-res));
+		return res;
+	}
+	if (args.removedeps) {
+		profile_begin("remove_conflicting_deps");
+		remove_conflicting_deps(mergedirs, mountpoint, mounted);
+		profile_end();
+	}
+	return 0;
+}
+
+/*
+ * Per-closure ld.so.cache, in glibc's "new" format (glibc-ld.so.cache1.1):
+ * a 48-byte header followed by 24-byte entries sorted in descending
+ * _dl_cache_libcmp() order and by the string table. String offsets are
+ * relative to the start of the file.
+ */
+#define LDCACHE_MAGIC        "glibc-ld.so.cache"
+#define LDCACHE_VERSION      "1.1"
+#define LDCACHE_FLAGS_ELF    0x0003   /* FLAG_ELF_LIBC6 */
+#define LDCACHE_FLAGS_X8664  0x0300   /* FLAG_X8664_LIB64 */
+#define LDCACHE_FLAGS_AARCH64 0x0a00  /* FLAG_AARCH64_LIB64 */
+
+struct ldcache_header {
+	char magic[sizeof(LDCACHE_MAGIC)-1];
+	char version[sizeof(LDCACHE_VERSION)-1];
+	uint32_t nlibs;
+	uint32_t len_strings;
+	uint8_t flags;                /* 2 for little endian, 3 for big endian */
+	uint8_t padding[3];
+	uint32_t extension_offset;
+	uint32_t unused[3];
+};
+
+struct ldcache_file_entry {
+	int32_t flags;
+	uint32_t key;
+	uint32_t value;
+	uint32_t osversion;
+	uint64_t hwcap;
+};
+
+struct ldcache_entry {
+	int32_t flags;
+	const char *key;              /* soname */
+	const char *value;            /* Path to the library */
+};
+
+/* Same as glibc's _dl_cache_libcmp(): digits compare numerically */
+static int
+ldcache_libcmp(const char *p1, const char *p2)
+{
+	while (*p1 != '\0') {
+		if (*p1 >= '0' && *p1 <= '9') {
+			if (*p2 >= '0' && *p2 <= '9') {
+				int val1 = *p1++ - '0';
+				int val2 = *p2++ - '0';
+				while (*p1 >= '0' && *p1 <= '9')
+					val1 = val1 * 10 + *p1++ - '0';
+				while (*p2 >= '0' && *p2 <= '9')
+					val2 = val2 * 10 + *p2++ - '0';
+				if (val1 != val2)
+					return val1 - val2;
+			} else {
+				return 1;
+			}
+		} else if (*p2 >= '0' && *p2 <= '9') {
+			return -1;
+		} else if (*p1 != *p2) {
+			return *p1 - *p2;
+		} else {
+			++p1;
+			++p2;
+		}
+	}
+	return *p1 - *p2;
+}
+
+static int
+compare_ldcache_entries(const void *a, const void *b)
+{
+	const struct ldcache_entry *e1 = a, *e2 = b;
+	int ret = ldcache_libcmp(e2->key, e1->key);
+	return ret ? ret : e2->flags - e1->flags;
+}
+
+/**
+ * Returns the ld.so.cache flags of the shared object at @path, or -1 if it
+ * is not an ELF file of a supported machine.
+ */
+static int
+ldcache_object_flags(const char *path)
+{
+	unsigned char ident[EI_NIDENT];
+	uint16_t machine;
+	int fd, flags = -1;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, ident, sizeof(ident), 0) == sizeof(ident) && ! memcmp(ident, ELFMAG, SELFMAG) &&
+		pread(fd, &machine, sizeof(machine), offsetof(Elf64_Ehdr, e_machine)) == sizeof(machine)) {
+		if (machine == EM_X86_64 && ident[EI_CLASS] == ELFCLASS64)
+			flags = LDCACHE_FLAGS_ELF | LDCACHE_FLAGS_X8664;
+		else if (machine == EM_AARCH64 && ident[EI_CLASS] == ELFCLASS64)
+			flags = LDCACHE_FLAGS_ELF | LDCACHE_FLAGS_AARCH64;
+		else if (machine == EM_386 && ident[EI_CLASS] == ELFCLASS32)
+			flags = LDCACHE_FLAGS_ELF;
+	}
+	close(fd);
+	return flags;
+}
+
+/**
+ * Appends an entry to @entries unless one with the same soname and flags is
+ * already there. @seen holds "<flags>:<soname>" for the entries added so far.
+ */
+static int
+ldcache_add(struct ldcache_entry **entries, size_t *num, struct path_set *seen,
+	int32_t flags, const char *key, const char *value)
+{
+	struct ldcache_entry *newentries;
+	char *id;
+	int ret;
+
+	if (asprintf(&id, "%d:%s", flags, key) < 0)
+		return -ENOMEM;
+	ret = path_set_add(seen, id);
+	free(id);
+	if (ret <= 0)
+		return ret;
+	if ((*num & 255) == 0) {
+		newentries = realloc(*entries, (*num + 256) * sizeof(struct ldcache_entry));
+		if (! newentries)
+			return -ENOMEM;
+		*entries = newentries;
+	}
+	(*entries)[*num].flags = flags;
+	(*entries)[*num].key = strdup(key);
+	(*entries)[*num].value = strdup(value);
+	if (! (*entries)[*num].key || ! (*entries)[*num].value)
+		return -ENOMEM;
+	(*num)++;
+	return 1;
+}
+
+/**
+ * Adds the entries of the system's ld.so.cache, which must be in the new
+ * format. Entries that depend on hwcaps are skipped, since their extension
+ * section is not carried over.
+ */
+static int
+ldcache_add_system(struct ldcache_entry **entries, size_t *num, struct path_set *seen)
+{
+	struct ldcache_header *hdr;
+	struct ldcache_file_entry *libs;
+	struct stat statbuf;
+	int fd, ret = -EINVAL;
+	uint32_t i;
+	char *map;
+
+	fd = open(GOBO_LD_SO_CACHE, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t) sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = (struct ldcache_header *) map;
+	libs = (struct ldcache_file_entry *) (map + sizeof(*hdr));
+	if (memcmp(hdr->magic, LDCACHE_MAGIC, sizeof(hdr->magic)) ||
+		memcmp(hdr->version, LDCACHE_VERSION, sizeof(hdr->version)) ||
+		sizeof(*hdr) + (uint64_t) hdr->nlibs * sizeof(*libs) > (uint64_t) statbuf.st_size)
+		goto out;
+	ret = 0;
+	for (i=0; i<hdr->nlibs && ret >= 0; ++i) {
+		if (libs[i].hwcap || libs[i].key >= statbuf.st_size || libs[i].value >= statbuf.st_size ||
+			! memchr(map + libs[i].key, '\0', statbuf.st_size - libs[i].key) ||
+			! memchr(map + libs[i].value, '\0', statbuf.st_size - libs[i].value))
+			continue;
+		ret = ldcache_add(entries, num, seen, libs[i].flags, map + libs[i].key, map + libs[i].value);
+	}
+out:
+	munmap(map, statbuf.st_size);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * Writes an ld.so.cache with @entries to @path.
+ */
+static int
+ldcache_write(const char *path, struct ldcache_entry *entries, size_t num)
+{
+	struct ldcache_header hdr;
+	struct ldcache_file_entry lib;
+	uint32_t offset;
+	size_t i;
+	FILE *fp;
+	int fd;
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return -errno;
+	}
+	qsort(entries, num, sizeof(struct ldcache_entry), compare_ldcache_entries);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LDCACHE_MAGIC, sizeof(hdr.magic));
+	memcpy(hdr.version, LDCACHE_VERSION, sizeof(hdr.version));
+	hdr.nlibs = num;
+	hdr.flags = __BYTE_ORDER == __LITTLE_ENDIAN ? 2 : 3;
+	for (i=0; i<num; ++i)
+		hdr.len_strings += strlen(entries[i].key) + strlen(entries[i].value) + 2;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	offset = sizeof(hdr) + num * sizeof(lib);
+	memset(&lib, 0, sizeof(lib));
+	for (i=0; i<num; ++i) {
+		lib.flags = entries[i].flags;
+		lib.key = offset;
+		offset += strlen(entries[i].key) + 1;
+		lib.value = offset;
+		offset += strlen(entries[i].value) + 1;
+		fwrite(&lib, sizeof(lib), 1, fp);
+	}
+	for (i=0; i<num; ++i) {
+		fwrite(entries[i].key, strlen(entries[i].key) + 1, 1, fp);
+		fwrite(entries[i].value, strlen(entries[i].value) + 1, 1, fp);
+	}
+	return fclose(fp) == 0 ? 0 : -EIO;
+}
+
+/**
+ * Builds the ld.so.cache of @mergedirs into @cachefile: the shared objects of
+ * their lib and lib64 directories, as seen through /System/Index/lib, take
+ * precedence over the entries of the system's cache.
+ */
+static int
+build_ld_cache(const struct path_set *mergedirs, const char *cachefile)
+{
+	const char *subdirs[] = { "lib", "lib64", NULL };
+	struct ldcache_entry *entries = NULL;
+	char path[PATH_MAX], value[PATH_MAX], *tmpfile = NULL;
+	struct path_entry *entry;
+	struct dirent *dirent;
+	struct path_set seen;
+	size_t i, num = 0;
+	int j, flags, ret = 0;
+	DIR *dp;
+
+	path_set_init(&seen);
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		if (! (entry->layers & LAYER_LIB))
+			continue;
+		for (j=0; subdirs[j] && ret >= 0; ++j) {
+			snprintf(path, sizeof(path), "%s/%s", entry->path, subdirs[j]);
+			dp = opendir(path);
+			while (dp && (dirent = readdir(dp)) && ret >= 0) {
+				if (strncmp(dirent->d_name, "lib", 3) || ! strstr(dirent->d_name, ".so"))
+					continue;
+				snprintf(path, sizeof(path), "%s/%s/%s", entry->path, subdirs[j], dirent->d_name);
+				flags = ldcache_object_flags(path);
+				if (flags < 0)
+					continue;
+				snprintf(value, sizeof(value), "%s/lib/%s", GOBO_INDEX_DIR, dirent->d_name);
+				ret = ldcache_add(&entries, &num, &seen, flags, dirent->d_name, value);
+			}
+			if (dp)
+				closedir(dp);
+		}
+	}
+	if (ret >= 0)
+		ret = ldcache_add_system(&entries, &num, &seen);
+	if (ret >= 0 && asprintf(&tmpfile, "%s.XXXXXX", cachefile) < 0)
+		ret = -ENOMEM;
+	if (ret >= 0) {
+		int fd = mkstemp(tmpfile);
+		if (fd < 0) {
+			ret = -errno;
+		} else {
+			if (fchmod(fd, 0644) < 0)
+				ret = -errno;
+			close(fd);
+			if (ret == 0)
+				ret = ldcache_write(tmpfile, entries, num);
+			if (ret == 0 && rename(tmpfile, cachefile) < 0)
+				ret = -errno;
+			if (ret < 0)
+				unlink(tmpfile);
+		}
+	}
+	debug_printf("ld.so.cache: %zu entries written to %s: %s\n", num, cachefile, ret < 0 ? strerror(-ret) : "ok");
+	for (i=0; i<num; ++i) {
+		free((char *) entries[i].key);
+		free((char *) entries[i].value);
+	}
+	free(entries);
+	free(tmpfile);
+	path_set_free(&seen);
+	return ret;
+}
+
+/**
+ * Tells if the mount holding @path propagates mount events to peers, in
+ * which case mounting over @path would affect other namespaces. Errs on
+ * the side of "shared" if /proc/self/mountinfo cannot be read.
+ */
+static bool
+mount_is_shared(const char *path)
+{
+	char *line = NULL, *end, mountpoint[PATH_MAX];
+	size_t size = 0, bestlen = 0, len;
+	bool shared = true;
+	FILE *fp;
+
+	fp = fopen("/proc/self/mountinfo", "re");
+	if (! fp)
+		return true;
+	/* Format: id parent major:minor root mountpoint options [optional fields...] - type ... */
+	while (getline(&line, &size, fp) > 0) {
+		end = strstr(line, " - ");
+		if (! end || sscanf(line, "%*s %*s %*s %*s %4095s", mountpoint) != 1)
+			continue;
+		*end = '\0';
+		len = strlen(mountpoint);
+		if (strncmp(path, mountpoint, len) || (path[len] != '/' && path[len] != '\0' && len > 1))
+			continue;
+		if (len >= bestlen) {
+			/* Later entries with the same mount point are stacked on top */
+			bestlen = len;
+			shared = strstr(line, " shared:") != NULL;
+		}
+	}
+	free(line);
+	fclose(fp);
+	return shared;
+}
+
+/**
+ * Bind-mounts an ld.so.cache of the closure over /etc/ld.so.cache, so that the
+ * dynamic loader finds its libraries with a single lookup rather than by
+ * probing /System/Index/lib through LD_LIBRARY_PATH. The file is cached per
+ * closure, keyed by the identity of each lib directory and of the system's
+ * cache.
+ */
+static int
+mount_ld_cache(const struct path_set *mergedirs)
+{
+	char *key = NULL, *cachefile = NULL, path[PATH_MAX];
+	struct path_entry *entry;
+	struct stat statbuf;
+	int ret = -ENOMEM;
+
+	if (geteuid() != 0 || make_directory(GOBO_RUNNER_CACHE_DIR, 0755) < 0)
+		return -EPERM;
+	if (append_cache_stamp(&key, GOBO_LD_SO_CACHE) < 0)
+		goto out_free;
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		if (! (entry->layers & LAYER_LIB))
+			continue;
+		snprintf(path, sizeof(path), "%s/lib", entry->path);
+		if (append_cache_stamp(&key, path) < 0)
+			goto out_free;
+		snprintf(path, sizeof(path), "%s/lib64", entry->path);
+		if (append_cache_stamp(&key, path) < 0)
+			goto out_free;
+	}
+	if (asprintf(&cachefile, "%s/ld.so.cache-%016llx", GOBO_RUNNER_CACHE_DIR,
+			(unsigned long long) hash_string(key)) < 0) {
+		cachefile = NULL;
+		goto out_free;
+	}
+
+	/* Only trust files written by Runner itself */
+	if (stat(cachefile, &statbuf) < 0 || statbuf.st_uid != 0) {
+		evict_cache_entries(GOBO_RUNNER_CACHE_DIR, "ld.so.cache-");
+		ret = build_ld_cache(mergedirs, cachefile);
+		if (ret < 0)
+			goto out_free;
+	} else {
+		touch_cache_entry(cachefile);
+	}
+
+	/* The bind mount would show up over the host's ld.so.cache otherwise */
+	if (mount_is_shared(GOBO_LD_SO_CACHE)) {
+		fprintf(stderr, "%s is on a shared mount, not replacing it\n", GOBO_LD_SO_CACHE);
+		ret = -EBUSY;
+		goto out_free;
+	}
+	ret = mount(cachefile, GOBO_LD_SO_CACHE, NULL, MS_BIND, NULL);
+	if (ret < 0) {
+		ret = -errno;
+		debug_printf("bind-mount %s over %s: %s\n", cachefile, GOBO_LD_SO_CACHE, strerror(errno));
+	} else {
+		verbose_printf("using %s as %s\n", cachefile, GOBO_LD_SO_CACHE);
+	}
+
+out_free:
+	free(cachefile);
+	free(key);
+	return ret;
+}
+
+/**
+ * Lists the Resources/Environment files shipped by the programs in
+ * @mergedirs, in overlay order.
+ * @return A NULL-terminated, malloc'd array of malloc'd paths, or NULL on
+ * failure.
+ */
+static char **
+get_environment_files(const struct path_set *mergedirs)
+{
+	struct path_entry *entry;
+	struct stat statbuf;
+	char **envfiles, *env;
+	int num = 0;
+
+	envfiles = calloc(mergedirs->count + 1, sizeof(char *));
+	if (! envfiles) {
+		perror("calloc");
+		return NULL;
+	}
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		if ((entry->probe & PROBE_DONE) && ! (entry->probe & PROBE_ENVIRONMENT))
+			continue;
+		if (asprintf(&env, "%s/Resources/Environment", entry->path) < 0) {
+			perror("asprintf");
+			break;
+		}
+		if (stat(env, &statbuf) == 0)
+			envfiles[num++] = env;
+		else
+			free(env);
+	}
+	return envfiles;
+}
+
+static void
+free_environment_files(char **envfiles)
+{
+	for (int i=0; envfiles && envfiles[i]; ++i)
+		free(envfiles[i]);
+	free(envfiles);
+}
+
+/**
+ * Returns a bash script that sources each of @envfiles.
+ */
+static char *
+make_source_script(char **envfiles, const char *command)
+{
+	char *script = NULL;
+	size_t len = 0;
+	FILE *fp = open_memstream(&script, &len);
+	if (! fp)
+		return NULL;
+	for (int i=0; envfiles[i]; ++i) {
+		fprintf(fp, "source '");
+		for (const char *ptr=envfiles[i]; *ptr; ++ptr)
+			fprintf(fp, *ptr == '\'' ? "'\\''" : "%c", *ptr);
+		fprintf(fp, "'\n");
+	}
+	fprintf(fp, "%s\n", command);
+	fclose(fp);
+	return script;
+}
+
+/**
+ * Variables that bash sets on its own and that do not belong to the delta.
+ */
+static bool
+volatile_env_var(const char *var)
+{
+	const char *names[] = { "_=", "PWD=", "OLDPWD=", "SHLVL=", NULL };
+	for (int i=0; names[i]; ++i)
+		if (! strncmp(var, names[i], strlen(names[i])))
+			return true;
+	return false;
+}
+
+/**
+ * The environment delta depends on the Environment files and on the
+ * environment they are evaluated in.
+ */
+static char *
+make_environment_key(char **envfiles)
+{
+	extern char **environ;
+	struct stat statbuf;
+	char *key = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int i;
+
+	fp = open_memstream(&key, &len);
+	if (! fp)
+		return NULL;
+	for (i=0; envfiles[i]; ++i) {
+		if (stat(envfiles[i], &statbuf) < 0)
+			memset(&statbuf, 0, sizeof(statbuf));
+		fprintf(fp, "%s:%ld.%09ld:%ld|", envfiles[i], (long) statbuf.st_mtim.tv_sec,
+				(long) statbuf.st_mtim.tv_nsec, (long) statbuf.st_size);
+	}
+	uint64_t hash = 0;
+	for (i=0; environ[i]; ++i)
+		if (! volatile_env_var(environ[i]))
+			hash = hash * 31 + hash_string(environ[i]);
+	fprintf(fp, "env=%016llx", (unsigned long long) hash);
+	fclose(fp);
+	return key;
+}
+
+/**
+ * Sources @envfiles in a bash instance and computes the resulting changes
+ * to the environment.
+ * @return The delta as a buffer of NUL-terminated records, either
+ * "NAME=VALUE" (set) or "NAME" (unset), or NULL on failure.
+ */
+static char *
+evaluate_environment_files(char **envfiles, size_t *deltalen)
+{
+	extern char **environ;
+	char *script, *output = NULL, *delta = NULL, *ptr, *eq;
+	size_t outlen = 0, outsize = 0, len = 0;
+	int pipefd[2], status, i;
+	ssize_t n;
+	FILE *fp;
+	pid_t pid;
+
+	script = make_source_script(envfiles, "exec env -0");
+	if (! script || pipe(pipefd) < 0) {
+		free(script);
+		return NULL;
+	}
+	pid = fork();
+	if (pid == 0) {
+		close(pipefd[0]);
+		dup2(pipefd[1], STDOUT_FILENO);
+		execl("/bin/bash", "bash", "-c", script, NULL);
+		_exit(127);
+	}
+	close(pipefd[1]);
+	free(script);
+	if (pid < 0) {
+		close(pipefd[0]);
+		return NULL;
+	}
+	do {
+		if (outlen + 4096 > outsize) {
+			char *newbuf = realloc(output, outsize + 65536);
+			if (! newbuf)
+				break;
+			output = newbuf;
+			outsize += 65536;
+		}
+		n = read(pipefd[0], &output[outlen], outsize - outlen - 1);
+		if (n > 0)
+			outlen += n;
+	} while (n > 0 || (n < 0 && errno == EINTR));
+	close(pipefd[0]);
+	waitpid(pid, &status, 0);
+	if (! output || ! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		free(output);
+		return NULL;
+	}
+	output[outlen] = '\0';
+
+	fp = open_memstream(&delta, &len);
+	if (! fp) {
+		free(output);
+		return NULL;
+	}
+	/* Variables set or modified by the Environment files */
+	for (ptr=output; ptr < &output[outlen]; ptr += strlen(ptr) + 1) {
+		eq = strchr(ptr, '=');
+		if (! eq || volatile_env_var(ptr))
+			continue;
+		*eq = '\0';
+		const char *value = getenv(ptr);
+		*eq = '=';
+		if (! value || strcmp(value, eq+1))
+			fwrite(ptr, strlen(ptr) + 1, 1, fp);
+	}
+	/* Variables unset by the Environment files */
+	for (i=0; environ[i]; ++i) {
+		bool found = false;
+		size_t namelen;
+		eq = strchr(environ[i], '=');
+		if (! eq || volatile_env_var(environ[i]))
+			continue;
+		namelen = eq - environ[i] + 1;
+		for (ptr=output; ptr < &output[outlen] && ! found; ptr += strlen(ptr) + 1)
+			found = ! strncmp(ptr, environ[i], namelen);
+		if (! found) {
+			fwrite(environ[i], namelen - 1, 1, fp);
+			fputc('\0', fp);
+		}
+	}
+	fclose(fp);
+	free(output);
+	*deltalen = len;
+	return delta;
+}
+
+static void
+apply_environment_delta(const char *delta, size_t len)
+{
+	const char *ptr;
+	char *eq;
+
+	for (ptr=delta; ptr < &delta[len]; ptr += strlen(ptr) + 1) {
+		eq = strchr(ptr, '=');
+		if (eq) {
+			*eq = '\0';
+			setenv(ptr, eq+1, 1);
+			*eq = '=';
+		} else {
+			unsetenv(ptr);
+		}
+	}
+}
+
+/**
+ * Applies the environment produced by sourcing @envfiles to the current
+ * process, so that the program can be exec'd without a bash wrapper. The
+ * delta is cached under ~/.local/Runner/environment, keyed by the files'
+ * modification times and by the environment they were evaluated in.
+ * Must be called after dropping privileges.
+ * @return 0 on success or a negative value on failure.
+ */
+static int
+apply_environment_snapshot(char **envfiles)
+{
+	char *key, *cachedir = NULL, *cachefile = NULL, *tmpfile = NULL, *buf = NULL, *delta;
+	const char *home = getenv("HOME");
+	size_t len = 0, keylen;
+	struct stat statbuf;
+	int fd, ret = -1;
+
+	key = make_environment_key(envfiles);
+	if (! key)
+		return -ENOMEM;
+	keylen = strlen(key) + 1;
+	if (asprintf(&cachedir, "%s/.local/Runner/environment", home ? home : "/tmp") < 0 ||
+		asprintf(&cachefile, "%s/%016llx", cachedir, (unsigned long long) hash_string(key)) < 0)
+		goto out_free;
+
+	/* Cached entries start with their (NUL-terminated) key */
+	fd = open(cachefile, O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		if (fstat(fd, &statbuf) == 0 && (size_t) statbuf.st_size >= keylen &&
+			(buf = malloc(statbuf.st_size)) != NULL &&
+			read(fd, buf, statbuf.st_size) == statbuf.st_size &&
+			memcmp(buf, key, keylen) == 0) {
+			debug_printf("using environment snapshot %s\n", cachefile);
+			apply_environment_delta(&buf[keylen], statbuf.st_size - keylen);
+			close(fd);
+			ret = 0;
+			goto out_free;
+		}
+		close(fd);
+	}
+
+	delta = evaluate_environment_files(envfiles, &len);
+	if (! delta)
+		goto out_free;
+	apply_environment_delta(delta, len);
+	ret = 0;
+
+	if (make_directory(cachedir, 0755) == 0 && asprintf(&tmpfile, "%s.XXXXXX", cachefile) > 0) {
+		fd = mkstemp(tmpfile);
+		if (fd >= 0) {
+			if (write(fd, key, keylen) == keylen && write(fd, delta, len) == len && close(fd) == 0)
+				rename(tmpfile, cachefile);
+			else
+				unlink(tmpfile);
+		}
+		free(tmpfile);
+	}
+	free(delta);
+
+out_free:
+	free(buf);
+	free(cachefile);
+	free(cachedir);
+	free(key);
+	return ret;
+}
+
+/**
+ * Returns 0 if the wrapper has been successfully created, a negative value on
+ * error, and 1 if no Resources/Environment files were available to justify the
+ * creation of a wrapper.
+ */
+static int
+create_wrapper(const struct path_set *mergedirs)
+{
+	int ret = 1;
+	FILE *fp = NULL;
+	bool keep_wrapper = false;
+
+	if (args.sourceenv) {
+		/* Shebang */
+		ret = asprintf(&args.wrapper, "%s/wrapper", args.workdir);
+		if (ret < 0) {
+			perror("asprintf");
+			return -ENOMEM;
+		}
+		verbose_printf("Creating wrapper %s\n", args.wrapper);
+
+		fp = fopen(args.wrapper, "w");
+		if (! fp) {
+			ret = -errno;
+			fprintf(stderr, "open %s: %s\n", args.wrapper, strerror(errno));
+			goto out_error;
+		}
+		fprintf(fp, "#!/bin/bash\n\n");
+
+		/* Source environment variables */
+		char **envfiles = get_environment_files(mergedirs);
+		if (! envfiles) {
+			fclose(fp);
+			ret = -ENOMEM;
+			goto out_error;
+		}
+		for (int i=0; envfiles[i]; ++i) {
+			fprintf(fp, "source %s\n", envfiles[i]);
+			keep_wrapper = true;
+		}
+		free_environment_files(envfiles);
+
+		/* Call user program */
+		if (keep_wrapper) {
+			for (int i=0; args.arguments[i]; ++i) {
+				if (strstr(args.arguments[i], " "))
+					fprintf(fp, "\"%s\"%c", args.arguments[i], args.arguments[i+1] ? ' ' : '\n');
+				else
+					fprintf(fp, "%s%c", args.arguments[i], args.arguments[i+1] ? ' ' : '\n');
+			}
+			fclose(fp);
+
+			chown(args.wrapper, getuid(), getgid());
+			chmod(args.wrapper, 0755);
+			ret = 0;
+		} else {
+			fclose(fp);
+			ret = 1;
+		}
+	}
+
+out_error:
+	if (ret != 0 && args.wrapper) {
+		if (args.cleanup)
+			unlink(args.wrapper);
+		free(args.wrapper);
+	}
+	return ret;
+}
+
+static char *
+parse_elf_file(const char *executable)
+{
+	char *arch = NULL;
+	struct stat statbuf;
+	int fd = open_object_file(executable, &statbuf);
+	FILE *fp = fd >= 0 ? fdopen(fd, "r") : NULL;
+	if (fd >= 0 && ! fp)
+		close(fd);
+	if (fp) {
+		char ident[EI_NIDENT];
+		size_t n = fread(ident, sizeof(ident), 1, fp);
+		if (n <= 0 || memcmp(ident, ELFMAG, SELFMAG) != 0) {
+			fclose(fp);
+			return NULL;
+		}
+		rewind(fp);
+
+		int e_machine = 0;
+		if (ident[EI_CLASS] == ELFCLASS32) {
+			Elf32_Ehdr hdr;
+			if (fread(&hdr, sizeof(hdr), 1, fp) <= 0) {
+				fclose(fp);
+				return NULL;
+			}
+			e_machine = (int) hdr.e_machine;
+		} else if (ident[EI_CLASS] == ELFCLASS64) {
+			Elf64_Ehdr hdr;
+			if (fread(&hdr, sizeof(hdr), 1, fp) <= 0) {
+				fclose(fp);
+				return NULL;
+			}
+			e_machine = (int) hdr.e_machine;
+		}
+		fclose(fp);
+
+		switch (e_machine) {
+			case EM_386:
+				arch = strdup("i686");
+				break;
+			case EM_X86_64:
+				arch = strdup("x86_64");
+				break;
+			default:
+				break;
+		}
+	}
+	return arch;
+}
+
+static char *
+parse_architecture_file(const char *archfile)
+{
+	struct stat statbuf;
+	char line[64];
+	size_t n;
+
+	int res = stat(archfile, &statbuf);
+	if (res < 0 && errno == EACCES) {
+		perror(archfile);
+		return NULL;
+	}
+
+	FILE *fp = fopen(archfile, "r");
+	if (fp) {
+		memset(line, 0, sizeof(line));
+		n = fread(line, sizeof(char), sizeof(line)-1, fp);
+		if (n > 0 && line[n-1] == '\n')
+			line[n-1] = '\0';
+		fclose(fp);
+		return strstr(line, "i386") ? strdup("i686") : strdup(line);
+	}
+	return NULL;
+}
+
+static char *
+open_program_file(const char *programdir, const char *path)
+{
+	struct stat statbuf;
+	char *fname = NULL;
+	int res;
+
+	if (asprintf(&fname, "%s%s", programdir, path) <= 0) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+	res = stat(fname, &statbuf);
+	if (res == 0 && statbuf.st_size > 1)
+		return fname;
+	else if (res < 0 && errno != ENOENT)
+		perror(fname);
+
+	free(fname);
+	return NULL;
+}
+
+/**
+ * Appends the identity of @path (inode and modification time) to the cache
+ * key being built in @key. Missing files are recorded as such, so that their
+ * later creation also invalidates the cache.
+ */
+static int
+append_cache_stamp(char **key, const char *path)
+{
+	struct stat statbuf;
+	char *newkey;
+	int ret;
+
+	if (stat(path, &statbuf) < 0)
+		memset(&statbuf, 0, sizeof(statbuf));
+	ret = asprintf(&newkey, "%s|%s:%lu:%ld.%09ld", *key ? *key : "", path,
+			(unsigned long) statbuf.st_ino, (long) statbuf.st_mtim.tv_sec,
+			(long) statbuf.st_mtim.tv_nsec);
+	if (ret < 0)
+		return -ENOMEM;
+	free(*key);
+	*key = newkey;
+	return 0;
+}
+
+/**
+ * Builds the key that identifies a resolved overlay: the program directory,
+ * the identity of each dependencies file and the flags that affect their
+ * resolution.
+ */
+static char *
+make_overlay_cache_key(const char *programdir, const char *depsfile)
+{
+	char *key = NULL;
+	int i, ret;
+
+	ret = asprintf(&key, "%s|%s|strict=%d|pure=%d",
+			programdir ? programdir : "",
+			args.architecture ? args.architecture : "",
+			args.strict, args.pure);
+	if (ret < 0)
+		return NULL;
+	if (depsfile && append_cache_stamp(&key, depsfile) < 0)
+		goto out_error;
+	for (i=0; args.dependencies[i]; ++i)
+		if (append_cache_stamp(&key, args.dependencies[i]) < 0)
+			goto out_error;
+	if (args.pure && append_cache_stamp(&key, GOBO_BASH_DEPENDENCIES) < 0)
+		goto out_error;
+	if (append_cache_stamp(&key, GOBO_COMPATIBILITY_LIST) < 0)
+		goto out_error;
+	return key;
+
+out_error:
+	free(key);
+	return NULL;
+}
+
+static char *
+get_overlay_cache_file(const char *key)
+{
+	char *cachefile = NULL;
+	if (asprintf(&cachefile, "%s/overlay-%016llx", GOBO_RUNNER_CACHE_DIR,
+			(unsigned long long) hash_string(key)) < 0)
+		return NULL;
+	return cachefile;
+}
+
+/**
+ * Checks if the modification time recorded in a cache 'stamp' line still
+ * matches the one of the directory it refers to.
+ */
+static bool
+overlay_cache_stamp_valid(char *line)
+{
+	struct stat statbuf;
+	long sec, nsec;
+	int offset = 0;
+
+	if (sscanf(line, "stamp %ld %ld %n", &sec, &nsec, &offset) != 2 || offset == 0)
+		return false;
+	if (stat(&line[offset], &statbuf) < 0)
+		return false;
+	return statbuf.st_mtim.tv_sec == sec && statbuf.st_mtim.tv_nsec == nsec;
+}
+
+/**
+ * Looks up a previously resolved overlay in the persistent cache.
+ * @param key Key produced by make_overlay_cache_key()
+ * @param mergedirs Filled with the cached program directories
+ * @param needs_wrapper Filled with the cached needs_wrapper decision
+ * @return true on a cache hit, false otherwise.
+ */
+static bool
+load_overlay_cache(const char *key, struct path_set *mergedirs, bool *needs_wrapper)
+{
+	char *cachefile, *line = NULL, *cached = NULL;
+	bool key_valid = false, wrapper = false;
+	struct stat statbuf;
+	size_t len = 0;
+	ssize_t n;
+	FILE *fp;
+
+	cachefile = get_overlay_cache_file(key);
+	if (! cachefile)
+		return false;
+	fp = fopen(cachefile, "r");
+	if (! fp) {
+		free(cachefile);
+		return false;
+	}
+
+	/* Only trust entries written by Runner itself */
+	if (fstat(fileno(fp), &statbuf) < 0 || statbuf.st_uid != 0)
+		goto out_miss;
+
+	while ((n = getline(&line, &len, fp)) > 0) {
+		if (line[n-1] == '\n')
+			line[n-1] = '\0';
+		if (! strncmp(line, "key=", 4)) {
+			key_valid = strcmp(&line[4], key) == 0;
+			if (! key_valid)
+				goto out_miss;
+		} else if (! strncmp(line, "needs_wrapper=", 14)) {
+			wrapper = line[14] == '1';
+		} else if (! strncmp(line, "stamp ", 6)) {
+			if (! overlay_cache_stamp_valid(line)) {
+				debug_printf("overlay cache: %s is stale\n", cachefile);
+				goto out_miss;
+			}
+		} else if (! strncmp(line, "mergedirs=", 10)) {
+			free(cached);
+			cached = strdup(&line[10]);
+		}
+	}
+	if (! key_valid || ! cached || ! strlen(cached))
+		goto out_miss;
+	if (path_set_add_string(mergedirs, cached) < 0) {
+		path_set_free(mergedirs);
+		goto out_miss;
+	}
+
+	verbose_printf("using cached overlay from %s\n", cachefile);
+	touch_cache_entry(cachefile);
+	*needs_wrapper = wrapper;
+	free(cached);
+	free(line);
+	free(cachefile);
+	fclose(fp);
+	return true;
+
+out_miss:
+	free(cached);
+	free(line);
+	free(cachefile);
+	fclose(fp);
+	return false;
+}
+
+/**
+ * Stores a resolved overlay in the persistent cache, along with the
+ * modification time of each $goboPrograms/<App> directory it references and
+ * of the Resources directory of each program directory, which tells if one
+ * of them gained or lost a Resources/Environment file.
+ */
+static void
+save_overlay_cache(const char *key, const struct path_set *mergedirs, bool needs_wrapper)
+{
+	char *cachefile, *tmpfile = NULL, *str, appdir[PATH_MAX], resources[PATH_MAX];
+	struct path_entry *entry;
+	struct stat statbuf;
+	FILE *fp;
+	int fd;
+
+	/* The cache is shared among users, so only a privileged Runner updates it */
+	if (geteuid() != 0 || make_directory(GOBO_RUNNER_CACHE_DIR, 0755) < 0)
+		return;
+	cachefile = get_overlay_cache_file(key);
+	if (! cachefile)
+		return;
+	evict_cache_entries(GOBO_RUNNER_CACHE_DIR, "overlay-");
+	if (asprintf(&tmpfile, "%s.XXXXXX", cachefile) < 0) {
+		free(cachefile);
+		return;
+	}
+	fd = mkstemp(tmpfile);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmpfile);
+		}
+		goto out_free;
+	}
+	fchmod(fd, 0644);
+
+	fprintf(fp, "Runner overlay cache\n");
+	fprintf(fp, "key=%s\n", key);
+	fprintf(fp, "needs_wrapper=%d\n", needs_wrapper);
+	if (stat(GOBO_PROGRAMS_DIR, &statbuf) == 0)
+		fprintf(fp, "stamp %ld %ld %s\n", (long) statbuf.st_mtim.tv_sec,
+				(long) statbuf.st_mtim.tv_nsec, GOBO_PROGRAMS_DIR);
+
+	/* Record the mtime of $goboPrograms/<App> for each /Programs/<App>/<Version> */
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		/* Without Resources, the version directory changes when it is created */
+		snprintf(resources, sizeof(resources), "%s/Resources", entry->path);
+		if (stat(resources, &statbuf) < 0)
+			snprintf(resources, sizeof(resources), "%s", entry->path);
+		if (stat(resources, &statbuf) == 0)
+			fprintf(fp, "stamp %ld %ld %s\n", (long) statbuf.st_mtim.tv_sec,
+					(long) statbuf.st_mtim.tv_nsec, resources);
+		snprintf(appdir, sizeof(appdir), "%s", entry->path);
+		char *version = strrchr(appdir, '/');
+		if (! version || version == appdir)
+			continue;
+		*version = '\0';
+		if (stat(appdir, &statbuf) == 0)
+			fprintf(fp, "stamp %ld %ld %s\n", (long) statbuf.st_mtim.tv_sec,
+					(long) statbuf.st_mtim.tv_nsec, appdir);
+	}
+
+	str = path_set_to_string(mergedirs);
+	fprintf(fp, "mergedirs=%s\n", str ? str : "");
+	free(str);
+	if (fclose(fp) != 0 || rename(tmpfile, cachefile) < 0) {
+		perror(cachefile);
+		unlink(tmpfile);
+	} else {
+		debug_printf("overlay cache: saved %s\n", cachefile);
+	}
+
+out_free:
+	free(tmpfile);
+	free(cachefile);
+}
+
+/**
+ * Resolves the closure of Bash, which --pure merges into every sandbox. It only
+ * depends on which Bash is Current, so it is cached on its own and reused by
+ * all pure launches until that link or its Dependencies file change.
+ * @param basedirs Filled with the program directories of the base layer
+ * @param needs_wrapper Set to true if any of them ships a Resources/Environment file
+ * @return 0 on success or -1 if the base layer could not be resolved.
+ */
+static int
+resolve_pure_base_layer(struct path_set *basedirs, bool *needs_wrapper)
+{
+	char current[PATH_MAX], *key = NULL;
+	ssize_t len;
+	int ret;
+
+	path_set_init(basedirs);
+	*needs_wrapper = false;
+
+	if (args.cache) {
+		len = readlink(GOBO_PROGRAMS_DIR "/Bash/Current", current, sizeof(current)-1);
+		current[len > 0 ? len : 0] = '\0';
+		if (asprintf(&key, "pure-base|%s|%s|strict=%d", current,
+				args.architecture ? args.architecture : "", args.strict) < 0)
+			key = NULL;
+		if (key && (append_cache_stamp(&key, GOBO_BASH_DEPENDENCIES) < 0 ||
+				append_cache_stamp(&key, GOBO_COMPATIBILITY_LIST) < 0)) {
+			free(key);
+			key = NULL;
+		}
+		if (key && load_overlay_cache(key, basedirs, needs_wrapper)) {
+			free(key);
+			return 0;
+		}
+	}
+
+	ret = prepare_merge_string(basedirs, NULL, NULL, GOBO_BASH_DEPENDENCIES, needs_wrapper);
+	if (ret >= 0 && key)
+		save_overlay_cache(key, basedirs, *needs_wrapper);
+	free(key);
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * resolve_overlay:
+ * @param mergedirs Filled with the program directories to merge, in overlay order.
+ * @param needs_wrapper Set to true if any of the merged programs ships a
+ * Resources/Environment file.
+ * @return 0 on success or -1 on failure.
+ */
+static int
+resolve_overlay(struct path_set *mergedirs, bool *needs_wrapper)
+{
+	struct stat statbuf;
+	int i, res = -1;
+	char *programdir = NULL, *callerprogram;
+	char *archfile = NULL, *fname = NULL, *depsfile = NULL, *cachekey = NULL;
+	struct path_set mergedirs_program;
+	struct path_entry *entry;
+
+	*needs_wrapper = false;
+	path_set_init(mergedirs);
+	path_set_init(&mergedirs_program);
+
+	if (args.architecture == NULL) {
+		/* If args.executable is an ELF file, try to determine architecture from the header */
+		args.architecture = parse_elf_file(args.executable);
+	}
+
+	programdir = get_program_dir(args.executable, false);
+	if (programdir) {
+		/* check if the software's Resources/Dependencies file exists */
+		depsfile = open_program_file(programdir, "/Resources/Dependencies");
+		if (depsfile == NULL) {
+			/* try again with Resources/BuildInformation */
+			depsfile = open_program_file(programdir, "/Resources/BuildInformation");
+		}
+		if (args.architecture == NULL) {
+			/* Try to determine architecture based on the Resources/Architecture metadata file */
+			if (asprintf(&archfile, "%s/Resources/Architecture", programdir) <= 0) {
+				fprintf(stderr, "Not enough memory\n");
+				goto out_free;
+			}
+			/* TODO: args.architecture is never freed */
+			args.architecture = parse_architecture_file(archfile);
+		}
+	}
+
+	if (args.trace_access) {
+		args.programdir = programdir ? strdup(programdir) : NULL;
+		args.depsfile = depsfile ? strdup(depsfile) : NULL;
+	}
+
+	if (args.cache) {
+		/* A warm launch skips dependency resolution altogether */
+		cachekey = make_overlay_cache_key(programdir, depsfile);
+		if (cachekey && load_overlay_cache(cachekey, mergedirs, needs_wrapper)) {
+			res = 0;
+			goto out_free;
+		}
+	}
+
+	if (programdir) {
+		callerprogram = program_in_ignorelist(programdir) ? NULL : programdir;
+		res = depsfile ? prepare_merge_string(&mergedirs_program, NULL, callerprogram, depsfile, needs_wrapper) : -1;
+		if (res < 0) {
+			/* For some reason the Dependencies file could not be parsed. Still,
+			 * we want to make sure that the callerprogram's directory is included
+			 * in @mergedirs so that things like the Environment file are properly
+			 * included in the wrapper file
+			 */
+			path_set_free(&mergedirs_program);
+			if (path_set_add(&mergedirs_program, programdir) < 0) {
+				fprintf(stderr, "Not enough memory\n");
+				goto out_free;
+			}
+			if (*needs_wrapper == false) {
+				char *path = open_program_file(programdir, "/Resources/Environment");
+				*needs_wrapper = path != NULL;
+				free(path);
+			}
+		}
+	}
+
+	for (i=0; args.dependencies[i]; ++i) {
+		/* take user-provided dependencies file */
+		fname = strdup(args.dependencies[i]);
+		if (! fname) {
+			fprintf(stderr, "Not enough memory\n");
+			goto out_free;
+		}
+		res = stat(fname, &statbuf);
+		if (res < 0) {
+			perror(fname);
+			goto out_free;
+		}
+		prepare_merge_string(mergedirs, &mergedirs_program, NULL, fname, needs_wrapper);
+		free(fname);
+		fname = NULL;
+	}
+
+	if (args.pure) {
+		/* Make sure that all of Bash dependencies are part of the overlay */
+		struct path_set basedirs;
+		bool base_wrapper;
+
+		profile_begin("pure_base_layer");
+		if (resolve_pure_base_layer(&basedirs, &base_wrapper) == 0) {
+			list_for_each_entry(entry, &basedirs.entries, list) {
+				if (path_set_contains(&mergedirs_program, entry->path))
+					continue;
+				if (path_set_add(mergedirs, entry->path) < 0) {
+					fprintf(stderr, "Not enough memory\n");
+					path_set_free(&basedirs);
+					profile_end();
+					res = -1;
+					goto out_free;
+				}
+			}
+			*needs_wrapper = *needs_wrapper || base_wrapper;
+		}
+		path_set_free(&basedirs);
+		profile_end();
+	}
+
+	/* User-provided dependencies take precedence over the program's own */
+	res = 0;
+	list_for_each_entry(entry, &mergedirs_program.entries, list) {
+		if (path_set_add(mergedirs, entry->path) < 0) {
+			fprintf(stderr, "Not enough memory\n");
+			res = -1;
+			goto out_free;
+		}
+	}
+
+	if (cachekey)
+		save_overlay_cache(cachekey, mergedirs, *needs_wrapper);
+
+out_free:
+	if (programdir) { free(programdir); }
+	path_set_free(&mergedirs_program);
+	if (res < 0) { path_set_free(mergedirs); }
+	if (archfile) { free(archfile); }
+	if (depsfile) { free(depsfile); }
+	if (cachekey) { free(cachekey); }
+	if (fname) { free(fname); }
+	return res;
+}
+
+/**
+ * update_env_var_list:
+ */
+static int
+update_env_var_list(const char *var, const char *item)
+{
+	const char *env;
+	char *value;
+	int ret;
+
+	env = getenv(var);
+	if (env == NULL || *env == 0) {
+		setenv(var, item, 1);
+	} else {
+		ret = asprintf(&value, "%s:%s", item, env);
+		if (ret <= 0) {
+			return ERR_OUTMEMORY;
+		} else {
+			setenv(var, value, 1);
+			free(value);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Mounts a size-limited tmpfs on GOBO_RUNNER_TMPFS_DIR and creates the
+ * overlayfs upper and write layers on it. The mount is only visible from
+ * the sandbox's namespace and vanishes with it, so there is nothing to
+ * clean up on exit.
+ */
+static int
+create_tmpfs_write_layer(void)
+{
+	const char *sources[] = {"bin", "include", "lib",  "libexec", "share", NULL};
+	char *options = NULL, path[PATH_MAX];
+	int ret, i;
+
+	ret = make_directory(GOBO_RUNNER_TMPFS_DIR, 0755);
+	if (ret < 0) {
+		fprintf(stderr, "mkdir %s: %s\n", GOBO_RUNNER_TMPFS_DIR, strerror(-ret));
+		return ret;
+	}
+	if (asprintf(&options, "size=%s,mode=0755", args.tmpfs) < 0) {
+		perror("asprintf");
+		return -ENOMEM;
+	}
+	debug_printf("mount -t tmpfs none -o %s %s\n", options, GOBO_RUNNER_TMPFS_DIR);
+	ret = mount("tmpfs", GOBO_RUNNER_TMPFS_DIR, "tmpfs", MS_NOSUID|MS_NODEV, options);
+	free(options);
+	if (ret < 0) {
+		ret = -errno;
+		fprintf(stderr, "mount tmpfs on %s: %s\n", GOBO_RUNNER_TMPFS_DIR, strerror(errno));
+		return ret;
+	}
+
+	args.workdir = strdup(GOBO_RUNNER_TMPFS_DIR);
+	if (asprintf(&args.writelayer, "%s/write_layer", args.workdir) < 0 ||
+		asprintf(&args.upperlayer, "%s/upper_layer", args.workdir) < 0) {
+		perror("asprintf");
+		return -ENOMEM;
+	}
+	chown(args.workdir, getuid(), getgid());
+	mkdir(args.writelayer, 0755);
+	mkdir(args.upperlayer, 0755);
+	chown(args.upperlayer, getuid(), getgid());
+	for (i=0; sources[i]; ++i) {
+		snprintf(path, sizeof(path)-1, "%s/%s", args.writelayer, sources[i]);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path)-1, "%s/%s", args.upperlayer, sources[i]);
+		mkdir(path, 0755);
+		chown(path, getuid(), getgid());
+	}
+	return 0;
+}
+
+/**
+ * Tells if @name can be used as the name of a persistent layer.
+ */
+static bool
+valid_layer_name(const char *name)
+{
+	return name && *name && *name != '.' && ! strchr(name, '/') && strlen(name) < NAME_MAX - 5;
+}
+
+/**
+ * Takes the lock of the persistent layer @name in @layersdir. The lock lives
+ * next to the layer, so that it survives --discard-layer.
+ * @param wait Wait for other Runner instances using the layer, or fail with -EBUSY
+ * @return The file descriptor holding the lock or a negative errno.
+ */
+static int
+lock_persistent_layer(const char *layersdir, const char *name, bool wait)
+{
+	char lockfile[PATH_MAX];
+	int fd;
+
+	snprintf(lockfile, sizeof(lockfile), "%s/%s.lock", layersdir, name);
+	fd = open(lockfile, O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", lockfile, strerror(errno));
+		return -errno;
+	}
+	if (flock(fd, LOCK_EX|LOCK_NB) == 0)
+		return fd;
+	if (errno == EWOULDBLOCK && wait) {
+		verbose_printf("layer %s is in use by another Runner, waiting\n", name);
+		if (flock(fd, LOCK_EX) == 0)
+			return fd;
+	}
+	close(fd);
+	return errno == EWOULDBLOCK ? -EBUSY : -errno;
+}
+
+/**
+ * Uses the persistent layer named by --layer as the work directory, creating
+ * it on first use. Launches with the same name are serialised: the lock is
+ * held until Runner exits, and the layer is never cleaned up.
+ */
+static int
+open_persistent_layer(const char *home)
+{
+	static int lockfd = -1;
+	char layersdir[PATH_MAX];
+	struct stat statbuf;
+	int ret;
+
+	snprintf(layersdir, sizeof(layersdir), "%s/.local/Runner/layers", home);
+	mkdir(layersdir, 0755);
+	if (lockfd < 0) {
+		lockfd = lock_persistent_layer(layersdir, args.layer, true);
+		if (lockfd < 0)
+			return lockfd;
+	}
+
+	ret = asprintf(&args.workdir, "%s/%s", layersdir, args.layer);
+	if (ret < 0) {
+		perror("asprintf");
+		return -ENOMEM;
+	}
+	if (mkdir(args.workdir, 0755) == 0) {
+		verbose_printf("created layer %s at %s\n", args.layer, args.workdir);
+	} else if (errno != EEXIST) {
+		ret = -errno;
+		fprintf(stderr, "mkdir %s: %s\n", args.workdir, strerror(errno));
+		return ret;
+	}
+	if (lstat(args.workdir, &statbuf) < 0 || ! S_ISDIR(statbuf.st_mode) || statbuf.st_uid != getuid()) {
+		fprintf(stderr, "%s: not a layer directory owned by the caller\n", args.workdir);
+		return -EPERM;
+	}
+	return 0;
+}
+
+/**
+ * Implements --discard-layer. Fails if a Runner is still using the layer.
+ * Everything is looked up and deleted with the caller's credentials, so a
+ * symlink planted under $HOME cannot make Runner delete files as root.
+ */
+static int
+discard_persistent_layer(const char *name)
+{
+	char layersdir[PATH_MAX], layerdir[PATH_MAX+NAME_MAX];
+	const char *home = getenv("HOME");
+	struct stat statbuf;
+	int fd;
+
+	if (seteuid(getuid()) < 0) {
+		perror("seteuid");
+		return 1;
+	}
+	if (! home)
+		home = "/tmp";
+	snprintf(layersdir, sizeof(layersdir), "%s/.local/Runner/layers", home);
+	snprintf(layerdir, sizeof(layerdir), "%s/%s", layersdir, name);
+	if (lstat(layerdir, &statbuf) < 0 || ! S_ISDIR(statbuf.st_mode)) {
+		fprintf(stderr, "No such layer: %s\n", name);
+		return 1;
+	}
+	fd = lock_persistent_layer(layersdir, name, false);
+	if (fd == -EBUSY) {
+		fprintf(stderr, "Layer %s is in use by another Runner\n", name);
+		return 1;
+	} else if (fd < 0) {
+		return 1;
+	}
+	cleanup_directory("persistent layer", layerdir);
+	close(fd);
+	return 0;
+}
+
+/**
+ * Creates the work directory and, if @with_layers is set, the overlayfs
+ * upper and write layers underneath it.
+ */
+int
+create_write_layer(bool with_layers)
+{
+	const char *sources[] = {"bin", "include", "lib",  "libexec", "share", NULL};
+	const char *home, *exec;
+	char path[PATH_MAX];
+	uid_t euid;
+	int ret, i;
+
+	if (args.tmpfs && with_layers)
+		return create_tmpfs_write_layer();
+
+	/*
+	 * Runner is setuid: create everything under $HOME with the caller's
+	 * credentials, so that no symlink planted there is followed as root.
+	 */
+	euid = geteuid();
+	if (seteuid(getuid()) < 0) {
+		ret = -errno;
+		perror("seteuid");
+		return ret;
+	}
+
+	home = getenv("HOME");
+	if (home == NULL)
+		home = "/tmp";
+
+	/* mkdir -p ~/.local/Runner */
+	memset(path, 0, sizeof(path));
+	snprintf(path, sizeof(path)-1, "%s/.local", home);
+	mkdir(path, 0755);
+	strcat(path, "/Runner");
+	mkdir(path, 0755);
+
+	/* Work directory */
+	if (args.layer) {
+		ret = open_persistent_layer(home);
+		if (ret < 0)
+			goto out_error;
+	} else {
+		exec = strrchr(args.executable, '/');
+		exec = exec ? exec + 1 : args.executable;
+		ret = asprintf(&args.workdir, "%s/.local/Runner/%ld-%s-XXXXXX", home, time(NULL), exec);
+		if (ret < 0) {
+			ret = -ENOMEM;
+			perror("asprintf");
+			goto out_error;
+		}
+		if (mkdtemp(args.workdir) == NULL) {
+			ret = -errno;
+			fprintf(stderr, "mkdtemp %s: %s\n", args.workdir, strerror(errno));
+			goto out_error;
+		}
+	}
+	if (! with_layers)
+		goto out;
+
+	/* Write layer */
+	ret = asprintf(&args.writelayer, "%s/write_layer", args.workdir);
+	if (ret < 0) {
+		ret = -ENOMEM;
+		perror("asprintf");
+		goto out_error;
+	}
+	mkdir(args.writelayer, 0755);
+	for (i=0; sources[i]; ++i) {
+		snprintf(path, sizeof(path)-1, "%s/%s", args.writelayer, sources[i]);
+		mkdir(path, 0755);
+	}
+
+	/* Upper layer. Overlayfs requires it to activate the write branch */
+	ret = asprintf(&args.upperlayer, "%s/upper_layer", args.workdir);
+	if (ret < 0) {
+		ret = -ENOMEM;
+		perror("asprintf");
+		goto out_error;
+	}
+	mkdir(args.upperlayer, 0755);
+	for (i=0; sources[i]; ++i) {
+		snprintf(path, sizeof(path)-1, "%s/%s", args.upperlayer, sources[i]);
+		mkdir(path, 0755);
+	}
+
+out:
+	seteuid(euid);
+	return 0;
+
+out_error:
+	seteuid(euid);
+	free(args.upperlayer);
+	free(args.writelayer);
+	free(args.workdir);
+	return ret;
+}
+
+void
+cleanup_directory(const char *layername, char *dirname)
+{
+	int cleanup_entry(const char *path, const struct stat *statbuf, int typeflag, struct FTW *ftwbuf)
+	{
+		if (typeflag == FTW_F || typeflag == FTW_SL || typeflag == FTW_SLN) {
+			debug_printf("%s: deleting file %s\n", layername, path);
+			unlink(path);
+		} else if (typeflag == FTW_D || typeflag == FTW_DP || typeflag == FTW_DNR) {
+			debug_printf("%s: deleting directory %s\n", layername, path);
+			rmdir(path);
+		}
+		return 0;
+	}
+
+	struct rlimit limit;
+	int ret = getrlimit(RLIMIT_NOFILE, &limit);
+	if (ret < 0) {
+		perror("getrusage");
+		limit.rlim_cur = 1024;
+	}
+	ret = nftw(dirname, cleanup_entry, limit.rlim_cur, FTW_DEPTH|FTW_PHYS);
+	if (ret < 0)
+		perror("nftw");
+	debug_printf("%s: deleting directory %s\n", layername, dirname);
+	rmdir(dirname);
+}
+
+void
+show_usage_and_exit(char *exec, int err)
+{
+	struct utsname uts_data;
+	uname(&uts_data);
+
+	printf(
+	"Executes a command with a read-only view of /System/Index overlaid with\n"
+	"dependencies extracted from the program's Resources/Dependencies and/or\n"
+	"from the given dependencies file(s).\n"
+	"\n"
+	"Syntax: %s [options] <command> [arguments]\n"
+	"\n"
+	"Available options are:\n"
+	"  -a, --arch=ARCH           Look for dependencies built for ARCH (default: extract from ELF headers\n"
+	"                            or from Resources/Architecture, falling back to %s on failure)\n"
+	"  -d, --dependencies=FILE   Path to GoboLinux Dependencies file to use\n"
+	"  -h, --help                This help\n"
+	"  -q, --quiet               Don't warn on bogus dependencies file(s)\n"
+	"  -v, --verbose             Run in verbose mode (-vv to enable debug messages)\n"
+	"  -c, --check               Check if Runner can be used in this system\n"
+	"  -S, --strict              Strict dependency resolution: If no operator is given assume '=' (Qt 5.2 to Qt=5.2)\n"
+	"  -p, --pure                Create a /System/Index overlay based purely on listed dependencies\n"
+	"  -f, --fallback            Run the command without the sandbox in case this is not available\n"
+	"  -E, --no-source-env       Do not import dependencies\' Resources/Environment files\n"
+	"  -e, --env-snapshot        Import Resources/Environment files from a cached snapshot of the variables\n"
+	"                            they set, rather than sourcing them from a wrapper script on every launch\n"
+	"  -C, --no-cleanup          Do not cleanup work directory on exit\n"
+	"  -R, --no-removedeps       Do not remove conflicting versions of dependencies from /System/Index view\n"
+	"  -N, --no-cache            Do not use the cache of resolved dependencies at %s\n"
+	"  -D, --daemon              Run as runnerd, keeping a pool of prepared namespaces for other Runner\n"
+	"                            instances (sandboxes with the same dependencies share their read-only overlays)\n"
+	"  -P, --pool-size=N         Maximum number of namespaces kept by runnerd (default: %d)\n"
+	"  -T, --tmpfs[=SIZE]        Keep the write layers on a tmpfs of SIZE bytes (default: %s) instead of\n"
+	"                            ~/.local/Runner\n"
+	"  -F, --flatten             Merge the dependencies into a single cached symlink farm per /System/Index\n"
+	"                            directory rather than stacking one overlay layer per program\n"
+	"  -U, --userns              Build the sandbox in an unprivileged user namespace (Linux 5.11+) rather\n"
+	"                            than through the suid bit, which is the default when that is not set\n"
+	"      --layer=NAME          Keep the write layer at ~/.local/Runner/layers/NAME and reuse it on later\n"
+	"                            launches with the same NAME, which wait for each other (implies -C -R)\n"
+	"      --discard-layer=NAME  Delete the persistent write layer NAME and exit\n"
+	"      --cgroup              Run the program in a cgroup v2 of its own, reporting its CPU time and peak\n"
+	"                            memory usage on exit. Limits are read from the program's Resources/Cgroup\n"
+	"      --cpu-weight=N        Set the cgroup's cpu.weight (implies --cgroup)\n"
+	"      --io-weight=N         Set the cgroup's io.weight (implies --cgroup)\n"
+	"      --memory-high=BYTES   Set the cgroup's memory.high (implies --cgroup)\n"
+	"      --pids-max=N          Set the cgroup's pids.max (implies --cgroup)\n"
+	"      --minimal             Only mount the lib, include and libexec directories of the dependencies that\n"
+	"                            supply shared objects the executable needs (not compatible with -F)\n"
+	"      --ldcache             Bind-mount an ld.so.cache of the dependencies over %s rather than\n"
+	"                            prepending /System/Index/lib to LD_LIBRARY_PATH. The caller's LD_LIBRARY_PATH\n"
+	"                            then takes precedence, and only lib*.so* names are in the cache\n"
+	"      --prefetch            Read the executable and the shared libraries it needs ahead of time, while\n"
+	"                            the sandbox is being forked\n"
+	"      --trace-access[=FILE] Record which dependencies the files opened under /System/Index came from.\n"
+	"                            On exit, list those never touched and a Dependencies file without them,\n"
+	"                            appending the report to FILE (default: stderr)\n"
+	"      --profile[=FILE]      Append a JSON line with the duration and syscall count of each startup\n"
+	"                            phase to FILE (default: stderr). Also enabled by $GOBOLINUX_RUNNER_PROFILE.\n"
+	"                            Syscalls made by background threads count towards the running phase\n"
+	"\n", exec, uts_data.machine, GOBO_RUNNER_CACHE_DIR, RUNNERD_POOL_SIZE,
+	RUNNER_TMPFS_SIZE, GOBO_LD_SO_CACHE);
+	exit(err);
+}
+
+/**
+ * parse_arguments:
+ */
+int
+parse_arguments(int argc, char *argv[])
+{
+	struct option long_options[] = {
+		{"dependencies",    required_argument, 0,  'd'},
+		{"arch",            required_argument, 0,  'a'},
+		{"help",            no_argument,       0,  'h'},
+		{"quiet",           no_argument,       0,  'q'},
+		{"verbose",         no_argument,       0,  'v'},
+		{"check",           no_argument,       0,  'c'},
+		{"strict",          no_argument,       0,  'S'},
+		{"pure",            no_argument,       0,  'p'},
+		{"fallback",        no_argument,       0,  'f'},
+		{"no-source-env",   no_argument,       0,  'E'},
+		{"env-snapshot",    no_argument,       0,  'e'},
+		{"no-cleanup",      no_argument,       0,  'C'},
+		{"no-removedeps",   no_argument,       0,  'R'},
+		{"no-cache",        no_argument,       0,  'N'},
+		{"daemon",          no_argument,       0,  'D'},
+		{"pool-size",       required_argument, 0,  'P'},
+		{"tmpfs",           optional_argument, 0,  'T'},
+		{"flatten",         no_argument,       0,  'F'},
+		{"userns",          no_argument,       0,  'U'},
+		{"profile",         optional_argument, 0,  OPT_PROFILE},
+		{"layer",           required_argument, 0,  OPT_LAYER},
+		{"discard-layer",   required_argument, 0,  OPT_DISCARD_LAYER},
+		{"cgroup",          no_argument,       0,  OPT_CGROUP},
+		{"cpu-weight",      required_argument, 0,  OPT_CPU_WEIGHT},
+		{"io-weight",       required_argument, 0,  OPT_IO_WEIGHT},
+		{"memory-high",     required_argument, 0,  OPT_MEMORY_HIGH},
+		{"pids-max",        required_argument, 0,  OPT_PIDS_MAX},
+		{"prefetch",        no_argument,       0,  OPT_PREFETCH},
+		{"minimal",         no_argument,       0,  OPT_MINIMAL},
+		{"ldcache",         no_argument,       0,  OPT_LDCACHE},
+		{"trace-access",    optional_argument, 0,  OPT_TRACE_ACCESS},
+		{0,                 0,                 0,   0 }
+	};
+	const char *short_options = "+d:a:hqvcSpfEeCRNDP:T::FU";
+	bool valid = true;
+	int next = optind;
+	int num_deps = 0;
+	int dep_nr = 0;
+
+	/* Don't stop on errors */
+	opterr = 0;
+
+	/* Count how many dependency files were given */
+	while (valid) {
+		int c = getopt_long(argc, argv, short_options, long_options, NULL);
+		if (c == -1)
+			break;
+		else if (c == 'd')
+			num_deps++;
+		else {
+			struct option *ptr = long_options;
+			valid = false;
+			while (ptr->name) {
+				if (c == ptr->val) {
+					valid = true;
+					break;
+				}
+				ptr++;
+			}
+		}
+	}
+
+	/* Default values */
+	args.executable = NULL;
+	args.arguments = NULL;
+	args.architecture = NULL;
+	args.check = false;
+	args.debug = false;
+	args.cleanup = true;
+	args.verbose = false;
+	args.quiet = false;
+	args.strict = false;
+	args.pure = false;
+	args.fallback = false;
+	args.sourceenv = true;
+	args.removedeps = true;
+	args.cache = true;
+	args.envsnapshot = false;
+	args.daemon = false;
+	args.pooled = false;
+	args.pool_size = RUNNERD_POOL_SIZE;
+	args.tmpfs = NULL;
+	args.flatten = false;
+	args.userns = false;
+	args.layer = NULL;
+	args.discard_layer = NULL;
+	args.cgroup = false;
+	args.prefetch = false;
+	args.minimal = false;
+	args.ldcache = false;
+	args.ldcache_mounted = false;
+	args.trace_access = NULL;
+	memset(args.cgroup_limits, 0, sizeof(args.cgroup_limits));
+	args.profile = getenv("GOBOLINUX_RUNNER_PROFILE");
+	if (args.profile && (! *args.profile || ! strcmp(args.profile, "1")))
+		args.profile = "-";
+
+	args.dependencies = (const char **) calloc(num_deps+1, sizeof(char *));
+	if (! args.dependencies)
+		return ERR_OUTMEMORY;
+
+	optind = 1;
+	while (valid) {
+		int c = getopt_long(argc, argv, short_options, long_options, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+			case 'a':
+				args.architecture = optarg;
+				break;
+			case 'd':
+				args.dependencies[dep_nr++] = optarg;
+				break;
+			case 'h':
+				show_usage_and_exit(argv[0], 0);
+				break;
+			case 'q':
+				args.quiet = true;
+				break;
+			case 'v':
+				if (args.verbose)
+					args.debug = true;
+				args.verbose = true;
+				break;
+			case 'c':
+				args.check = true;
+				break;
+			case 'S':
+				args.strict = true;
+				break;
+			case 'p':
+				args.pure = true;
+				args.removedeps = false; // implicitly set to 'false' with --pure
+				break;
+			case 'f':
+				args.fallback = true;
+				break;
+			case 'E':
+				args.sourceenv = false;
+				break;
+			case 'e':
+				args.envsnapshot = true;
+				break;
+			case 'C':
+				args.cleanup = false;
+				break;
+			case 'R':
+				args.removedeps = false;
+				break;
+			case 'N':
+				args.cache = false;
+				break;
+			case 'D':
+				args.daemon = true;
+				break;
+			case 'P':
+				args.pool_size = atoi(optarg);
+				if (args.pool_size <= 0)
+					return ERR_BAD_ARGS;
+				break;
+			case 'T':
+				args.tmpfs = optarg ? optarg : RUNNER_TMPFS_SIZE;
+				break;
+			case 'F':
+				args.flatten = true;
+				break;
+			case 'U':
+				args.userns = true;
+				break;
+			case OPT_PROFILE:
+				args.profile = optarg ? optarg : "-";
+				break;
+			case OPT_CGROUP:
+				args.cgroup = true;
+				break;
+			case OPT_PREFETCH:
+				args.prefetch = true;
+				break;
+			case OPT_MINIMAL:
+				args.minimal = true;
+				break;
+			case OPT_LDCACHE:
+				args.ldcache = true;
+				break;
+			case OPT_TRACE_ACCESS:
+				args.trace_access = optarg ? optarg : "-";
+				break;
+			case OPT_CPU_WEIGHT:
+			case OPT_IO_WEIGHT:
+			case OPT_MEMORY_HIGH:
+			case OPT_PIDS_MAX:
+				args.cgroup = true;
+				args.cgroup_limits[c - OPT_CPU_WEIGHT] = optarg;
+				break;
+			case OPT_LAYER:
+			case OPT_DISCARD_LAYER:
+				if (! valid_layer_name(optarg)) {
+					fprintf(stderr, "Invalid layer name: %s\n", optarg);
+					return ERR_BAD_ARGS;
+				}
+				if (c == OPT_LAYER)
+					args.layer = optarg;
+				else
+					args.discard_layer = optarg;
+				break;
+			case '?':
+			default:
+				valid = false;
+				break;
+		}
+		if (valid)
+			next = optind;
+	}
+
+	if (args.layer) {
+		/* The layer outlives the launch, so it is neither pooled nor kept on a tmpfs */
+		args.cleanup = false;
+		args.tmpfs = NULL;
+		/* The whiteouts left by remove_conflicting_deps() would outlive it too,
+		 * hiding files of the versions chosen by later launches */
+		args.removedeps = false;
+	}
+
+	optind = next;
+	if (optind < argc) {
+		int i, num = argc - optind + 1;
+		args.arguments = calloc(num, sizeof(char *));
+		if (args.arguments == NULL)
+			return ERR_OUTMEMORY;
+		for (i = optind; i < argc; i++)
+			args.arguments[i-optind] = argv[i];
+		args.executable = argv[optind];
+	}
+
+	return 0;
+}
+
+/**
+ * Checks if the sandbox execution model can be constructed
+ */
+bool check_availability()
+{
+	uid_t uid = getuid(), euid = geteuid();
+	struct utsname uts_data;
+	struct statfs statbuf;
+	char hostname[512];
+	bool is_available = true;
+
+	/* Not currently available on the LiveCD */
+	if (gethostname(hostname, sizeof(hostname)-1) == 0 && !strcmp(hostname, "LiveCD"))
+		return false;
+
+	/* Check uid */
+	if ((uid >0) && (uid == euid)) {
+		if (userns_available()) {
+			verbose_printf("No suid bit, using an unprivileged user namespace.\n");
+			args.userns = true;
+		} else {
+			verbose_printf("This program needs its suid bit to be set or unprivileged user namespaces.\n");
+			is_available = false;
+		}
+	} else if (args.userns && ! userns_available()) {
+		verbose_printf("User namespaces are not available, using the suid bit.\n");
+		args.userns = false;
+	}
+
+	/* Check kernel version */
+	uname(&uts_data);
+	if (compare_kernel_versions("4.0", uts_data.release) > 0) {
+		verbose_printf("Running on Linux %s. At least Linux 4.0 is needed.\n",
+			uts_data.release);;
+		is_available = false;
+	}
+
+	/* Check if maximum filesystem stacking count will be reached */
+	if (statfs("/", &statbuf) == 0 && statbuf.f_type == OVERLAYFS_MAGIC) {
+		verbose_printf("Rootfs is an overlayfs, max filesystem stacking count will be reached\n");
+		is_available = false;
+	}
+
+	return is_available;
+}
+
+void
+cleanup(int signum)
+{
+	if (args.tmpfs) {
+		/* The tmpfs goes away with the namespace */
+	} else if (args.cleanup) {
+		destroy_namespace();
+		cleanup_directory("upper layer", args.upperlayer);
+		cleanup_directory("write layer", args.writelayer);
+		cleanup_directory("working layer", args.workdir);
+	}
+}
+
+/**
+ * Returns the directory where work directories are moved to while they
+ * wait to be deleted. It lives next to them so that rename() can be used.
+ */
+static char *
+get_trash_dir(void)
+{
+	const char *home = getenv("HOME");
+	char *trash = NULL;
+
+	if (asprintf(&trash, "%s/.local/Runner/.trash", home ? home : "/tmp") < 0)
+		return NULL;
+	return trash;
+}
+
+/**
+ * Opens the trash directory one component at a time, never following a
+ * symlink below $HOME. Must be called with the caller's credentials.
+ * @return A descriptor of the trash or a negative errno.
+ */
+static int
+open_trash_dir(void)
+{
+	const char *components[] = { ".local", "Runner", ".trash", NULL };
+	const char *home = getenv("HOME");
+	int fd, next, i;
+
+	fd = open(home ? home : "/tmp", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	for (i=0; fd >= 0 && components[i]; ++i) {
+		next = openat(fd, components[i], O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		close(fd);
+		fd = next;
+	}
+	return fd < 0 ? -errno : fd;
+}
+
+/**
+ * Deletes the directory @name, relative to @parentfd, and everything under
+ * it. Entries are read in getdents() batches and removed with unlinkat()
+ * relative to their parent's descriptor; symlinks are never followed.
+ * @return true if @name is gone.
+ */
+static bool
+remove_directory_at(int parentfd, const char *name)
+{
+	struct dirent *entry;
+	struct stat statbuf;
+	DIR *dp;
+	int fd;
+
+	fd = openat(parentfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0 && errno == EACCES && geteuid() != 0 && seteuid(0) == 0) {
+		/* Overlayfs' work directories belong to root, so the reaper regains
+		 * root for them, still relative to a descriptor the caller opened */
+		bool ret = remove_directory_at(parentfd, name);
+		seteuid(getuid());
+		return ret;
+	}
+	if (fd < 0)
+		return unlinkat(parentfd, name, 0) == 0;
+	dp = fdopendir(fd);
+	if (! dp) {
+		close(fd);
+		return false;
+	}
+	while ((entry = readdir(dp))) {
+		bool is_dir = entry->d_type == DT_DIR;
+		if (! strcmp(entry->d_name, ".") || ! strcmp(entry->d_name, ".."))
+			continue;
+		if (entry->d_type == DT_UNKNOWN && fstatat(fd, entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0)
+			is_dir = S_ISDIR(statbuf.st_mode);
+		if (is_dir)
+			remove_directory_at(fd, entry->d_name);
+		else
+			unlinkat(fd, entry->d_name, 0);
+	}
+	closedir(dp);
+	return unlinkat(parentfd, name, AT_REMOVEDIR) == 0;
+}
+
+/**
+ * Empties the trash directory open on @fd, which is closed on return. Only
+ * one reaper works on it at a time.
+ */
+static void
+reap_trash(int fd)
+{
+	struct dirent *entry;
+	bool removed;
+	DIR *dp;
+
+	if (flock(fd, LOCK_EX|LOCK_NB) < 0) {
+		close(fd);
+		return;
+	}
+	dp = fdopendir(fd);
+	if (! dp) {
+		close(fd);
+		return;
+	}
+	do {
+		/* Pick up work directories trashed while we were busy. Entries that
+		 * cannot be removed (e.g., a read-only directory left by the program
+		 * when the reaper is not root) stay behind once a pass makes no
+		 * progress. */
+		removed = false;
+		rewinddir(dp);
+		while ((entry = readdir(dp))) {
+			if (! strcmp(entry->d_name, ".") || ! strcmp(entry->d_name, ".."))
+				continue;
+			if (remove_directory_at(fd, entry->d_name))
+				removed = true;
+		}
+	} while (removed);
+	closedir(dp);
+}
+
+/**
+ * Forks a detached process that empties the trash, so that the caller does
+ * not have to wait for it. The reaper runs with the caller's euid and only
+ * regains root to unmount the sandbox and in remove_directory_at().
+ */
+static void
+spawn_reaper(bool unmount)
+{
+	uid_t euid = geteuid();
+	int fd, trashfd, status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == 0) {
+		setsid();
+		if (fork() != 0)
+			_exit(0);
+		fd = open("/dev/null", O_RDWR);
+		if (fd >= 0) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			if (fd > STDERR_FILENO)
+				close(fd);
+		}
+		if (seteuid(getuid()) < 0)
+			_exit(1);
+		trashfd = open_trash_dir();
+		if (unmount) {
+			seteuid(euid);
+			destroy_namespace();
+			seteuid(getuid());
+		}
+		if (trashfd >= 0)
+			reap_trash(trashfd);
+		_exit(0);
+	} else if (pid > 0) {
+		waitpid(pid, &status, 0);
+	} else {
+		perror("fork");
+	}
+}
+
+/**
+ * Spawns a reaper if work directories were left in the trash by previous
+ * launches (e.g., because their reaper was killed).
+ */
+static void
+collect_trash(void)
+{
+	char *trash = get_trash_dir();
+	uid_t euid = geteuid();
+	bool full;
+
+	/* Succeeds if the trash is empty, fails with ENOTEMPTY otherwise */
+	if (! trash || seteuid(getuid()) < 0) {
+		free(trash);
+		return;
+	}
+	full = rmdir(trash) < 0 && errno == ENOTEMPTY;
+	seteuid(euid);
+	if (full) {
+		verbose_printf("collecting left-over work directories from %s\n", trash);
+		spawn_reaper(false);
+	}
+	free(trash);
+}
+
+/**
+ * Moves the work directory to the trash and lets a detached reaper delete
+ * it, so that Runner can return the exit status of the program right away.
+ * Falls back to cleanup() if the work directory cannot be moved.
+ */
+void
+cleanup_async(void)
 {
-	char *arch = NULL;
-	FILE *fp = fopen(executable, "r");
-	if (fp) {
-		char ident[EI_NIDENT];
-		size_t n = fread(ident, sizeof(ident), 1, fp);
-		if (n <= 0 || memcmp(ident, ELFMAG, SELFMAG) != 0) {
-			fclose(fp);
-			return NULL;
+	char *trash, *target = NULL, *name;
+	uid_t euid = geteuid();
+	int ret;
+
+	if (! args.cleanup || ! args.workdir || args.tmpfs) {
+		cleanup(0);
+		return;
+	}
+
+	trash = get_trash_dir();
+	name = strrchr(args.workdir, '/');
+	if (! trash || ! name || asprintf(&target, "%s%s", trash, name) < 0) {
+		free(trash);
+		cleanup(0);
+		return;
+	}
+	/* The trash lives in the caller's $HOME, so it is only touched as the caller */
+	if (seteuid(getuid()) < 0) {
+		free(target);
+		free(trash);
+		cleanup(0);
+		return;
+	}
+	mkdir(trash, 0755);
+	ret = rename(args.workdir, target);
+	seteuid(euid);
+	if (ret < 0) {
+		debug_printf("rename %s: %s\n", args.workdir, strerror(errno));
+		cleanup(0);
+	} else {
+		debug_printf("moved %s to %s\n", args.workdir, target);
+		spawn_reaper(true);
+	}
+	free(target);
+	free(trash);
+}
+
+/**
+ * A namespace prepared by 'Runner --daemon' and kept around for reuse. It
+ * only holds read-only overlays: clients stack their own write layer on top
+ * of them, in a copy of the namespace, so nothing in it belongs to a client.
+ */
+struct pooled_namespace {
+	char *key;                 /* Flags and list of merged directories */
+	unsigned layers;           /* LAYER_* bits of the /System/Index subdirectories overlaid */
+	int nsfd;                  /* Handle to /proc/<pid>/ns/mnt */
+	unsigned long last_used;   /* LRU stamp */
+};
+
+static volatile sig_atomic_t daemon_quit;
+
+static void
+daemon_signal_handler(int signum)
+{
+	daemon_quit = 1;
+}
+
+/**
+ * Makes sure that every entry of @mergedirs is a $goboPrograms subdirectory,
+ * as the daemon must not be used to overlay arbitrary directories.
+ */
+static bool
+valid_pooled_mergedirs(const char *mergedirs)
+{
+	const char *start, *end;
+	size_t len = strlen(GOBO_PROGRAMS_DIR);
+
+	if (! *mergedirs || strstr(mergedirs, "/../") || strstr(mergedirs, "/.."))
+		return false;
+	for (start=mergedirs; *start; start=end+1) {
+		end = strchr(start, ':');
+		if (! end || strncmp(start, GOBO_PROGRAMS_DIR "/", len+1) || end-start <= len+1)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Drops the daemon's handle to a pooled namespace. Clients attached to it
+ * keep it alive for as long as they need it.
+ */
+static void
+release_pooled_namespace(struct pooled_namespace *entry)
+{
+	verbose_printf("releasing namespace %s\n", entry->key);
+	close(entry->nsfd);
+	free(entry->key);
+	memset(entry, 0, sizeof(*entry));
+}
+
+/**
+ * Forks a process that creates a new mount namespace with read-only
+ * overlays of @mergedirs. The namespace is kept alive by the returned
+ * /proc/<pid>/ns/mnt handle once that process exits.
+ */
+static int
+prepare_pooled_namespace(struct path_set *mergedirs, struct pooled_namespace *entry)
+{
+	char path[PATH_MAX], reply[32];
+	int pipefd[2], status;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe(pipefd) < 0) {
+		perror("pipe");
+		return -errno;
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -errno;
+	} else if (pid == 0) {
+		unsigned layers;
+		close(pipefd[0]);
+		if (create_mount_namespace() < 0 || mount_overlay_dirs(mergedirs, GOBO_INDEX_DIR, &layers) != 0)
+			_exit(1);
+		dprintf(pipefd[1], "%u", layers);
+		close(pipefd[1]);
+		pause();
+		_exit(0);
+	}
+
+	close(pipefd[1]);
+	entry->nsfd = -1;
+	memset(reply, 0, sizeof(reply));
+	n = read(pipefd[0], reply, sizeof(reply)-1);
+	close(pipefd[0]);
+	if (n > 0) {
+		snprintf(path, sizeof(path), "/proc/%d/ns/mnt", pid);
+		entry->nsfd = open(path, O_RDONLY|O_CLOEXEC);
+		if (entry->nsfd < 0)
+			perror(path);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+
+	if (n <= 0 || entry->nsfd < 0) {
+		if (entry->nsfd >= 0)
+			close(entry->nsfd);
+		return -1;
+	}
+	entry->layers = strtoul(reply, NULL, 10);
+	return 0;
+}
+
+/**
+ * Returns the pooled namespace that matches @key, preparing a new one
+ * (and evicting the least recently used entry if the pool is full) on a
+ * miss.
+ */
+static struct pooled_namespace *
+get_pooled_namespace(struct pooled_namespace *pool, const char *key, struct path_set *mergedirs)
+{
+	static unsigned long clock = 0;
+	struct pooled_namespace *entry = NULL, *lru = NULL;
+	int i;
+
+	for (i=0; i<args.pool_size; ++i) {
+		if (pool[i].key && ! strcmp(pool[i].key, key)) {
+			pool[i].last_used = ++clock;
+			debug_printf("pool hit: %s\n", pool[i].key);
+			return &pool[i];
+		} else if (! pool[i].key && ! entry) {
+			entry = &pool[i];
+		} else if (pool[i].key && (! lru || pool[i].last_used < lru->last_used)) {
+			lru = &pool[i];
 		}
-		rewind(fp);
+	}
+	if (! entry) {
+		release_pooled_namespace(lru);
+		entry = lru;
+	}
+	if (prepare_pooled_namespace(mergedirs, entry) < 0)
+		return NULL;
+	entry->key = strdup(key);
+	entry->last_used = ++clock;
+	verbose_printf("prepared namespace %s\n", entry->key);
+	return entry;
+}
 
-		int e_machine = 0;
-		if (ident[EI_CLASS] == ELFCLASS32) {
-			Elf32_Ehdr hdr;
-			if (fread(&hdr, sizeof(hdr), 1, fp) <= 0) {
-				fclose(fp);
-				return NULL;
-			}
-			e_machine = (int) hdr.e_machine;
-		} else if (ident[EI_CLASS] == ELFCLASS64) {
-			Elf64_Ehdr hdr;
-			if (fread(&hdr, sizeof(hdr), 1, fp) <= 0) {
-				fclose(fp);
-				return NULL;
-			}
-			e_machine = (int) hdr.e_machine;
+/**
+ * Serves a single client: reads its request, finds or prepares a matching
+ * namespace and hands its file descriptor over through SCM_RIGHTS.
+ */
+static void
+serve_pooled_namespace(int clientfd, struct pooled_namespace *pool)
+{
+	struct pooled_namespace *entry = NULL;
+	char *request = NULL, *mergedirs, *key = NULL, reply[2] = { 1, 0 };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct path_set dirs;
+	size_t len = 0, size = 0;
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	struct timespec deadline, now;
+	struct pollfd pfd = { .fd = clientfd, .events = POLLIN };
+	struct msghdr msg;
+	struct iovec iov;
+	int pure, removedeps, timeout;
+	ssize_t n;
+
+	if (getsockopt(clientfd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0) {
+		perror("SO_PEERCRED");
+		return;
+	}
+
+	/* Clients are served one at a time, so a silent one must not hold up the others */
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += RUNNERD_REQUEST_TIMEOUT / 1000;
+
+	/* Request format: "<pure> <removedeps> <mergedirs>\n" */
+	do {
+		if (len + 1 >= size) {
+			char *newbuf = realloc(request, size ? size * 2 : 4096);
+			if (! newbuf)
+				goto out_reply;
+			request = newbuf;
+			size = size ? size * 2 : 4096;
 		}
-		fclose(fp);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0) {
+			fprintf(stderr, "runnerd: timed out waiting for the request of uid %d\n", cred.uid);
+			goto out_reply;
+		}
+		n = read(clientfd, &request[len], size-len-1);
+		if (n > 0)
+			len += n;
+		request[len] = '\0';
+	} while (n > 0 && ! strchr(request, '\n') && size < RUNNERD_MAX_REQUEST);
+
+	mergedirs = request ? strchr(request, '\n') : NULL;
+	if (! mergedirs)
+		goto out_reply;
+	*mergedirs = '\0';
+	if (sscanf(request, "%d %d", &pure, &removedeps) != 2 || ! (mergedirs = strchr(request, ' ')) ||
+		! (mergedirs = strchr(mergedirs+1, ' ')) || ! valid_pooled_mergedirs(++mergedirs)) {
+		fprintf(stderr, "runnerd: rejecting malformed request from uid %d\n", cred.uid);
+		goto out_reply;
+	}
 
-		switch (e_machine) {
-			case EM_386:
-				arch = strdup("i686");
-				break;
-			case EM_X86_64:
-				arch = strdup("x86_64");
+	/* The overlays are read-only, so clients of any user may share them.
+	 * Conflicting dependencies are removed by the clients themselves. */
+	if (asprintf(&key, "%d %s", pure, mergedirs) < 0)
+		goto out_reply;
+	args.pure = pure;
+	path_set_init(&dirs);
+	if (path_set_add_string(&dirs, mergedirs) == 0)
+		entry = get_pooled_namespace(pool, key, &dirs);
+	path_set_free(&dirs);
+	if (entry) {
+		reply[0] = 0;
+		reply[1] = entry->layers;
+	}
+
+out_reply:
+	/* Reply format: status byte, then the LAYER_* bits of the overlays */
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (entry) {
+		struct cmsghdr *cmsg;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &entry->nsfd, sizeof(int));
+	}
+	if (sendmsg(clientfd, &msg, MSG_NOSIGNAL) < 0)
+		perror("sendmsg");
+	free(request);
+	free(key);
+}
+
+/**
+ * run_daemon:
+ *
+ * Runs Runner as a privileged daemon that keeps a pool of prepared mount
+ * namespaces keyed by their dependency closure. Clients attach to them with
+ * setns() instead of unsharing and mounting overlays on every launch.
+ */
+static int
+run_daemon(void)
+{
+	struct pooled_namespace *pool;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int i, sockfd, clientfd;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "runnerd must be run as root\n");
+		return ERR_NOSANDBOX;
+	}
+	pool = calloc(args.pool_size, sizeof(struct pooled_namespace));
+	if (! pool)
+		return ERR_OUTMEMORY;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", GOBO_RUNNER_SOCKET);
+	make_directory(GOBO_RUNNER_RUN_DIR, 0755);
+	unlink(GOBO_RUNNER_SOCKET);
+	sockfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sockfd < 0 || bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sockfd, 64) < 0) {
+		perror(GOBO_RUNNER_SOCKET);
+		free(pool);
+		return ERR_NOSANDBOX;
+	}
+	chmod(GOBO_RUNNER_SOCKET, 0666);
+
+	/* No SA_RESTART: let accept() return on SIGINT/SIGTERM */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	args.executable = "runnerd";
+	verbose_printf("runnerd: listening on %s with a pool of %d namespaces\n",
+		GOBO_RUNNER_SOCKET, args.pool_size);
+	while (! daemon_quit) {
+		clientfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+		if (clientfd < 0) {
+			if (errno != EINTR)
+				perror("accept");
+			continue;
+		}
+		serve_pooled_namespace(clientfd, pool);
+		close(clientfd);
+	}
+
+	close(sockfd);
+	unlink(GOBO_RUNNER_SOCKET);
+	for (i=0; i<args.pool_size; ++i)
+		if (pool[i].key)
+			release_pooled_namespace(&pool[i]);
+	free(pool);
+	return 0;
+}
+
+/**
+ * Asks runnerd for a namespace prepared with the overlays in @mergedirs and
+ * moves into a private copy of it, where the caller stacks its own write
+ * layer with mount_pooled_overlay_dirs().
+ * @param layers Receives the LAYER_* bits of the overlays found in the namespace
+ * @return 0 on success or a negative value if the daemon is not available,
+ * in which case the caller should build its own namespace.
+ */
+static int
+attach_pooled_namespace(const struct path_set *mergedirs, unsigned *layers)
+{
+	char control[CMSG_SPACE(sizeof(int))], reply[2] = { 1, 0 }, *cwd, *request = NULL;
+	struct timeval timeout = { .tv_sec = 5, .tv_usec = 0 };
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int sockfd, nsfd = -1, ret = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", GOBO_RUNNER_SOCKET);
+	sockfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sockfd < 0)
+		return -1;
+	if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(sockfd);
+		return -1;
+	}
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	request = path_set_to_string(mergedirs);
+	if (! request || dprintf(sockfd, "%d %d %s\n", args.pure, args.removedeps, request) < 0)
+		goto out;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) != sizeof(reply) || reply[0] != 0)
+		goto out;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (! cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+		goto out;
+	memcpy(&nsfd, CMSG_DATA(cmsg), sizeof(int));
+
+	/* setns() moves us to the namespace's root directory */
+	cwd = getcwd(NULL, 0);
+	if (setns(nsfd, CLONE_NEWNS) < 0) {
+		perror("setns");
+	} else {
+		/* Our write layer must not show up in the namespace other clients attach to */
+		if (unshare(CLONE_NEWNS) < 0) {
+			perror("unshare");
+			exit(ERR_MNT_NAMESPACE);
+		}
+		if (isolate_mount_namespace() < 0)
+			exit(ERR_MNT_NAMESPACE);
+		verbose_printf("attached to a namespace pooled by runnerd\n");
+		if (cwd && chdir(cwd) < 0)
+			perror(cwd);
+		*layers = (unsigned char) reply[1];
+		ret = 0;
+	}
+	free(cwd);
+
+out:
+	if (nsfd >= 0)
+		close(nsfd);
+	close(sockfd);
+	free(request);
+	return ret;
+}
+
+/*
+ * --prefetch: while the child is being forked, a thread walks the ELF
+ * dependencies of the executable (PT_INTERP and DT_NEEDED, transitively) the
+ * way ld.so would find them through the overlay, and asks the kernel to read
+ * them ahead so that the dynamic loader does not stall on page cache misses.
+ */
+#define PREFETCH_MAX_OBJECTS  256
+#define PREFETCH_MAX_NEEDED   128
+
+struct elf_deps {
+	char *interp;                        /* PT_INTERP */
+	char *runpath;                       /* DT_RUNPATH, or DT_RPATH */
+	char *needed[PREFETCH_MAX_NEEDED];   /* DT_NEEDED */
+	int numneeded;
+};
+
+static pthread_t prefetch_thread;
+static bool prefetch_running;
+
+static char *
+elf_read_string(int fd, off_t offset)
+{
+	char buf[PATH_MAX];
+	ssize_t n = pread(fd, buf, sizeof(buf)-1, offset);
+	if (n <= 0)
+		return NULL;
+	buf[n] = '\0';
+	return strdup(buf);
+}
+
+/**
+ * Extracts the interpreter and the dynamic dependencies of the ELF file open
+ * at @fd. Only files of the host's byte order are understood.
+ */
+static int
+read_elf_deps(int fd, struct elf_deps *deps)
+{
+	unsigned char ident[EI_NIDENT];
+	uint64_t phoff, phnum, phentsize, dynoff = 0, dynsize = 0, strtab = 0, strtaboff = 0;
+	uint64_t needed[PREFETCH_MAX_NEEDED], runpath = 0;
+	uint64_t loads[16][3];   /* p_vaddr, p_filesz, p_offset of the PT_LOAD segments */
+	int numloads = 0, numneeded = 0, hasrunpath = 0;
+	bool is64;
+	uint64_t i;
+
+	memset(deps, 0, sizeof(*deps));
+	if (pread(fd, ident, sizeof(ident), 0) != sizeof(ident) || memcmp(ident, ELFMAG, SELFMAG))
+		return -ENOEXEC;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	if (ident[EI_DATA] != ELFDATA2LSB)
+		return -ENOEXEC;
+#else
+	if (ident[EI_DATA] != ELFDATA2MSB)
+		return -ENOEXEC;
+#endif
+	is64 = ident[EI_CLASS] == ELFCLASS64;
+	if (is64) {
+		Elf64_Ehdr hdr;
+		if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			return -ENOEXEC;
+		phoff = hdr.e_phoff;
+		phnum = hdr.e_phnum;
+		phentsize = hdr.e_phentsize;
+	} else {
+		Elf32_Ehdr hdr;
+		if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			return -ENOEXEC;
+		phoff = hdr.e_phoff;
+		phnum = hdr.e_phnum;
+		phentsize = hdr.e_phentsize;
+	}
+	if (phentsize != (is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr)))
+		return -ENOEXEC;
+
+	for (i=0; i<phnum; ++i) {
+		uint64_t type, offset, vaddr, filesz;
+		if (is64) {
+			Elf64_Phdr phdr;
+			if (pread(fd, &phdr, sizeof(phdr), phoff + i*phentsize) != sizeof(phdr))
+				return -ENOEXEC;
+			type = phdr.p_type, offset = phdr.p_offset, vaddr = phdr.p_vaddr, filesz = phdr.p_filesz;
+		} else {
+			Elf32_Phdr phdr;
+			if (pread(fd, &phdr, sizeof(phdr), phoff + i*phentsize) != sizeof(phdr))
+				return -ENOEXEC;
+			type = phdr.p_type, offset = phdr.p_offset, vaddr = phdr.p_vaddr, filesz = phdr.p_filesz;
+		}
+		if (type == PT_INTERP && ! deps->interp) {
+			deps->interp = elf_read_string(fd, offset);
+		} else if (type == PT_DYNAMIC) {
+			dynoff = offset;
+			dynsize = filesz;
+		} else if (type == PT_LOAD && numloads < 16) {
+			loads[numloads][0] = vaddr;
+			loads[numloads][1] = filesz;
+			loads[numloads][2] = offset;
+			numloads++;
+		}
+	}
+
+	for (i=0; dynsize && i < dynsize; i += is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn)) {
+		int64_t tag;
+		uint64_t val;
+		if (is64) {
+			Elf64_Dyn dyn;
+			if (pread(fd, &dyn, sizeof(dyn), dynoff + i) != sizeof(dyn))
 				break;
-			default:
+			tag = dyn.d_tag, val = dyn.d_un.d_val;
+		} else {
+			Elf32_Dyn dyn;
+			if (pread(fd, &dyn, sizeof(dyn), dynoff + i) != sizeof(dyn))
 				break;
+			tag = dyn.d_tag, val = dyn.d_un.d_val;
+		}
+		if (tag == DT_NULL)
+			break;
+		else if (tag == DT_NEEDED && numneeded < PREFETCH_MAX_NEEDED)
+			needed[numneeded++] = val;
+		else if (tag == DT_STRTAB)
+			strtab = val;
+		else if (tag == DT_RUNPATH || (tag == DT_RPATH && ! hasrunpath)) {
+			runpath = val;
+			hasrunpath = 1;
 		}
 	}
-	return arch;
+	if (! strtab)
+		return 0;
+
+	/* DT_STRTAB holds a virtual address */
+	for (i=0; i<numloads; ++i)
+		if (strtab >= loads[i][0] && strtab < loads[i][0] + loads[i][1])
+			strtaboff = strtab - loads[i][0] + loads[i][2];
+	if (! strtaboff)
+		return 0;
+	for (i=0; i<numneeded; ++i) {
+		deps->needed[deps->numneeded] = elf_read_string(fd, strtaboff + needed[i]);
+		if (deps->needed[deps->numneeded])
+			deps->numneeded++;
+	}
+	if (hasrunpath)
+		deps->runpath = elf_read_string(fd, strtaboff + runpath);
+	return 0;
 }
 
-static char *
-parse_architecture_file(const char *archfile)
+static void
+free_elf_deps(struct elf_deps *deps)
 {
-	struct stat statbuf;
-	char line[64];
-	size_t n;
+	int i;
+	for (i=0; i<deps->numneeded; ++i)
+		free(deps->needed[i]);
+	free(deps->interp);
+	free(deps->runpath);
+}
 
-	int res = stat(archfile, &statbuf);
-	if (res < 0 && errno == EACCES) {
-		perror(archfile);
-		return NULL;
+/**
+ * Looks @name up in the colon-separated list of directories @dirs.
+ */
+static bool
+find_in_dirs(const char *name, const char *dirs, int mode, char *result, size_t size)
+{
+	const char *dir, *end;
+
+	for (dir = dirs; dir && *dir; dir = *end ? end + 1 : end) {
+		end = strchrnul(dir, ':');
+		/* $ORIGIN and friends are not expanded */
+		if (end == dir || memchr(dir, '$', end - dir))
+			continue;
+		snprintf(result, size, "%.*s/%s", (int) (end - dir), dir, name);
+		if (access(result, mode) == 0)
+			return true;
 	}
+	return false;
+}
 
-	FILE *fp = fopen(archfile, "r");
-	if (fp) {
-		memset(line, 0, sizeof(line));
-		n = fread(line, sizeof(char), sizeof(line)-1, fp);
-		if (n > 0 && line[n-1] == '\n')
-			line[n-1] = '\0';
-		fclose(fp);
-		return strstr(line, "i386") ? strdup("i686") : strdup(line);
+/**
+ * Finds a DT_NEEDED entry in the order ld.so will search for it in the
+ * sandbox: LD_LIBRARY_PATH (which the child prefixes with /System/Index),
+ * DT_RUNPATH and the default directories. ld.so.cache is not consulted.
+ */
+static bool
+find_library(const char *name, const char *runpath, char *result, size_t size)
+{
+	const char *env = getenv("LD_LIBRARY_PATH");
+
+	if (strchr(name, '/')) {
+		snprintf(result, size, "%s", name);
+		return access(result, R_OK) == 0;
 	}
-	return NULL;
+	return find_in_dirs(name, GOBO_INDEX_DIR "/lib64:" GOBO_INDEX_DIR "/lib", R_OK, result, size) ||
+		find_in_dirs(name, env, R_OK, result, size) ||
+		find_in_dirs(name, runpath, R_OK, result, size) ||
+		find_in_dirs(name, "/lib64:/usr/lib64:/lib:/usr/lib", R_OK, result, size);
 }
 
-static char *
-open_program_file(const char *programdir, const char *path)
+static void *
+prefetch_worker(void *data)
 {
-	struct stat statbuf;
-	char *fname = NULL;
-	int res;
+	struct path_set objects;
+	struct path_entry *entry;
+	struct elf_deps deps;
+	char path[PATH_MAX];
+	int i, fd, count = 0;
 
-	if (asprintf(&fname, "%s%s", programdir, path) <= 0) {
-		fprintf(stderr, "Not enough memory\n");
+	/* Only touch what the caller could read (this is per-thread) */
+	setfsuid(getuid());
+	setfsgid(getgid());
+
+	path_set_init(&objects);
+	if (strchr(args.executable, '/'))
+		snprintf(path, sizeof(path), "%s", args.executable);
+	else if (! find_in_dirs(args.executable, getenv("PATH"), X_OK, path, sizeof(path)) &&
+		! find_in_dirs(args.executable, GOBO_INDEX_DIR "/bin", X_OK, path, sizeof(path)))
 		return NULL;
+	path_set_add(&objects, path);
+
+	/* The set doubles as the work queue: new entries are appended to its tail */
+	list_for_each_entry(entry, &objects.entries, list) {
+		struct stat statbuf;
+		fd = open_object_file(entry->path, &statbuf);
+		if (fd < 0)
+			continue;
+		posix_fadvise(fd, 0, statbuf.st_size, POSIX_FADV_WILLNEED);
+		count++;
+		if (read_elf_deps(fd, &deps) == 0) {
+			if (deps.interp && objects.count < PREFETCH_MAX_OBJECTS)
+				path_set_add(&objects, deps.interp);
+			for (i=0; i<deps.numneeded && objects.count < PREFETCH_MAX_OBJECTS; ++i)
+				if (find_library(deps.needed[i], deps.runpath, path, sizeof(path)))
+					path_set_add(&objects, path);
+			free_elf_deps(&deps);
+		}
+		close(fd);
 	}
-	res = stat(fname, &statbuf);
-	if (res == 0 && statbuf.st_size > 1)
-		return fname;
-	else if (res < 0 && errno != ENOENT)
-		perror(fname);
+	debug_printf("prefetched %d objects\n", count);
+	path_set_free(&objects);
+	return NULL;
+}
 
-	free(fname);
+/**
+ * Starts reading the executable and its shared objects ahead, in the
+ * background. The mount namespace must be set up by now.
+ */
+static void
+start_prefetch(void)
+{
+	prefetch_running = pthread_create(&prefetch_thread, NULL, prefetch_worker, NULL) == 0;
+	if (! prefetch_running)
+		debug_printf("could not start the prefetch thread\n");
+}
+
+static void
+wait_prefetch(void)
+{
+	if (prefetch_running)
+		pthread_join(prefetch_thread, NULL);
+	prefetch_running = false;
+}
+
+/**
+ * Looks the shared object @name up in the lib and lib64 directories of
+ * @mergedirs, in overlay order.
+ * @return The program that supplies it, or NULL.
+ */
+static struct path_entry *
+find_library_supplier(const struct path_set *mergedirs, const char *name, char *result, size_t size)
+{
+	const char *subdirs[] = { "lib", "lib64", NULL };
+	struct path_entry *entry;
+	int i;
+
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		for (i=0; subdirs[i]; ++i) {
+			snprintf(result, size, "%s/%s/%s", entry->path, subdirs[i], name);
+			if (access(result, R_OK) == 0)
+				return entry;
+		}
+	}
 	return NULL;
 }
 
 /**
- * mount_overlay:
+ * Implements --minimal: only the programs that supply the executable or one
+ * of the shared objects it needs (transitively, through DT_NEEDED) have their
+ * lib, include and libexec directories mounted. bin and share are kept for
+ * every program, as scripts and helpers look things up in them.
+ * @return 0 on success or -1 if the executable is not a dynamic ELF file, in
+ * which case every layer is kept.
  */
-static char *
-mount_overlay()
+static int
+minimize_layers(struct path_set *mergedirs)
 {
+	const unsigned supplier_layers = LAYER_LIB|LAYER_INCLUDE|LAYER_LIBEXEC;
+	struct path_entry *entry, *object, *supplier;
+	struct path_set objects;
+	struct elf_deps deps;
 	struct stat statbuf;
-	int i, res = -1;
-	bool needs_wrapper = false;
-	char *programdir = NULL, *callerprogram;
-	char *archfile = NULL, *fname = NULL, *tmpstr;
-	char *mergedirs_user = NULL, *mergedirs_program = NULL, *mergedirs = NULL;
-	char **envfiles = NULL;
+	char path[PATH_MAX], *exec;
+	uid_t fsuid;
+	gid_t fsgid;
+	int i, fd, ret = -1;
+
+	/* Only open what the caller could read */
+	fsuid = setfsuid(getuid());
+	fsgid = setfsgid(getgid());
+
+	exec = strchr(args.executable, '/') ? realpath(args.executable, NULL) : which(args.executable);
+	if (! exec) {
+		verbose_printf("--minimal: cannot find %s, mounting all layers\n", args.executable);
+		setfsuid(fsuid);
+		setfsgid(fsgid);
+		return -1;
+	}
 
-	if (args.architecture == NULL) {
-		/* If args.executable is an ELF file, try to determine architecture from the header */
-		args.architecture = parse_elf_file(args.executable);
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		entry->layers = LAYER_BIN|LAYER_SHARE;
+		if (strncmp(exec, entry->path, strlen(entry->path)) == 0 && exec[strlen(entry->path)] == '/')
+			entry->layers |= supplier_layers;
 	}
 
-	programdir = get_program_dir(args.executable, false);
-	if (programdir) {
-		/* check if the software's Resources/Dependencies file exists */
-		fname = open_program_file(programdir, "/Resources/Dependencies");
-		if (fname == NULL) {
-			/* try again with Resources/BuildInformation */
-			fname = open_program_file(programdir, "/Resources/BuildInformation");
-		}
-		if (args.architecture == NULL) {
-			/* Try to determine architecture based on the Resources/Architecture metadata file */
-			if (asprintf(&archfile, "%s/Resources/Architecture", programdir) <= 0) {
-				fprintf(stderr, "Not enough memory\n");
-				goto out_free;
+	path_set_init(&objects);
+	path_set_add(&objects, exec);
+	list_for_each_entry(object, &objects.entries, list) {
+		fd = open_object_file(object->path, &statbuf);
+		if (fd < 0)
+			continue;
+		i = read_elf_deps(fd, &deps);
+		close(fd);
+		if (i < 0)
+			continue;
+		if (object->list.prev == &objects.entries && deps.numneeded > 0)
+			ret = 0;
+		for (i=0; i<deps.numneeded && objects.count < PREFETCH_MAX_OBJECTS; ++i) {
+			supplier = find_library_supplier(mergedirs, deps.needed[i], path, sizeof(path));
+			if (supplier) {
+				if (! (supplier->layers & LAYER_LIB))
+					debug_printf("--minimal: %s supplies %s\n", supplier->path, deps.needed[i]);
+				supplier->layers |= supplier_layers;
+			} else if (! find_library(deps.needed[i], deps.runpath, path, sizeof(path))) {
+				continue;
 			}
-			/* TODO: args.architecture is never freed */
-			args.architecture = parse_architecture_file(archfile);
-		}
-		callerprogram = program_in_ignorelist(programdir) ? NULL : programdir;
-		mergedirs_program =
-			fname ? prepare_merge_string(callerprogram, fname, NULL, NULL, &needs_wrapper) : NULL;
-		if (! mergedirs_program) {
-			/* For some reason the Dependencies file could not be parsed. Still,
-			 * we want to make sure that the callerprogram's directory is included
-			 * in @mergedirs so that things like the Environment file are properly
-			 * included in the wrapper file
-			 */
-			mergedirs_program = strdup(programdir);
+			path_set_add(&objects, path);
 		}
-		free(fname);
-		fname = NULL;
+		free_elf_deps(&deps);
+	}
 
+	if (ret < 0) {
+		verbose_printf("--minimal: %s is not a dynamic ELF executable, mounting all layers\n", exec);
+		list_for_each_entry(entry, &mergedirs->entries, list)
+			entry->layers = LAYER_ALL;
 	}
+	path_set_free(&objects);
+	free(exec);
+	setfsuid(fsuid);
+	setfsgid(fsgid);
+	return ret;
+}
 
-	for (i=0; args.dependencies[i]; ++i) {
-		/* take user-provided dependencies file */
-		fname = strdup(args.dependencies[i]);
-		if (! fname) {
-			fprintf(stderr, "Not enough memory\n");
-			goto out_free;
-		}
-		res = stat(fname, &statbuf);
-		if (res < 0) {
-			perror(fname);
-			goto out_free;
-		}
-		tmpstr = prepare_merge_string(NULL, fname, mergedirs_program, mergedirs_user, &needs_wrapper);
-		free(fname);
-		fname = NULL;
+/**
+ * Finds where the cgroup v2 hierarchy is mounted: /sys/fs/cgroup on unified
+ * systems, /sys/fs/cgroup/unified on hybrid ones.
+ */
+static int
+find_cgroup2_mount(char *buf, size_t size)
+{
+	struct mntent *mnt;
+	int ret = -ENOENT;
+	FILE *fp;
 
-		/* concatenate */
-		if (mergedirs_user == NULL)
-			mergedirs_user = tmpstr;
-		else if (tmpstr) {
-			char *newstr;
-			res = asprintf(&newstr, "%s%s", mergedirs_user, tmpstr);
-			if (res < 0) {
-				perror("asprintf");
-				free(tmpstr);
-				goto out_free;
-			}
-			free(mergedirs_user);
-			mergedirs_user = newstr;
-			res = 0;
+	fp = setmntent("/proc/self/mounts", "r");
+	if (! fp)
+		return -errno;
+	while ((mnt = getmntent(fp)) != NULL) {
+		if (! strcmp(mnt->mnt_type, "cgroup2")) {
+			snprintf(buf, size, "%s", mnt->mnt_dir);
+			ret = 0;
+			break;
 		}
 	}
+	endmntent(fp);
+	return ret;
+}
 
-	if (args.pure) {
-		/* Make sure that all of Bash dependencies are part of the overlay */
-		const char *bash = "/Programs/Bash/Current/Resources/Dependencies";
-		tmpstr = prepare_merge_string(NULL, bash, mergedirs_program, mergedirs_user, NULL);
-		/* concatenate */
-		if (mergedirs_user == NULL)
-			mergedirs_user = tmpstr;
-		else if (tmpstr) {
-			char *newstr;
-			res = asprintf(&newstr, "%s%s", mergedirs_user, tmpstr);
-			if (res < 0) {
-				perror("asprintf");
-				free(tmpstr);
-				goto out_free;
-			}
-			free(mergedirs_user);
-			mergedirs_user = newstr;
-			res = 0;
-		}
-	}
+/**
+ * Finds the caller's cgroup in the v2 hierarchy, as given by /proc/self/cgroup,
+ * relative to where the hierarchy is mounted.
+ */
+static int
+find_caller_cgroup(char *buf, size_t size)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int ret = -ENOENT;
+	FILE *fp;
 
-	res = asprintf(&mergedirs, "%s%s",
-			mergedirs_user ? mergedirs_user : "",
-			mergedirs_program ? mergedirs_program : "");
-	if (res < 0) {
-		perror("asprintf");
-		goto out_free;
+	fp = fopen("/proc/self/cgroup", "r");
+	if (! fp)
+		return -errno;
+	while (getline(&line, &len, fp) > 0) {
+		if (! strncmp(line, "0::/", 4)) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(buf, size, "%s", &line[3]);
+			ret = 0;
+			break;
+		}
 	}
+	free(line);
+	fclose(fp);
+	return ret;
+}
 
+/**
+ * Reads the limits listed in the program's Resources/Cgroup file, one
+ * "<file> = <value>" pair per line (e.g. "memory.high = 2G").
+ */
+static void
+read_cgroup_file(const char *programdir, char *limits[CGROUP_MAX])
+{
+	char *path, *line = NULL, *key, *value, *saveptr;
+	size_t len = 0;
+	FILE *fp;
+	int i;
 
-	res = mount_overlay_dirs(mergedirs, GOBO_INDEX_DIR);
-
-out_free:
-	if (envfiles) {
-		for (int i=0; envfiles[i]; ++i)
-			free(envfiles[i]);
-		free(envfiles);
+	path = open_program_file(programdir, "/Resources/Cgroup");
+	if (! path)
+		return;
+	fp = fopen(path, "r");
+	free(path);
+	if (! fp)
+		return;
+	while (getline(&line, &len, fp) > 0) {
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+		key = strtok_r(line, "= \t\n", &saveptr);
+		value = strtok_r(NULL, "= \t\n", &saveptr);
+		if (! key || ! value)
+			continue;
+		for (i=0; i<CGROUP_MAX; ++i) {
+			if (! strcmp(key, cgroup_files[i])) {
+				free(limits[i]);
+				limits[i] = strdup(value);
+			}
+		}
 	}
-	if (programdir) { free(programdir); }
-	if (mergedirs_program) { free(mergedirs_program); }
-	if (mergedirs_user) { free(mergedirs_user); }
-	if (mergedirs && res < 0) { free(mergedirs); mergedirs = NULL; }
-	if (archfile) { free(archfile); }
-	if (fname) { free(fname); }
-	return mergedirs;
+	free(line);
+	fclose(fp);
 }
 
 /**
- * update_env_var_list:
+ * Moves Runner into a leaf of its own, Runner-<pid>-supervisor, next to the
+ * program's cgroup: cgroup v2 only lets @parent hand controllers down to its
+ * children once no process is left in it. Supervisor leaves left behind by
+ * previous launches are removed on the way; those still in use are busy.
  */
 static int
-update_env_var_list(const char *var, const char *item)
+enter_supervisor_cgroup(const char *parent)
 {
-	const char *env;
-	char *value;
+	char path[PATH_MAX*2+NAME_MAX];
+	struct dirent *entry;
+	size_t len;
+	DIR *dp;
 	int ret;
 
-	env = getenv(var);
-	if (env == NULL || *env == 0) {
-		setenv(var, item, 1);
-	} else {
-		ret = asprintf(&value, "%s:%s", item, env);
-		if (ret <= 0) {
-			return ERR_OUTMEMORY;
-		} else {
-			setenv(var, value, 1);
-			free(value);
+	dp = opendir(parent);
+	while (dp && (entry = readdir(dp))) {
+		len = strlen(entry->d_name);
+		if (! strncmp(entry->d_name, "Runner-", 7) && len > 11 &&
+			! strcmp(&entry->d_name[len-11], "-supervisor")) {
+			snprintf(path, sizeof(path), "%s/%s", parent, entry->d_name);
+			rmdir(path);
 		}
 	}
+	if (dp)
+		closedir(dp);
 
-	return 0;
+	snprintf(path, sizeof(path), "%s/Runner-%d-supervisor", parent, getpid());
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -errno;
+	strcat(path, "/cgroup.procs");
+	ret = write_proc_file(path, "0");
+	if (ret < 0)
+		debug_printf("%s: %s\n", path, strerror(-ret));
+	return ret;
 }
 
-int
-create_write_layer(void)
+/**
+ * Creates the cgroup the program will run in, Runner-<exec>-<pid> under the
+ * caller's own cgroup, and applies the limits given on the command line or,
+ * failing that, in the program's Resources/Cgroup file.
+ *
+ * All of this is done with the caller's credentials, so it only works in a
+ * cgroup delegated to the caller (e.g. by systemd-run --user -p Delegate=yes)
+ * and the program can never leave the caller's part of the hierarchy.
+ */
+static int
+create_cgroup(void)
 {
-	const char *sources[] = {"bin", "include", "lib",  "libexec", "share", NULL};
-	const char *home, *exec;
-	char path[PATH_MAX];
-	int ret, i;
-
-	home = getenv("HOME");
-	if (home == NULL)
-		home = "/tmp";
-
-	/* mkdir -p ~/.local/Runner */
-	memset(path, 0, sizeof(path));
-	snprintf(path, sizeof(path)-1, "%s/.local", home);
-	mkdir(path, 0755);
-	chown(path, getuid(), getgid());
-	strcat(path, "/Runner");
-	mkdir(path, 0755);
-	chown(path, getuid(), getgid());
-
-	/* Work directory */
-	exec = strrchr(args.executable, '/');
-	exec = exec ? exec + 1 : args.executable;
-	ret = asprintf(&args.workdir, "%s/.local/Runner/%ld-%s-XXXXXX", home, time(NULL), exec);
+	/* The controller of each of cgroup_files[] */
+	const char *controllers[CGROUP_MAX] = { "+cpu", "+io", "+memory", "+pids" };
+	char mnt[PATH_MAX], cgroup[PATH_MAX], parent[PATH_MAX*2], path[PATH_MAX*2+NAME_MAX], *programdir;
+	char *file_limits[CGROUP_MAX] = { NULL };
+	const char *exec, *value;
+	uid_t euid;
+	int i, ret;
+
+	ret = find_cgroup2_mount(mnt, sizeof(mnt));
+	if (ret == 0)
+		ret = find_caller_cgroup(cgroup, sizeof(cgroup));
 	if (ret < 0) {
-		ret = -ENOMEM;
-		perror("asprintf");
-		goto out_error;
+		fprintf(stderr, "Could not find a cgroup v2 hierarchy: %s\n", strerror(-ret));
+		return ret;
 	}
-	if (mkdtemp(args.workdir) == NULL) {
+	snprintf(parent, sizeof(parent), "%s%s", mnt, strcmp(cgroup, "/") ? cgroup : "");
+	euid = geteuid();
+	if (seteuid(getuid()) < 0) {
 		ret = -errno;
-		fprintf(stderr, "mkdtemp %s: %s\n", args.workdir, strerror(errno));
-		goto out_error;
+		perror("seteuid");
+		return ret;
 	}
-	chown(args.workdir, getuid(), getgid());
 
-	/* Write layer */
-	ret = asprintf(&args.writelayer, "%s/write_layer", args.workdir);
-	if (ret < 0) {
-		ret = -ENOMEM;
-		perror("asprintf");
-		goto out_error;
+	programdir = get_program_dir(args.executable, false);
+	if (programdir) {
+		read_cgroup_file(programdir, file_limits);
+		free(programdir);
 	}
-	mkdir(args.writelayer, 0755);
-	chown(args.writelayer, getuid(), getgid());
-	for (i=0; sources[i]; ++i) {
-		snprintf(path, sizeof(path)-1, "%s/%s", args.writelayer, sources[i]);
-		mkdir(path, 0755);
-		chown(path, getuid(), getgid());
+
+	/*
+	 * Controllers that are not available are simply not enabled, unless a
+	 * limit needs them. Those of the root cgroup, which may hold processes,
+	 * are left to the system's administrator.
+	 */
+	if (strcmp(parent, mnt))
+		enter_supervisor_cgroup(parent);
+	for (i=0; strcmp(parent, mnt) && i<CGROUP_MAX; ++i) {
+		value = args.cgroup_limits[i] ? args.cgroup_limits[i] : file_limits[i];
+		snprintf(path, sizeof(path), "%s/cgroup.subtree_control", parent);
+		ret = write_proc_file(path, controllers[i]);
+		if (ret < 0 && value) {
+			fprintf(stderr, "Could not enable the %s controller in %s: %s\n", &controllers[i][1], parent, strerror(-ret));
+			goto out_error;
+		} else if (ret < 0) {
+			debug_printf("cgroup controller %s is not available\n", &controllers[i][1]);
+		}
 	}
 
-	/* Upper layer. Overlayfs requires it to activate the write branch */
-	ret = asprintf(&args.upperlayer, "%s/upper_layer", args.workdir);
-	if (ret < 0) {
+	exec = strrchr(args.executable, '/');
+	exec = exec ? exec + 1 : args.executable;
+	if (asprintf(&args.cgroupdir, "%s/Runner-%s-%d", parent, exec, getpid()) < 0) {
+		args.cgroupdir = NULL;
 		ret = -ENOMEM;
-		perror("asprintf");
 		goto out_error;
 	}
-	mkdir(args.upperlayer, 0755);
-	chown(args.upperlayer, getuid(), getgid());
-	for (i=0; sources[i]; ++i) {
-		snprintf(path, sizeof(path)-1, "%s/%s", args.upperlayer, sources[i]);
-		mkdir(path, 0755);
-		chown(path, getuid(), getgid());
+	if (mkdir(args.cgroupdir, 0755) < 0) {
+		ret = -errno;
+		fprintf(stderr, "%s: %s\n", args.cgroupdir, strerror(errno));
+		goto out_error;
 	}
 
+	for (i=0; i<CGROUP_MAX; ++i) {
+		value = args.cgroup_limits[i] ? args.cgroup_limits[i] : file_limits[i];
+		if (! value)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", args.cgroupdir, cgroup_files[i]);
+		ret = write_proc_file(path, value);
+		if (ret < 0) {
+			fprintf(stderr, "Could not set %s to %s: %s\n", cgroup_files[i], value, strerror(-ret));
+			rmdir(args.cgroupdir);
+			goto out_error;
+		}
+		verbose_printf("%s=%s\n", cgroup_files[i], value);
+	}
+	for (i=0; i<CGROUP_MAX; ++i)
+		free(file_limits[i]);
+	seteuid(euid);
 	return 0;
 
 out_error:
-	free(args.upperlayer);
-	free(args.writelayer);
-	free(args.workdir);
+	seteuid(euid);
+	for (i=0; i<CGROUP_MAX; ++i)
+		free(file_limits[i]);
+	free(args.cgroupdir);
+	args.cgroupdir = NULL;
 	return ret;
 }
 
-void
-cleanup_directory(const char *layername, char *dirname)
+/**
+ * Moves the calling process into the program's cgroup.
+ */
+static int
+enter_cgroup(void)
 {
-	int cleanup_entry(const char *path, const struct stat *statbuf, int typeflag, struct FTW *ftwbuf)
-	{
-		if (typeflag == FTW_F || typeflag == FTW_SL || typeflag == FTW_SLN) {
-			debug_printf("%s: deleting file %s\n", layername, path);
-			unlink(path);
-		} else if (typeflag == FTW_D || typeflag == FTW_DP || typeflag == FTW_DNR) {
-			debug_printf("%s: deleting directory %s\n", layername, path);
-			rmdir(path);
-		}
-		return 0;
-	}
+	char path[PATH_MAX+NAME_MAX];
 
-	struct rlimit limit;
-	int ret = getrlimit(RLIMIT_NOFILE, &limit);
-	if (ret < 0) {
-		perror("getrusage");
-		limit.rlim_cur = 1024;
-	}
-	ret = nftw(dirname, cleanup_entry, limit.rlim_cur, FTW_DEPTH);
-	if (ret < 0)
-		perror("nftw");
-	debug_printf("%s: deleting directory %s\n", layername, dirname);
-	rmdir(dirname);
+	snprintf(path, sizeof(path), "%s/cgroup.procs", args.cgroupdir);
+	return write_proc_file(path, "0");
 }
 
-void
-show_usage_and_exit(char *exec, int err)
-{
-	struct utsname uts_data;
-	uname(&uts_data);
-
-	printf(
-	"Executes a command with a read-only view of /System/Index overlaid with\n"
-	"dependencies extracted from the program's Resources/Dependencies and/or\n"
-	"from the given dependencies file(s).\n"
-	"\n"
-	"Syntax: %s [options] <command> [arguments]\n"
-	"\n"
-	"Available options are:\n"
-	"  -a, --arch=ARCH           Look for dependencies built for ARCH (default: extract from ELF headers\n"
-	"                            or from Resources/Architecture, falling back to %s on failure)\n"
-	"  -d, --dependencies=FILE   Path to GoboLinux Dependencies file to use\n"
-	"  -h, --help                This help\n"
-	"  -q, --quiet               Don't warn on bogus dependencies file(s)\n"
-	"  -v, --verbose             Run in verbose mode (-vv to enable debug messages)\n"
-	"  -c, --check               Check if Runner can be used in this system\n"
-	"  -S, --strict              Strict dependency resolution: If no operator is given assume '=' (Qt 5.2 to Qt=5.2)\n"
-	"  -p, --pure                Create a /System/Index overlay based purely on listed dependencies\n"
-	"  -f, --fallback            Run the command without the sandbox in case this is not available\n"
-	"  -E, --no-source-env       Do not import dependencies\' Resources/Environment files\n"
-	"  -C, --no-cleanup          Do not cleanup work directory on exit\n"
-	"  -R, --no-removedeps       Do not remove conflicting versions of dependencies from /System/Index view\n"
-	"\n", exec, uts_data.machine);
-	exit(err);
+/**
+ * Collects cpu.stat and memory.peak of the program's cgroup, reports them
+ * alongside its exit status and removes the cgroup.
+ */
+static void
+report_cgroup(int exit_status)
+{
+	char path[PATH_MAX+NAME_MAX], key[64];
+	long long value;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/cpu.stat", args.cgroupdir);
+	fp = fopen(path, "r");
+	while (fp && fscanf(fp, "%63s %lld", key, &value) == 2) {
+		if (! strcmp(key, "usage_usec"))
+			cgroup_usage.usage_usec = value;
+		else if (! strcmp(key, "user_usec"))
+			cgroup_usage.user_usec = value;
+		else if (! strcmp(key, "system_usec"))
+			cgroup_usage.system_usec = value;
+	}
+	if (fp)
+		fclose(fp);
+	snprintf(path, sizeof(path), "%s/memory.peak", args.cgroupdir);
+	fp = fopen(path, "r");
+	if (fp && fscanf(fp, "%lld", &value) == 1)
+		cgroup_usage.memory_peak = value;
+	if (fp)
+		fclose(fp);
+
+	if (! args.quiet)
+		fprintf(stderr, "%s: exit_status=%d usage_usec=%lld user_usec=%lld system_usec=%lld memory.peak=%lld\n",
+			args.executable, exit_status, cgroup_usage.usage_usec, cgroup_usage.user_usec,
+			cgroup_usage.system_usec, cgroup_usage.memory_peak);
+
+	/* Fails if the program left processes behind, which keep the cgroup alive */
+	if (rmdir(args.cgroupdir) < 0)
+		debug_printf("rmdir %s: %s\n", args.cgroupdir, strerror(errno));
 }
 
+/*
+ * Access tracing (--trace-access): a fanotify group watching the overlays on
+ * /System/Index tells which of the layers below them each file opened by the
+ * program came from. Layers that supplied nothing are dependencies the
+ * program could do without, at least for the workload that was traced.
+ */
+struct trace_layer {
+	char *path;                /* Program directory */
+	unsigned layers;           /* LAYER_* mounted from it */
+	bool touched;              /* Was a file opened from it? */
+};
+
+static struct {
+	int fd;                    /* fanotify group */
+	int stopfd[2];             /* Written to once the program has exited */
+	pthread_t thread;
+	bool running;
+	bool overflow;             /* Did the kernel drop events? */
+	unsigned long files;       /* Distinct files opened under /System/Index */
+	struct trace_layer *layers;
+	int numlayers;
+	struct path_set seen;      /* Files attributed so far */
+} trace = { .fd = -1, .stopfd = { -1, -1 } };
+
 /**
- * parse_arguments:
+ * Attributes the file behind @fd, opened through one of the overlays, to the
+ * topmost layer that has it.
  */
-int
-parse_arguments(int argc, char *argv[])
+static void
+trace_record(int fd)
 {
-	struct option long_options[] = {
-		{"dependencies",    required_argument, 0,  'd'},
-		{"arch",            required_argument, 0,  'a'},
-		{"help",            no_argument,       0,  'h'},
-		{"quiet",           no_argument,       0,  'q'},
-		{"verbose",         no_argument,       0,  'v'},
-		{"check",           no_argument,       0,  'c'},
-		{"strict",          no_argument,       0,  'S'},
-		{"pure",            no_argument,       0,  'p'},
-		{"fallback",        no_argument,       0,  'f'},
-		{"no-source-env",   no_argument,       0,  'E'},
-		{"no-cleanup",      no_argument,       0,  'C'},
-		{"no-removedeps",   no_argument,       0,  'R'},
-		{0,                 0,                 0,   0 }
-	};
-	const char *short_options = "+d:a:hqvcSpfECR";
-	bool valid = true;
-	int next = optind;
-	int num_deps = 0;
-	int dep_nr = 0;
+	const char *sources[] = {"bin", "include", "lib",  "libexec", "share", NULL};
+	const char *aliases[] = {"sbin", NULL,     "lib64", NULL,      NULL,   NULL};
+	char link[64], path[PATH_MAX], candidate[PATH_MAX];
+	const char *target, *rel;
+	struct stat statbuf;
+	ssize_t len;
+	int i, j, k;
 
-	/* Don't stop on errors */
-	opterr = 0;
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, path, sizeof(path)-1);
+	if (len < 0)
+		return;
+	path[len] = '\0';
+	if (strncmp(path, GOBO_INDEX_DIR "/", strlen(GOBO_INDEX_DIR "/")))
+		return;
+	target = path + strlen(GOBO_INDEX_DIR "/");
+	rel = strchr(target, '/');
+	if (! rel || path_set_add(&trace.seen, path) <= 0)
+		return;
+	trace.files++;
 
-	/* Count how many dependency files were given */
-	while (valid) {
-		int c = getopt_long(argc, argv, short_options, long_options, NULL);
-		if (c == -1)
+	for (i=0; sources[i]; ++i)
+		if (! strncmp(target, sources[i], rel - target) && strlen(sources[i]) == (size_t) (rel - target))
 			break;
-		else if (c == 'd')
-			num_deps++;
-		else {
-			struct option *ptr = long_options;
-			valid = false;
-			while (ptr->name) {
-				if (c == ptr->val) {
-					valid = true;
-					break;
-				}
-				ptr++;
+	if (! sources[i])
+		return;
+	for (k=0; k<trace.numlayers; ++k) {
+		if (! (trace.layers[k].layers & (1 << i)))
+			continue;
+		for (j=0; j<2; ++j) {
+			const char *source = j == 0 ? sources[i] : aliases[i];
+			if (! source)
+				continue;
+			snprintf(candidate, sizeof(candidate), "%s/%s%s", trace.layers[k].path, source, rel);
+			if (lstat(candidate, &statbuf) == 0) {
+				trace.layers[k].touched = true;
+				return;
 			}
 		}
 	}
+}
 
-	/* Default values */
-	args.executable = NULL;
-	args.arguments = NULL;
-	args.architecture = NULL;
-	args.check = false;
-	args.debug = false;
-	args.cleanup = true;
-	args.verbose = false;
-	args.quiet = false;
-	args.strict = false;
-	args.pure = false;
-	args.fallback = false;
-	args.sourceenv = true;
-	args.removedeps = true;
-
-	args.dependencies = (const char **) calloc(num_deps+1, sizeof(char *));
-	if (! args.dependencies)
-		return ERR_OUTMEMORY;
-
-	optind = 1;
-	while (valid) {
-		int c = getopt_long(argc, argv, short_options, long_options, NULL);
-		if (c == -1)
+static void *
+trace_worker(void *data)
+{
+	char buf[8192] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	struct pollfd fds[2] = {
+		{ .fd = trace.fd, .events = POLLIN },
+		{ .fd = trace.stopfd[0], .events = POLLIN },
+	};
+	struct fanotify_event_metadata *event;
+	bool stopping = false;
+	pid_t self = getpid();
+	ssize_t len;
+
+	for (;;) {
+		/* Once the program is gone, drain what is left in the queue and stop */
+		if (poll(fds, 2, stopping ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
 			break;
-		switch (c) {
-			case 'a':
-				args.architecture = optarg;
-				break;
-			case 'd':
-				args.dependencies[dep_nr++] = optarg;
-				break;
-			case 'h':
-				show_usage_and_exit(argv[0], 0);
-				break;
-			case 'q':
-				args.quiet = true;
-				break;
-			case 'v':
-				if (args.verbose)
-					args.debug = true;
-				args.verbose = true;
-				break;
-			case 'c':
-				args.check = true;
-				break;
-			case 'S':
-				args.strict = true;
-				break;
-			case 'p':
-				args.pure = true;
-				args.removedeps = false; // implicitly set to 'false' with --pure
-				break;
-			case 'f':
-				args.fallback = true;
-				break;
-			case 'E':
-				args.sourceenv = false;
-				break;
-			case 'C':
-				args.cleanup = false;
-				break;
-			case 'R':
-				args.removedeps = false;
-				break;
-			case '?':
-			default:
-				valid = false;
+		}
+		if (fds[1].revents)
+			stopping = true;
+		if (! (fds[0].revents & POLLIN)) {
+			if (stopping)
 				break;
+			continue;
+		}
+		len = read(trace.fd, buf, sizeof(buf));
+		if (len < 0 && errno != EAGAIN && errno != EINTR)
+			break;
+		for (event = (struct fanotify_event_metadata *) buf; len > 0 && FAN_EVENT_OK(event, len);
+				event = FAN_EVENT_NEXT(event, len)) {
+			if (event->mask & FAN_Q_OVERFLOW)
+				trace.overflow = true;
+			if (event->fd < 0)
+				continue;
+			/* Skip what Runner itself opens, such as --prefetch's reads */
+			if (event->pid != self)
+				trace_record(event->fd);
+			close(event->fd);
 		}
-		if (valid)
-			next = optind;
 	}
+	return NULL;
+}
 
-	optind = next;
-	if (optind < argc) {
-		int i, num = argc - optind + 1;
-		args.arguments = calloc(num, sizeof(char *));
-		if (args.arguments == NULL)
-			return ERR_OUTMEMORY;
-		for (i = optind; i < argc; i++)
-			args.arguments[i-optind] = argv[i];
-		args.executable = argv[optind];
+/**
+ * Starts tracing the files opened through the overlays of @mergedirs. Must be
+ * called from within the mount namespace, once the overlays are mounted.
+ */
+static int
+start_access_trace(const struct path_set *mergedirs)
+{
+	const char *targets[] = {"bin", "include", "lib", "libexec", "share", NULL};
+	struct path_entry *entry;
+	struct statfs fsbuf;
+	char mp[PATH_MAX];
+	int i, marked = 0, err = -ENOMEM;
+
+	trace.fd = fanotify_init(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK, O_RDONLY|O_LARGEFILE|O_CLOEXEC);
+	if (trace.fd < 0)
+		return -errno;
+	for (i=0; targets[i]; ++i) {
+		/* Marking a directory that is not an overlay would trace the host's mount */
+		snprintf(mp, sizeof(mp), "%s/%s", GOBO_INDEX_DIR, targets[i]);
+		if (statfs(mp, &fsbuf) < 0 || fsbuf.f_type != OVERLAYFS_SUPER_MAGIC)
+			continue;
+		if (fanotify_mark(trace.fd, FAN_MARK_ADD|FAN_MARK_MOUNT, FAN_OPEN, AT_FDCWD, mp) < 0) {
+			debug_printf("fanotify_mark %s: %s\n", mp, strerror(errno));
+		} else {
+			marked++;
+		}
+	}
+	if (marked == 0) {
+		err = -ENODEV;
+		goto out_error;
 	}
 
+	trace.layers = calloc(mergedirs->count, sizeof(struct trace_layer));
+	if (! trace.layers)
+		goto out_error;
+	list_for_each_entry(entry, &mergedirs->entries, list) {
+		trace.layers[trace.numlayers].path = strdup(entry->path);
+		trace.layers[trace.numlayers].layers = entry->layers;
+		if (! trace.layers[trace.numlayers].path)
+			goto out_error;
+		trace.numlayers++;
+	}
+	path_set_init(&trace.seen);
+	if (pipe2(trace.stopfd, O_CLOEXEC) < 0) {
+		err = -errno;
+		goto out_error;
+	}
+	trace.running = pthread_create(&trace.thread, NULL, trace_worker, NULL) == 0;
+	if (! trace.running)
+		goto out_error;
 	return 0;
+
+out_error:
+	close(trace.fd);
+	trace.fd = -1;
+	return err;
 }
 
 /**
- * Checks if the sandbox execution model can be constructed
+ * Tells whether @line of a Dependencies file names a program in @layer.
  */
-bool check_availability()
+static bool
+dependency_matches_layer(const char *line, const struct trace_layer *layer)
 {
-	uid_t uid = getuid(), euid = geteuid();
-	struct utsname uts_data;
-	struct statfs statbuf;
-	char hostname[512];
-	bool is_available = true;
+	const char *version, *name;
+	size_t len = strcspn(line, " \t\n");
 
-	/* Not currently available on the LiveCD */
-	if (gethostname(hostname, sizeof(hostname)-1) == 0 && !strcmp(hostname, "LiveCD"))
+	version = strrchr(layer->path, '/');
+	if (! version || version == layer->path)
 		return false;
+	for (name = version - 1; name > layer->path && *name != '/'; --name)
+		continue;
+	name++;
+	return len == (size_t) (version - name) && ! strncasecmp(line, name, len);
+}
 
-	/* Check uid */
-	if ((uid >0) && (uid == euid)) {
-		verbose_printf("This program needs its suid bit to be set.\n");
-		is_available = false;
-	}
-
-	/* Check kernel version */
-	uname(&uts_data);
-	if (compare_kernel_versions("4.0", uts_data.release) > 0) {
-		verbose_printf("Running on Linux %s. At least Linux 4.0 is needed.\n",
-			uts_data.release);;
-		is_available = false;
-	}
-
-	/* Check if maximum filesystem stacking count will be reached */
-	if (statfs("/", &statbuf) == 0 && statbuf.f_type == OVERLAYFS_MAGIC) {
-		verbose_printf("Rootfs is an overlayfs, max filesystem stacking count will be reached\n");
-		is_available = false;
+/**
+ * Copies the Dependencies file @depsfile to @fp, leaving out the entries
+ * that only resolved to layers that were never touched.
+ */
+static void
+print_trimmed_dependencies(FILE *fp, const char *depsfile)
+{
+	char *line = NULL;
+	size_t size = 0;
+	uid_t euid;
+	FILE *in;
+	int k;
+
+	/* Runner is setuid: open the file with the caller's credentials */
+	euid = geteuid();
+	if (seteuid(getuid()) < 0)
+		return;
+	in = fopen(depsfile, "r");
+	if (! in)
+		fprintf(fp, "# %s: %s\n", depsfile, strerror(errno));
+	seteuid(euid);
+	if (! in)
+		return;
+	fprintf(fp, "# From %s\n", depsfile);
+	while (getline(&line, &size, in) > 0) {
+		const char *start = line + strspn(line, " \t");
+		bool unused = false;
+		for (k=0; k<trace.numlayers && *start != '#' && *start != '\n'; ++k) {
+			if (dependency_matches_layer(start, &trace.layers[k])) {
+				unused = ! trace.layers[k].touched;
+				if (! unused)
+					break;
+			}
+		}
+		if (! unused)
+			fputs(line, fp);
 	}
-
-	return is_available;
+	free(line);
+	fclose(in);
 }
 
-void
-cleanup(int signum)
+/**
+ * Stops tracing and reports the dependencies that supplied none of the files
+ * the program opened, followed by a Dependencies file without them. The
+ * report is itself a valid Dependencies file.
+ */
+static void
+report_access_trace(void)
 {
-	if (args.cleanup) {
-		destroy_namespace();
-		cleanup_directory("upper layer", args.upperlayer);
-		cleanup_directory("write layer", args.writelayer);
-		cleanup_directory("working layer", args.workdir);
+	char *report = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int i, k;
+
+	if (! trace.running)
+		return;
+	if (write(trace.stopfd[1], "", 1) < 0)
+		perror("write");
+	pthread_join(trace.thread, NULL);
+	trace.running = false;
+	close(trace.stopfd[0]);
+	close(trace.stopfd[1]);
+	close(trace.fd);
+	trace.fd = -1;
+
+	fp = open_memstream(&report, &len);
+	if (fp) {
+		fprintf(fp, "# Access trace of %s: %lu files opened under %s\n",
+			args.executable, trace.files, GOBO_INDEX_DIR);
+		if (trace.overflow)
+			fprintf(fp, "# WARNING: events were lost, so some of the dependencies below may be needed after all\n");
+		fprintf(fp, "# Dependencies that were never touched:\n");
+		for (k=0; k<trace.numlayers; ++k)
+			if (! trace.layers[k].touched && ! (args.programdir && ! strcmp(trace.layers[k].path, args.programdir)))
+				fprintf(fp, "#   %s\n", trace.layers[k].path);
+		fprintf(fp, "# Suggested Resources/Dependencies:\n");
+		if (args.depsfile)
+			print_trimmed_dependencies(fp, args.depsfile);
+		for (i=0; args.dependencies[i]; ++i)
+			if (! args.depsfile || strcmp(args.dependencies[i], args.depsfile))
+				print_trimmed_dependencies(fp, args.dependencies[i]);
+		fclose(fp);
+		write_report(args.trace_access, report, len);
+		free(report);
 	}
+
+	for (k=0; k<trace.numlayers; ++k)
+		free(trace.layers[k].path);
+	free(trace.layers);
+	path_set_free(&trace.seen);
 }
 
 /**
@@ -1449,10 +5766,17 @@ cleanup(int signum)
 int
 main(int argc, char *argv[])
 {
-	int status, ret = 1, available = 1, wrapper_val = 1;
+	int status, ret = 1, available = 1, wrapper_val = 1, execfd[2] = { -1, -1 };
+	bool needs_wrapper = false;
+	unsigned pooledlayers = 0;
+	char **envfiles = NULL;
+	char *closure = NULL;
 	pid_t pid;
 
+	clock_gettime(CLOCK_MONOTONIC, &profile.start);
+	profile_begin("parse_arguments");
 	CHECK(parse_arguments(argc, argv), false);
+	profile_end();
 
 	if (args.quiet && args.verbose) {
 		error_printf(main, "--quiet and --verbose are mutually exclusive");
@@ -1460,13 +5784,24 @@ main(int argc, char *argv[])
 	}
 
 	/* Check if sandbox is available it this system */
+	profile_begin("check_availability");
 	available = check_availability(&args);
+	profile_end();
 
 	/* Check mode? */
 	if (args.check == 1) {
 		exit(!available);
 	}
 
+	/* Daemon mode? */
+	if (args.daemon) {
+		exit(run_daemon());
+	}
+
+	if (args.discard_layer) {
+		exit(discard_persistent_layer(args.discard_layer));
+	}
+
 	/* Do we have an executable? */
 	if (args.executable == NULL) {
 		error_printf(main, "no executable was specified");
@@ -1481,39 +5816,144 @@ main(int argc, char *argv[])
 		}
 	} else {
 		signal(SIGINT, cleanup);
+		collect_trash();
 
-		ret = create_mount_namespace();
+		profile_begin("resolve_overlay");
+		struct path_set mergedirs;
+		ret = resolve_overlay(&mergedirs, &needs_wrapper);
+		profile_end();
 		if (ret < 0)
-			exit(ERR_MNT_NAMESPACE);
+			exit(ERR_MNT_OVERLAY);
 
-		ret = create_write_layer();
-		if (ret < 0)
-			exit(ERR_MNT_WRITEDIR);
+		/* Reuse the overlays of a namespace prepared by runnerd, if one is running */
+		profile_begin("attach_pooled_namespace");
+		args.pooled = args.cleanup && ! args.userns && ! args.minimal && ! args.trace_access &&
+			attach_pooled_namespace(&mergedirs, &pooledlayers) == 0;
+		profile_end();
+		if (args.pooled) {
+			profile_begin("create_write_layer");
+			ret = create_write_layer(true);
+			profile_end();
+			if (ret < 0)
+				exit(ERR_MNT_WRITEDIR);
+
+			profile_begin("mount_overlay_dirs");
+			ret = mount_pooled_overlay_dirs(&mergedirs, GOBO_INDEX_DIR, pooledlayers);
+			profile_end();
+			if (ret != 0)
+				exit(ERR_MNT_OVERLAY);
+		} else {
+			profile_begin("create_mount_namespace");
+			ret = create_mount_namespace();
+			profile_end();
+			if (ret < 0)
+				exit(ERR_MNT_NAMESPACE);
+
+			profile_begin("create_write_layer");
+			ret = create_write_layer(true);
+			profile_end();
+			if (ret < 0)
+				exit(ERR_MNT_WRITEDIR);
+
+			if (args.minimal && ! args.flatten) {
+				profile_begin("minimize_layers");
+				minimize_layers(&mergedirs);
+				profile_end();
+			}
 
-		char *mergedirs = mount_overlay();
-		if (mergedirs == NULL)
-			exit(ERR_MNT_OVERLAY);
+			profile_begin("mount_overlay_dirs");
+			ret = mount_overlay_dirs(&mergedirs, GOBO_INDEX_DIR, NULL);
+			profile_end();
+			if (ret != 0)
+				exit(ERR_MNT_OVERLAY);
+
+			if (args.ldcache) {
+				profile_begin("mount_ld_cache");
+				args.ldcache_mounted = mount_ld_cache(&mergedirs) == 0;
+				profile_end();
+			}
+
+			if (args.trace_access) {
+				ret = start_access_trace(&mergedirs);
+				if (ret < 0)
+					fprintf(stderr, "Could not trace accesses to %s: %s\n", GOBO_INDEX_DIR, strerror(-ret));
+			}
+		}
 
-		wrapper_val = create_wrapper(mergedirs);
-		free(mergedirs);
+		profile_begin("create_wrapper");
+		if (needs_wrapper && args.sourceenv && args.envsnapshot)
+			envfiles = get_environment_files(&mergedirs);
+		if (! envfiles)
+			wrapper_val = needs_wrapper ? create_wrapper(&mergedirs) : 1;
+		profile_end();
+		closure = path_set_to_string(&mergedirs);
+		path_set_free(&mergedirs);
 		if (wrapper_val < 0)
 			exit(ERR_WRAPPER);
 	}
 
+	if (args.cgroup) {
+		profile_begin("create_cgroup");
+		ret = create_cgroup();
+		profile_end();
+		if (ret < 0)
+			exit(ERR_CGROUP);
+	}
+
+	/* The child's end of this pipe is closed by execvp(), telling us when it happened */
+	if (args.profile && pipe2(execfd, O_CLOEXEC) < 0)
+		perror("pipe2");
+
+	profile_begin("exec");
+	if (args.prefetch)
+		start_prefetch();
 	pid = fork();
 	if (pid == 0) {
+		if (execfd[0] >= 0)
+			close(execfd[0]);
+
+		if (args.cgroupdir && enter_cgroup() < 0) {
+			perror("cgroup.procs");
+			_exit(ERR_CGROUP);
+		}
+
 		/* Now we have everything we need CAP_SYS_ADMIN for, so drop setuid */
 		CHECK(setuid(getuid()), true);
 
 		setenv("GOBOLINUX_RUNNER", "1", 1);
 
-		/* Add generic library path */
-		CHECK(update_env_var_list("LD_LIBRARY_PATH", GOBO_INDEX_DIR "/lib"), false);
-		CHECK(update_env_var_list("LD_LIBRARY_PATH", GOBO_INDEX_DIR "/lib64"), false);
+		/* Let RunnerRedirect know which programs this sandbox already provides */
+		if (closure && strlen(closure) <= RUNNER_MAX_CLOSURE_ENV)
+			setenv("GOBOLINUX_RUNNER_CLOSURE", closure, 1);
+		else
+			unsetenv("GOBOLINUX_RUNNER_CLOSURE");
+
+		/* Add generic library path, unless the closure's ld.so.cache already covers it */
+		if (! args.ldcache_mounted) {
+			CHECK(update_env_var_list("LD_LIBRARY_PATH", GOBO_INDEX_DIR "/lib"), false);
+			CHECK(update_env_var_list("LD_LIBRARY_PATH", GOBO_INDEX_DIR "/lib64"), false);
+		}
 
 		/* Add generic binary directory to PATH */
 		CHECK(update_env_var_list("PATH", GOBO_INDEX_DIR "/bin"), false);
 
+		/* Import Resources/Environment without going through a wrapper */
+		if (envfiles && envfiles[0] && apply_environment_snapshot(envfiles) < 0) {
+			int i, argcount = 0;
+			while (args.arguments[argcount]) { argcount++; }
+			char *script = make_source_script(envfiles, "exec \"$@\"");
+			char *exec_args[argcount+5];
+			exec_args[0] = "bash";
+			exec_args[1] = "-c";
+			exec_args[2] = script;
+			exec_args[3] = "bash";
+			for (i=0; i<=argcount; ++i)
+				exec_args[4+i] = args.arguments[i];
+			verbose_printf("Could not snapshot the environment, sourcing it from bash\n");
+			ret = execv("/bin/bash", exec_args);
+			perror("/bin/bash");
+		}
+
 		/* Launch the program provided by the user */
 		if (wrapper_val == 1) {
 			ret = execvp(args.executable, args.arguments);
@@ -1528,11 +5968,32 @@ main(int argc, char *argv[])
 		 * Wait for child and clean up files and directories left on its write
 		 * and upper unionfs layers. Note that this effectively causes all
 		 * operations made under /System/Index to be discarded. Runner is not
-		 * meant to be used for regular system management anyway.
+		 * meant to be used for regular system management anyway. The actual
+		 * removal happens in the background, after we have returned.
 		 */
+		if (execfd[0] >= 0) {
+			char c;
+			close(execfd[1]);
+			while (read(execfd[0], &c, 1) < 0 && errno == EINTR)
+				continue;
+			close(execfd[0]);
+		}
+		profile_end();
+
+		profile_begin("run");
+		wait_prefetch();
 		waitpid(pid, &status, 0);
+		profile_end();
 		ret = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
-		cleanup(0);
+		if (args.cgroupdir)
+			report_cgroup(ret);
+		if (args.trace_access)
+			report_access_trace();
+
+		profile_begin("cleanup");
+		cleanup_async();
+		profile_end();
+		profile_report(ret);
 	} else if (pid < 0) {
 		ret = -errno;
 		perror("fork");
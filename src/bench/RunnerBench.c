@@ -0,0 +1,742 @@
+/*
+ * RunnerBench: measures Runner's launch latency against a synthetic /Programs tree
+ *
+ * The tree is generated under a temporary directory and exposed as /Programs
+ * and /System inside an unprivileged user+mount namespace, so no root access
+ * (and no real GoboLinux installation) is needed. For each closure size a
+ * program whose Resources/Dependencies lists that many entries is launched
+ * through Runner a number of times, and the --profile reports are condensed
+ * into p50/p95/p99 latencies and syscall counts.
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE /* Required for CLONE_NEWUSER */
+
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+
+#define BENCH_MAX_CLOSURES  16
+/* Inside the sandbox /System is the synthetic tree, so this lives under the mkdtemp() base */
+#define BENCH_PROFILE_FILE  "/System/Variable/run/RunnerBench.profile"
+#define RUNNER_CACHE_DIR    "/System/Variable/cache/Runner"
+
+/* Must match the order of syscall_names[] in Runner.c */
+enum {
+	SYSCALL_STAT,
+	SYSCALL_OPEN,
+	SYSCALL_READDIR,
+	SYSCALL_READLINK,
+	SYSCALL_MOUNT,
+	SYSCALL_MKDIR,
+	SYSCALL_UNLINK,
+	SYSCALL_MAX
+};
+
+static const char *syscall_names[SYSCALL_MAX] = {
+	"stat", "open", "readdir", "readlink", "mount", "mkdir", "unlink"
+};
+
+struct bench_args {
+	const char *runner;     /* Runner binary under test */
+	const char *workdir;    /* Where the synthetic tree is generated */
+	int programs;           /* Number of synthetic programs */
+	int versions;           /* Versions installed of each program */
+	int fanout;             /* Dependencies of each synthetic program */
+	int envpercent;         /* Share of versions shipping Resources/Environment */
+	int iterations;         /* Measured launches per closure size */
+	int warmup;             /* Unmeasured launches per closure size */
+	int closures[BENCH_MAX_CLOSURES];
+	int numclosures;
+	bool cold;              /* Drop Runner's overlay cache before each launch */
+	bool keep;              /* Keep the synthetic tree around */
+};
+
+struct sample {
+	long wall_us;           /* fork() to waitpid() */
+	long launch_us;         /* Runner start until the target was exec'd */
+	long resolve_us;        /* resolve_overlay phase, includes parse_dependencies */
+	long mount_us;          /* mount_overlay_dirs phase */
+	unsigned long syscalls[SYSCALL_MAX];
+};
+
+static struct bench_args args = {
+	.runner = "./Runner",
+	.programs = 500,
+	.versions = 3,
+	.fanout = 4,
+	.envpercent = 10,
+	.iterations = 100,
+	.warmup = 5,
+	.closures = { 1, 16, 64, 256 },
+	.numclosures = 4,
+};
+
+/**
+ * snprintf() into a PATH_MAX buffer.
+ */
+static char *
+pathf(char *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static char *
+pathf(char *buf, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, PATH_MAX, fmt, ap);
+	va_end(ap);
+	return buf;
+}
+
+static int
+write_file(const char *path, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int
+write_file(const char *path, const char *fmt, ...)
+{
+	va_list ap;
+	FILE *fp = fopen(path, "w");
+	if (! fp) {
+		perror(path);
+		return -1;
+	}
+	va_start(ap, fmt);
+	vfprintf(fp, fmt, ap);
+	va_end(ap);
+	return fclose(fp);
+}
+
+static int
+make_dirs(const char *path)
+{
+	char buf[PATH_MAX], *ptr;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (ptr = buf+1; *ptr; ++ptr) {
+		if (*ptr != '/')
+			continue;
+		*ptr = '\0';
+		if (mkdir(buf, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*ptr = '/';
+	}
+	if (mkdir(buf, 0755) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/**
+ * Picks the n-th dependency of a program. The stride spreads the entries
+ * over the whole tree instead of clustering them on the first programs.
+ */
+static int
+pick_dependency(int self, int n)
+{
+	return (self + 1 + n * 7919) % args.programs;
+}
+
+/**
+ * Formats a Dependencies entry, rotating through the constraint forms seen in
+ * real recipes so that ParseDependencies() walks all of its code paths.
+ */
+static void
+write_dependency(FILE *fp, int prog, int n)
+{
+	int newest = args.versions;
+
+	switch (n % 4) {
+		case 0:
+			fprintf(fp, "Prog%04d\n", prog);
+			break;
+		case 1:
+			fprintf(fp, "Prog%04d >= 1.0\n", prog);
+			break;
+		case 2:
+			fprintf(fp, "Prog%04d %d.0\n", prog, newest);
+			break;
+		default:
+			fprintf(fp, "Prog%04d >= 1.0, < %d.0\n", prog, newest > 1 ? newest : 2);
+			break;
+	}
+}
+
+static int
+generate_program(const char *base, const char *arch, int prog)
+{
+	const char *subdirs[] = { "bin", "lib", "include", "libexec", "share", "Resources", NULL };
+	char path[PATH_MAX], file[PATH_MAX];
+	int v, i;
+
+	for (v=1; v<=args.versions; ++v) {
+		pathf(path, "%s/Programs/Prog%04d/%d.0", base, prog, v);
+		for (i=0; subdirs[i]; ++i) {
+			pathf(file, "%s/%s", path, subdirs[i]);
+			if (make_dirs(file) < 0) {
+				perror(file);
+				return -1;
+			}
+		}
+		pathf(file, "%s/bin/prog%04d", path, prog);
+		if (write_file(file, "#!/bin/sh\necho Prog%04d %d.0\n", prog, v) < 0 || chmod(file, 0755) < 0)
+			return -1;
+		pathf(file, "%s/lib/libprog%04d.so.%d", path, prog, v);
+		if (write_file(file, "Prog%04d %d.0\n", prog, v) < 0)
+			return -1;
+		pathf(file, "%s/include/prog%04d.h", path, prog);
+		if (write_file(file, "int prog%04d(void);\n", prog) < 0)
+			return -1;
+		pathf(file, "%s/Resources/Architecture", path);
+		if (write_file(file, "%s\n", arch) < 0)
+			return -1;
+		if (((prog * args.versions + v) * 37) % 100 < args.envpercent) {
+			pathf(file, "%s/Resources/Environment", path);
+			if (write_file(file, "export PROG%04d_HOME=%s\n", prog, path+strlen(base)) < 0)
+				return -1;
+		}
+		if (args.fanout > 0) {
+			FILE *fp;
+			pathf(file, "%s/Resources/Dependencies", path);
+			fp = fopen(file, "w");
+			if (! fp) {
+				perror(file);
+				return -1;
+			}
+			for (i=0; i<args.fanout; ++i)
+				write_dependency(fp, pick_dependency(prog, i), i);
+			fclose(fp);
+		}
+	}
+	pathf(path, "%s/Programs/Prog%04d/Current", base, prog);
+	pathf(file, "%d.0", args.versions);
+	return symlink(file, path);
+}
+
+/**
+ * Generates the launched program of a given closure size: RunnerBench<size>,
+ * whose Resources/Dependencies lists that many distinct programs.
+ */
+static int
+generate_closure(const char *base, int size)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	pathf(path, "%s/Programs/RunnerBench%d/1.0/Resources", base, size);
+	if (make_dirs(path) < 0) {
+		perror(path);
+		return -1;
+	}
+	strcat(path, "/Dependencies");
+	fp = fopen(path, "w");
+	if (! fp) {
+		perror(path);
+		return -1;
+	}
+	for (i=0; i<size; ++i)
+		write_dependency(fp, (i * 7919) % args.programs, i);
+	return fclose(fp);
+}
+
+static int
+generate_tree(const char *base)
+{
+	const char *dirs[] = {
+		"System/Index/bin", "System/Index/include", "System/Index/lib", "System/Index/libexec",
+		"System/Index/share", "System/Variable/cache", "System/Variable/run", "System/Settings/Scripts",
+		NULL
+	};
+	char path[PATH_MAX];
+	struct utsname uts;
+	int i;
+
+	if (uname(&uts) < 0) {
+		perror("uname");
+		return -1;
+	}
+	for (i=0; dirs[i]; ++i) {
+		pathf(path, "%s/%s", base, dirs[i]);
+		if (make_dirs(path) < 0) {
+			perror(path);
+			return -1;
+		}
+	}
+	for (i=0; i<args.programs; ++i)
+		if (generate_program(base, uts.machine, i) < 0)
+			return -1;
+	for (i=0; i<args.numclosures; ++i)
+		if (generate_closure(base, args.closures[i]) < 0)
+			return -1;
+	return 0;
+}
+
+static int
+remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	if (remove(path) < 0 && errno != ENOENT)
+		perror(path);
+	return 0;
+}
+
+static void
+remove_tree(const char *path)
+{
+	nftw(path, remove_entry, 64, FTW_DEPTH|FTW_PHYS);
+}
+
+static int
+write_proc_file(const char *path, const char *content)
+{
+	int ret, fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, content, strlen(content));
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Enters a new user and mount namespace and chroot()s into a view of the host
+ * filesystem where /Programs and /System come from the synthetic tree.
+ */
+static int
+enter_sandbox(const char *base)
+{
+	char root[PATH_MAX], src[PATH_MAX], dst[PATH_MAX], map[64], cwd[PATH_MAX];
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	struct dirent *entry;
+	DIR *dp;
+
+	if (! getcwd(cwd, sizeof(cwd)))
+		strcpy(cwd, "/");
+	if (unshare(CLONE_NEWUSER|CLONE_NEWNS) < 0) {
+		perror("unshare");
+		return -1;
+	}
+	snprintf(map, sizeof(map), "0 %d 1", uid);
+	if (write_proc_file("/proc/self/setgroups", "deny") < 0 && errno != ENOENT) {
+		perror("/proc/self/setgroups");
+		return -1;
+	}
+	if (write_proc_file("/proc/self/uid_map", map) < 0) {
+		perror("/proc/self/uid_map");
+		return -1;
+	}
+	snprintf(map, sizeof(map), "0 %d 1", gid);
+	if (write_proc_file("/proc/self/gid_map", map) < 0) {
+		perror("/proc/self/gid_map");
+		return -1;
+	}
+	if (mount(NULL, "/", NULL, MS_REC|MS_PRIVATE, NULL) < 0) {
+		perror("mount");
+		return -1;
+	}
+
+	pathf(root, "%s/root", base);
+	if (mkdir(root, 0755) < 0 || mount("tmpfs", root, "tmpfs", 0, "mode=0755") < 0) {
+		perror(root);
+		return -1;
+	}
+	dp = opendir("/");
+	if (! dp) {
+		perror("/");
+		return -1;
+	}
+	while ((entry = readdir(dp)) != NULL) {
+		struct stat statbuf;
+		if (! strcmp(entry->d_name, ".") || ! strcmp(entry->d_name, "..") ||
+			! strcmp(entry->d_name, "Programs") || ! strcmp(entry->d_name, "System"))
+			continue;
+		pathf(src, "/%s", entry->d_name);
+		pathf(dst, "%s/%s", root, entry->d_name);
+		if (lstat(src, &statbuf) < 0)
+			continue;
+		if (S_ISLNK(statbuf.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t len = readlink(src, target, sizeof(target)-1);
+			if (len > 0) {
+				target[len] = '\0';
+				if (symlink(target, dst) < 0)
+					perror(dst);
+			}
+		} else if (S_ISDIR(statbuf.st_mode)) {
+			if (mkdir(dst, 0755) < 0 || mount(src, dst, NULL, MS_BIND|MS_REC, NULL) < 0)
+				fprintf(stderr, "warning: cannot bind %s: %s\n", src, strerror(errno));
+		}
+	}
+	closedir(dp);
+
+	pathf(src, "%s/Programs", base);
+	pathf(dst, "%s/Programs", root);
+	if (mkdir(dst, 0755) < 0 || mount(src, dst, NULL, MS_BIND, NULL) < 0) {
+		perror(dst);
+		return -1;
+	}
+	pathf(src, "%s/System", base);
+	pathf(dst, "%s/System", root);
+	if (mkdir(dst, 0755) < 0 || mount(src, dst, NULL, MS_BIND, NULL) < 0) {
+		perror(dst);
+		return -1;
+	}
+	if (chroot(root) < 0) {
+		perror("chroot");
+		return -1;
+	}
+	if (chdir(cwd) < 0 && chdir("/") < 0)
+		return -1;
+	return 0;
+}
+
+static long
+elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000L;
+}
+
+static long
+json_number(const char *str, const char *key)
+{
+	char needle[64];
+	const char *ptr;
+
+	snprintf(needle, sizeof(needle), "\"%s\":", key);
+	ptr = strstr(str, needle);
+	return ptr ? strtol(ptr + strlen(needle), NULL, 10) : -1;
+}
+
+/**
+ * Condenses one --profile line. Phases may nest, so syscalls are only summed
+ * over the outermost ones; they are reported in the order they began.
+ */
+static int
+parse_profile(char *line, struct sample *sample)
+{
+	long stack[32];
+	int depth = 0;
+	char *phase;
+
+	sample->launch_us = sample->resolve_us = sample->mount_us = -1;
+	memset(sample->syscalls, 0, sizeof(sample->syscalls));
+
+	phase = strstr(line, "\"phases\":[");
+	while (phase && (phase = strstr(phase, "{\"name\":\"")) != NULL) {
+		char *name = phase + strlen("{\"name\":\""), *next;
+		long start = json_number(phase, "start_us");
+		long duration = json_number(phase, "duration_us");
+		int i;
+
+		next = strstr(name, "{\"name\":\"");
+		if (next)
+			next[0] = '\0';
+		while (depth > 0 && start >= stack[depth-1])
+			depth--;
+		if (depth == 0)
+			for (i=0; i<SYSCALL_MAX; ++i)
+				sample->syscalls[i] += json_number(strstr(phase, "\"syscalls\""), syscall_names[i]);
+		if (depth < 32)
+			stack[depth++] = start + duration;
+
+		if (! strncmp(name, "exec\"", 5))
+			sample->launch_us = start + duration;
+		else if (! strncmp(name, "resolve_overlay\"", 16))
+			sample->resolve_us = duration;
+		else if (! strncmp(name, "mount_overlay_dirs\"", 19))
+			sample->mount_us = duration;
+		if (next)
+			next[0] = '{';
+		phase = next;
+	}
+	return sample->launch_us < 0 ? -1 : 0;
+}
+
+static int
+run_once(const char *depsfile, struct sample *sample)
+{
+	struct timespec start, end;
+	char line[64*1024];
+	int status, fd;
+	ssize_t len;
+	pid_t pid;
+
+	if (args.cold)
+		remove_tree(RUNNER_CACHE_DIR);
+	fd = open(BENCH_PROFILE_FILE, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		perror(BENCH_PROFILE_FILE);
+		return -1;
+	}
+	close(fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0)
+			dup2(null, STDOUT_FILENO);
+		execl(args.runner, "Runner", "-q", "--profile=" BENCH_PROFILE_FILE, "-d", depsfile, "true", NULL);
+		perror(args.runner);
+		_exit(127);
+	} else if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Runner failed with status %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+		return -1;
+	}
+
+	fd = open(BENCH_PROFILE_FILE, O_RDONLY|O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+	len = read(fd, line, sizeof(line)-1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	line[len] = '\0';
+
+	sample->wall_us = elapsed_us(&start, &end);
+	return parse_profile(line, sample);
+}
+
+static int
+compare_longs(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Nearest-rank percentile. Sorts the array in place.
+ */
+static long
+percentile(long *values, int n, int pct)
+{
+	int rank = (pct * n + 99) / 100;
+	qsort(values, n, sizeof(long), compare_longs);
+	return values[rank > 0 ? rank-1 : 0];
+}
+
+static int
+bench_closure(int size)
+{
+	char depsfile[PATH_MAX];
+	struct sample *samples;
+	long *values;
+	int i, j, n = args.iterations;
+
+	pathf(depsfile, "/Programs/RunnerBench%d/1.0/Resources/Dependencies", size);
+	samples = calloc(n, sizeof(struct sample));
+	values = calloc(n, sizeof(long));
+	if (! samples || ! values) {
+		free(samples);
+		free(values);
+		return -1;
+	}
+	for (i=0; i<args.warmup; ++i)
+		if (run_once(depsfile, &samples[0]) < 0)
+			goto fail;
+	for (i=0; i<n; ++i)
+		if (run_once(depsfile, &samples[i]) < 0)
+			goto fail;
+
+	printf("%7d", size);
+	for (i=0; i<n; ++i)
+		values[i] = samples[i].launch_us;
+	printf(" %7ld %7ld %7ld", percentile(values, n, 50), percentile(values, n, 95), percentile(values, n, 99));
+	for (i=0; i<n; ++i)
+		values[i] = samples[i].wall_us;
+	printf(" %7ld", percentile(values, n, 50));
+	for (i=0; i<n; ++i)
+		values[i] = samples[i].resolve_us;
+	printf(" %8ld", percentile(values, n, 50));
+	for (i=0; i<n; ++i)
+		values[i] = samples[i].mount_us;
+	printf(" %8ld", percentile(values, n, 50));
+	for (j=0; j<SYSCALL_MAX; ++j) {
+		for (i=0; i<n; ++i)
+			values[i] = samples[i].syscalls[j];
+		printf(" %8ld", percentile(values, n, 50));
+	}
+	printf("\n");
+	fflush(stdout);
+	free(samples);
+	free(values);
+	return 0;
+
+fail:
+	free(samples);
+	free(values);
+	return -1;
+}
+
+static int
+run_benchmarks(const char *base)
+{
+	int i;
+
+	if (enter_sandbox(base) < 0)
+		return 1;
+	printf("# %d programs x %d versions, fan-out %d, %d%% with Environment, %d runs (%s cache)\n",
+		args.programs, args.versions, args.fanout, args.envpercent, args.iterations,
+		args.cold ? "cold" : "warm");
+	printf("# launch = Runner start until exec() of the target; wall = fork() to exit; "
+		"resolve/mount = phase medians; syscall columns are medians\n");
+	printf("%7s %7s %7s %7s %7s %8s %8s", "closure", "p50_us", "p95_us", "p99_us", "wall_us", "resolve", "mount");
+	for (i=0; i<SYSCALL_MAX; ++i)
+		printf(" %8s", syscall_names[i]);
+	printf("\n");
+	for (i=0; i<args.numclosures; ++i)
+		if (bench_closure(args.closures[i]) < 0)
+			return 1;
+	unlink(BENCH_PROFILE_FILE);
+	return 0;
+}
+
+static int
+parse_closures(char *list)
+{
+	char *saveptr = NULL, *token;
+
+	args.numclosures = 0;
+	for (token = strtok_r(list, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		int size = atoi(token);
+		if (size < 0 || size > args.programs || args.numclosures == BENCH_MAX_CLOSURES)
+			return -1;
+		args.closures[args.numclosures++] = size;
+	}
+	return args.numclosures ? 0 : -1;
+}
+
+static void
+usage(const char *progname, int ret)
+{
+	fprintf(ret ? stderr : stdout,
+		"Usage: %s [options] [RUNNER]\n"
+		"Measures the launch latency of RUNNER (default: ./Runner) against a synthetic /Programs tree.\n\n"
+		"Options:\n"
+		"  -p, --programs=N      Number of synthetic programs (default: %d)\n"
+		"  -m, --versions=N      Versions installed of each program (default: %d)\n"
+		"  -f, --fanout=N        Dependencies listed by each synthetic program (default: %d)\n"
+		"  -e, --environment=PCT Share of versions shipping Resources/Environment (default: %d)\n"
+		"  -c, --closures=LIST   Comma-separated closure sizes to measure (default: 1,16,64,256)\n"
+		"  -n, --iterations=N    Measured launches per closure size (default: %d)\n"
+		"  -w, --warmup=N        Unmeasured launches per closure size (default: %d)\n"
+		"  -C, --cold            Drop Runner's overlay cache before each launch\n"
+		"  -t, --workdir=DIR     Where to generate the tree (default: $TMPDIR)\n"
+		"  -k, --keep            Do not remove the generated tree\n"
+		"  -h, --help            This help\n",
+		progname, args.programs, args.versions, args.fanout, args.envpercent, args.iterations, args.warmup);
+	exit(ret);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *short_options = "p:m:f:e:c:n:w:Ct:kh";
+	struct option long_options[] = {
+		{"programs",    required_argument, 0, 'p'},
+		{"versions",    required_argument, 0, 'm'},
+		{"fanout",      required_argument, 0, 'f'},
+		{"environment", required_argument, 0, 'e'},
+		{"closures",    required_argument, 0, 'c'},
+		{"iterations",  required_argument, 0, 'n'},
+		{"warmup",      required_argument, 0, 'w'},
+		{"cold",        no_argument,       0, 'C'},
+		{"workdir",     required_argument, 0, 't'},
+		{"keep",        no_argument,       0, 'k'},
+		{"help",        no_argument,       0, 'h'},
+		{0, 0, 0, 0}
+	};
+	char base[PATH_MAX], runner[PATH_MAX], *closures = NULL;
+	int c, status, ret;
+	pid_t pid;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+			case 'p': args.programs = atoi(optarg); break;
+			case 'm': args.versions = atoi(optarg); break;
+			case 'f': args.fanout = atoi(optarg); break;
+			case 'e': args.envpercent = atoi(optarg); break;
+			case 'c': closures = optarg; break;
+			case 'n': args.iterations = atoi(optarg); break;
+			case 'w': args.warmup = atoi(optarg); break;
+			case 'C': args.cold = true; break;
+			case 't': args.workdir = optarg; break;
+			case 'k': args.keep = true; break;
+			case 'h': usage(argv[0], 0); break;
+			default: usage(argv[0], 1); break;
+		}
+	}
+	if (optind < argc)
+		args.runner = argv[optind];
+	if (args.programs < 1 || args.programs > 9999 || args.versions < 1 || args.iterations < 1 || args.fanout < 0)
+		usage(argv[0], 1);
+	if (closures && parse_closures(closures) < 0) {
+		fprintf(stderr, "Invalid closure list (sizes must not exceed --programs)\n");
+		return 1;
+	}
+	for (c=0; c<args.numclosures; ++c)
+		if (args.closures[c] > args.programs)
+			args.closures[c] = args.programs;
+	if (! realpath(args.runner, runner)) {
+		perror(args.runner);
+		return 1;
+	}
+	args.runner = runner;
+
+	if (! args.workdir)
+		args.workdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	pathf(base, "%s/RunnerBench-XXXXXX", args.workdir);
+	if (! mkdtemp(base)) {
+		perror(base);
+		return 1;
+	}
+	fprintf(stderr, "Generating synthetic tree at %s\n", base);
+	if (generate_tree(base) < 0) {
+		remove_tree(base);
+		return 1;
+	}
+
+	/* The namespaces are entered by a child so that the tree can be removed afterwards */
+	pid = fork();
+	if (pid == 0)
+		_exit(run_benchmarks(base));
+	ret = pid < 0 || waitpid(pid, &status, 0) < 0 || ! WIFEXITED(status) ? 1 : WEXITSTATUS(status);
+
+	if (args.keep)
+		fprintf(stderr, "Synthetic tree kept at %s\n", base);
+	else
+		remove_tree(base);
+	return ret;
+}
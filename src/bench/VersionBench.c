@@ -0,0 +1,299 @@
+/*
+ * VersionBench: compares FindDependencies' string and pre-parsed version comparisons
+ *
+ * The corpus is the set of version directories found under $goboPrograms
+ * (or the directory given with -p), optionally extended with versions read
+ * from a file, one per line. Every pair of versions is compared through both
+ * VersionCmp() and VersionKeyCmp(), which must agree, and the time taken by
+ * pairwise comparisons and by GetBestVersion()'s range matching is reported
+ * for each of them.
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the license, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* The functions under test are static, so they are built into the benchmark */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#pragma GCC diagnostic ignored "-Waddress"
+#pragma GCC diagnostic ignored "-Wstringop-truncation"
+#include "../FindDependencies.c"
+
+#include <time.h>
+
+#define BENCH_MAX_VERSIONS  4096
+#define BENCH_MAX_MISMATCHES  10
+
+struct corpus {
+	char *versions[BENCH_MAX_VERSIONS];   /* Version strings */
+	int program[BENCH_MAX_VERSIONS];      /* Index of the program each version belongs to */
+	struct version_key keys[BENCH_MAX_VERSIONS];
+	int num;
+	int numprograms;
+};
+
+static struct corpus corpus;
+
+static void add_version(const char *version, int program)
+{
+	if (corpus.num == BENCH_MAX_VERSIONS)
+		return;
+	corpus.versions[corpus.num] = strdup(version);
+	corpus.program[corpus.num] = program;
+	if (corpus.versions[corpus.num])
+		corpus.num++;
+}
+
+static void load_programs(const char *programs)
+{
+	struct dirent *app, *ver;
+	char path[PATH_MAX];
+	DIR *dp, *vp;
+
+	dp = opendir(programs);
+	if (! dp) {
+		perror(programs);
+		return;
+	}
+	while ((app = readdir(dp))) {
+		if (app->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", programs, app->d_name);
+		vp = opendir(path);
+		if (! vp)
+			continue;
+		while ((ver = readdir(vp)))
+			if (IsVersionDirectory(ver->d_name))
+				add_version(ver->d_name, corpus.numprograms);
+		closedir(vp);
+		corpus.numprograms++;
+	}
+	closedir(dp);
+}
+
+static void load_file(const char *fname)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n;
+	FILE *fp;
+
+	fp = fopen(fname, "r");
+	if (! fp) {
+		perror(fname);
+		exit(1);
+	}
+	/* Versions from a file are all treated as versions of the same program */
+	while ((n = getline(&line, &size, fp)) > 0) {
+		if (line[n-1] == '\n')
+			line[--n] = '\0';
+		if (n > 0 && IsVersionDirectory(line))
+			add_version(line, corpus.numprograms);
+	}
+	corpus.numprograms++;
+	free(line);
+	fclose(fp);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int sign(int value)
+{
+	return value > 0 ? 1 : value < 0 ? -1 : 0;
+}
+
+/* Both comparisons must agree on every pair of the corpus */
+static int check_equivalence(void)
+{
+	int i, j, mismatches = 0, inexact = 0;
+
+	for (i=0; i<corpus.num; i++)
+		inexact += ! corpus.keys[i].exact;
+	for (i=0; i<corpus.num; i++) {
+		for (j=0; j<corpus.num; j++) {
+			int a = sign(VersionCmp(corpus.versions[i], corpus.versions[j]));
+			int b = sign(VersionKeyCmp(&corpus.keys[i], &corpus.keys[j]));
+			if (a != b && mismatches++ < BENCH_MAX_MISMATCHES)
+				printf("MISMATCH: VersionCmp(%s, %s) = %d, VersionKeyCmp = %d\n",
+					corpus.versions[i], corpus.versions[j], a, b);
+		}
+	}
+	printf("%d versions from %d programs, %d compared through the string fallback\n",
+		corpus.num, corpus.numprograms, inexact);
+	printf("%lld pairs compared, %d mismatches\n", (long long) corpus.num * corpus.num, mismatches);
+	return mismatches;
+}
+
+static void bench_pairs(int rounds)
+{
+	double start, string_ns, key_ns;
+	long long pairs = (long long) corpus.num * corpus.num * rounds;
+	volatile int sink = 0;
+	int r, i, j;
+
+	start = now_ns();
+	for (r=0; r<rounds; r++)
+		for (i=0; i<corpus.num; i++)
+			for (j=0; j<corpus.num; j++)
+				sink += VersionCmp(corpus.versions[i], corpus.versions[j]);
+	string_ns = now_ns() - start;
+
+	start = now_ns();
+	for (r=0; r<rounds; r++) {
+		/* Keys are parsed once per round, as GetBestVersion() does per resolution */
+		for (i=0; i<corpus.num; i++)
+			VersionKeyParse(&corpus.keys[i], corpus.versions[i]);
+		for (i=0; i<corpus.num; i++)
+			for (j=0; j<corpus.num; j++)
+				sink += VersionKeyCmp(&corpus.keys[i], &corpus.keys[j]);
+	}
+	key_ns = now_ns() - start;
+
+	printf("pairwise:   VersionCmp %8.1f ns/cmp   VersionKeyCmp %8.1f ns/cmp   speedup %.1fx\n",
+		string_ns / pairs, key_ns / pairs, string_ns / key_ns);
+}
+
+/*
+ * For each version of each program, resolves ">= version", "< version" and
+ * "= version" against the other versions of that program, the way
+ * GetBestVersion() does before and after pre-parsing.
+ */
+static void bench_ranges(int rounds)
+{
+	const operator_t ops[] = { GREATER_THAN_OR_EQUAL, LESS_THAN, EQUAL };
+	double start, string_ns = 0, key_ns = 0;
+	int r, i, j, o, mismatches = 0;
+	long long resolutions = 0;
+
+	for (i=0; i<corpus.num; i++) {
+		for (o=0; o<3; o++) {
+			struct version spec = { .version = corpus.versions[i], .op = ops[o] };
+			struct list_head ranges;
+			struct range *range = CreateRangeFromVersion(&spec);
+			struct version_key candidatekey, latestkey;
+			int best_string = -1, best_key = -1;
+
+			if (! range)
+				continue;
+			INIT_LIST_HEAD(&ranges);
+			list_add_tail(&range->list, &ranges);
+
+			start = now_ns();
+			for (r=0; r<rounds; r++) {
+				best_string = -1;
+				for (j=0; j<corpus.num; j++) {
+					if (corpus.program[j] != corpus.program[i])
+						continue;
+					if (VersionMatchRange(corpus.versions[j], range) &&
+						(best_string < 0 || VersionCmp(corpus.versions[j], corpus.versions[best_string]) >= 0))
+						best_string = j;
+				}
+			}
+			string_ns += now_ns() - start;
+
+			start = now_ns();
+			for (r=0; r<rounds; r++) {
+				best_key = -1;
+				PrepareRangeKeys(&ranges);
+				for (j=0; j<corpus.num; j++) {
+					if (corpus.program[j] != corpus.program[i])
+						continue;
+					VersionKeyParse(&candidatekey, corpus.versions[j]);
+					if (VersionKeyMatchRangeList(&candidatekey, &ranges) &&
+						(best_key < 0 || VersionKeyCmp(&candidatekey, &latestkey) >= 0)) {
+						best_key = j;
+						latestkey = candidatekey;
+					}
+				}
+			}
+			key_ns += now_ns() - start;
+
+			if (best_string != best_key && mismatches++ < BENCH_MAX_MISMATCHES)
+				printf("MISMATCH: %s %s resolves to %s with strings, %s with keys\n",
+					GetOperatorString(ops[o]), corpus.versions[i],
+					best_string < 0 ? "nothing" : corpus.versions[best_string],
+					best_key < 0 ? "nothing" : corpus.versions[best_key]);
+			resolutions += rounds;
+			free(range);
+		}
+	}
+	if (resolutions)
+		printf("resolution: strings    %8.1f ns/dep   keys          %8.1f ns/dep   speedup %.1fx (%d mismatches)\n",
+			string_ns / resolutions, key_ns / resolutions, string_ns / key_ns, mismatches);
+}
+
+static void bench_usage(const char *appname, int retval)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+			"Available options are:\n"
+			"  -p, --programs=<dir>   Take versions from <dir> (default: $goboPrograms or /Programs)\n"
+			"  -f, --file=<file>      Also take versions from <file>, one per line\n"
+			"  -r, --rounds=<n>       Repeat each measurement <n> times (default: 20)\n"
+			"  -h, --help             This help\n", appname);
+	exit(retval);
+}
+
+int main(int argc, char **argv)
+{
+	const char *programs = getenv("goboPrograms") ? getenv("goboPrograms") : "/Programs";
+	const char *fname = NULL;
+	int c, i, rounds = 20;
+	struct option longopts[] = {
+		{"programs", 1, NULL, 'p'},
+		{"file",     1, NULL, 'f'},
+		{"rounds",   1, NULL, 'r'},
+		{"help",     0, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "p:f:r:h", longopts, NULL)) != -1) {
+		switch (c) {
+			case 'p':
+				programs = optarg;
+				break;
+			case 'f':
+				fname = optarg;
+				break;
+			case 'r':
+				rounds = atoi(optarg) > 0 ? atoi(optarg) : 1;
+				break;
+			case 'h':
+				bench_usage(argv[0], 0);
+				break;
+			default:
+				bench_usage(argv[0], 1);
+		}
+	}
+
+	load_programs(programs);
+	if (fname)
+		load_file(fname);
+	if (corpus.num == 0) {
+		fprintf(stderr, "No versions found under %s\n", programs);
+		return 1;
+	}
+	for (i=0; i<corpus.num; i++)
+		VersionKeyParse(&corpus.keys[i], corpus.versions[i]);
+
+	if (check_equivalence() != 0)
+		return 1;
+	bench_pairs(rounds);
+	bench_ranges(rounds);
+	return 0;
+}
+
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
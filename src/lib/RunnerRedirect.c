@@ -6,17 +6,32 @@
  *
  * Build with:
  * gcc RunnerRedirect.c -shared -fpic -ldl -o RunnerRedirect.so
+ *
+ * Inside a Runner sandbox ($GOBOLINUX_RUNNER), targets that belong to one of
+ * the programs listed in $GOBOLINUX_RUNNER_CLOSURE (or to no program at all)
+ * are already served by the current overlay, so they are executed directly
+ * rather than through a nested Runner. Set $GOBOLINUX_RUNNER_REDIRECT_QUIET
+ * to stop printing the redirected commands.
  */
 #define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dlfcn.h>
 #include <spawn.h>
 #include <assert.h>
 
+#define GOBO_PROGRAMS      "/Programs"
+#define GOBO_PROGRAMS_LEN  9
+#define DECISION_CACHE_SIZE 1024
+
 static int   (*execl_orig)(const char *filename, const char *arg, ...);
 static int   (*execlp_orig)(const char *filename, const char *arg, ...);
 static int   (*execle_orig)(const char *filename, const char *arg, ...);
@@ -38,6 +53,8 @@ int          (*posix_spawnp_orig)(pid_t *pid, const char *file,
                                  const posix_spawnattr_t *attrp,
                                  char *const argv[], char *const envp[]);
 
+static bool quiet;
+
 __attribute__((constructor)) static void init()
 {
 	execl_orig        = dlsym(RTLD_NEXT, "execl");
@@ -59,122 +76,304 @@ __attribute__((constructor)) static void init()
 	assert(execv_orig != execv);
 	assert(execvp_orig != execvp);
 	assert(execvpe_orig != execvpe);
+
+	quiet = getenv("GOBOLINUX_RUNNER_REDIRECT_QUIET") != NULL;
+}
+
+/*
+ * Per-path cache of the decision to bypass Runner. Entries are never
+ * modified once published, and slots are claimed with a compare-and-swap:
+ * the hooks run in children forked from multithreaded programs, where a
+ * lock held by another thread at fork() time would never be released.
+ */
+struct decision {
+	bool direct;
+	char path[];
+};
+static struct decision *decision_cache[DECISION_CACHE_SIZE];
+
+static uint64_t _hashString(const char *str)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *str; ++str) {
+		hash ^= (unsigned char) *str;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Looks @file up in $PATH the way execvp() does.
+ */
+static const char *_searchPath(const char *file, char *buf, size_t size)
+{
+	const char *path = getenv("PATH"), *end;
+
+	if (strchr(file, '/'))
+		return file;
+	if (! path)
+		path = "/bin:/usr/bin";
+	for (; path; path = *end ? end+1 : NULL) {
+		end = strchrnul(path, ':');
+		if (end == path)
+			snprintf(buf, size, "%s", file);
+		else
+			snprintf(buf, size, "%.*s/%s", (int) (end-path), path, file);
+		if (access(buf, X_OK) == 0)
+			return buf;
+	}
+	return NULL;
+}
+
+/*
+ * Tells if the program that owns @realpath, if any, is in @closure.
+ */
+static bool _inClosure(const char *realpath, const char *closure)
+{
+	const char *version, *end, *entry, *next;
+	size_t len;
+
+	if (strncmp(realpath, GOBO_PROGRAMS "/", GOBO_PROGRAMS_LEN+1))
+		return true;
+	version = strchr(realpath + GOBO_PROGRAMS_LEN + 1, '/');
+	if (! version)
+		return false;
+	end = strchrnul(version+1, '/');
+	len = end - realpath;
+	for (entry = closure; *entry; entry = *next ? next+1 : next) {
+		next = strchrnul(entry, ':');
+		if (next - entry == len && ! strncmp(entry, realpath, len))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Decides whether @file can be executed directly, as the sandbox we are
+ * running in already provides its program.
+ */
+static bool _runDirectly(const char *file, bool search)
+{
+	char buf[PATH_MAX], *resolved;
+	const char *closure, *path;
+	struct decision *entry, *expected;
+	bool direct = false, cacheable;
+	uint64_t hash;
+	size_t i, slot;
+
+	if (! getenv("GOBOLINUX_RUNNER") || ! (closure = getenv("GOBOLINUX_RUNNER_CLOSURE")))
+		return false;
+	path = search ? _searchPath(file, buf, sizeof(buf)) : file;
+	if (! path)
+		return false;
+
+	/* Relative paths depend on the working directory, /proc/self/fd ones on the open files */
+	cacheable = path[0] == '/' && strncmp(path, "/proc/", 6);
+	hash = _hashString(path);
+	for (i=0; cacheable && i<DECISION_CACHE_SIZE; ++i) {
+		slot = (hash + i) % DECISION_CACHE_SIZE;
+		entry = __atomic_load_n(&decision_cache[slot], __ATOMIC_ACQUIRE);
+		if (! entry)
+			break;
+		if (! strcmp(entry->path, path))
+			return entry->direct;
+	}
+
+	resolved = realpath(path, NULL);
+	direct = resolved && _inClosure(resolved, closure);
+	free(resolved);
+	if (! cacheable)
+		return direct;
+
+	entry = malloc(sizeof(struct decision) + strlen(path) + 1);
+	if (! entry)
+		return direct;
+	entry->direct = direct;
+	strcpy(entry->path, path);
+	for (i=0; i<DECISION_CACHE_SIZE; ++i) {
+		slot = (hash + i) % DECISION_CACHE_SIZE;
+		expected = NULL;
+		if (__atomic_compare_exchange_n(&decision_cache[slot], &expected, entry, false,
+				__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			return direct;
+		if (! strcmp(expected->path, path))
+			break;
+	}
+	/* Another thread got there first, or the cache is full */
+	free(entry);
+	return direct;
+}
+
+static bool _runDirectlyAt(int dirfd, const char *filename, int flags)
+{
+	char path[PATH_MAX];
+
+	if (filename[0] == '/' || (dirfd == AT_FDCWD && filename[0]))
+		return _runDirectly(filename, false);
+	if (! filename[0] && (flags & AT_EMPTY_PATH))
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", dirfd);
+	else
+		snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", dirfd, filename);
+	return _runDirectly(path, false);
 }
 
 #define RESET_ENV() \
     unsetenv("LD_PRELOAD")
 
 #define PRINT_CMD() \
-	fprintf(stderr, "%s\n", cmd)
+	if (! quiet) { fprintf(stderr, "%s\n", cmd); }
 
 #define DECLARE_CMD() \
 	char *cmd = NULL; \
-	asprintf(&cmd, "/bin/Runner -f %s", command); \
-	RESET_ENV(); \
-	PRINT_CMD()
+	bool direct = _runDirectly("/bin/sh", false); \
+	if (! direct) { \
+		if (asprintf(&cmd, "/bin/Runner -f %s", command) < 0) { cmd = NULL; } \
+		RESET_ENV(); \
+		PRINT_CMD(); \
+	}
 
 #define PRINT_ARGS() \
-	for (i=0; args[i]; ++i) { fprintf(stderr, "%s ", args[i]); } \
-	fprintf(stderr, "\n")
+	if (! quiet) { \
+		for (i=0; args[i]; ++i) { fprintf(stderr, "%s ", args[i]); } \
+		fprintf(stderr, "\n"); \
+	}
 
-#define DECLARE_ARGS() \
+#define DECLARE_ARGS(direct_check) \
 	int i, argcount = 0; \
+	bool direct = (direct_check); \
 	while (argv[argcount++]) {} \
 	char *args[argcount+3]; \
 	args[0] = "/bin/Runner"; \
 	args[1] = "-f"; \
 	for (i=1; i<argcount; ++i) { args[1+i] = argv[i-1]; } \
 	args[1+argcount] = NULL; \
-	RESET_ENV(); \
-	PRINT_ARGS()
+	if (! direct) { \
+		RESET_ENV(); \
+		PRINT_ARGS(); \
+	}
 
-#define DECLARE_VA_ARGS() \
+/* The arguments are counted first, so that they fit in an array on the stack */
+#define DECLARE_VA_ARGS(direct_check, with_envp) \
 	int i, argcount = 1; \
-	const char **args = (const char **) malloc(sizeof(const char *) * 4); \
+	bool direct = (direct_check); \
+	char *const *envp = NULL; \
+	va_list ap, aq; \
+	va_start(ap, arg); \
+	va_copy(aq, ap); \
+	while (va_arg(aq, const char *)) { argcount++; } \
+	va_end(aq); \
+	const char *args[argcount+3]; \
 	args[0] = "/bin/Runner"; \
 	args[1] = "-f"; \
 	args[2] = arg; \
-	args[3] = NULL; \
-	va_list ap; \
-	va_start(ap, arg); \
-	while (args[argcount++]) { \
-		args = (const char **) realloc(args, sizeof(const char *) * (argcount + 4)); \
-		args[1+argcount] = va_arg(ap, char *); \
-	} \
+	for (i=1; i<=argcount; ++i) { args[2+i] = va_arg(ap, const char *); } \
+	if (with_envp) { envp = va_arg(ap, char *const *); } \
 	va_end(ap); \
-	RESET_ENV(); \
-	PRINT_ARGS()
+	(void) envp; \
+	if (! direct) { \
+		RESET_ENV(); \
+		PRINT_ARGS(); \
+	}
 
 int execl(const char *filename, const char *arg, ...)
 {
-	DECLARE_VA_ARGS();
+	DECLARE_VA_ARGS(_runDirectly(filename, false), false);
+	if (direct)
+		return execv_orig(filename, (char * const *) &args[2]);
 	return execv_orig(args[0], (char * const *) args);
 }
 
 int execlp(const char *filename, const char *arg, ...)
 {
-	DECLARE_VA_ARGS();
+	DECLARE_VA_ARGS(_runDirectly(filename, true), false);
+	if (direct)
+		return execvp_orig(filename, (char * const *) &args[2]);
 	return execvp_orig(args[0], (char * const *) args);
 }
 
 int execle(const char *filename, const char *arg, ...)
 {
-	DECLARE_VA_ARGS();
-	return execv_orig(args[0], (char * const *) args);
+	DECLARE_VA_ARGS(_runDirectly(filename, false), true);
+	if (direct)
+		return execve_orig(filename, (char * const *) &args[2], envp);
+	return execve_orig(args[0], (char * const *) args, envp);
 }
 
 int execv(const char *filename, char *const argv[])
 {
-	DECLARE_ARGS();
+	DECLARE_ARGS(_runDirectly(filename, false));
+	if (direct)
+		return execv_orig(filename, argv);
 	return execv_orig(args[0], args);
 }
 
 int execvp(const char *filename, char *const argv[])
 {
-	DECLARE_ARGS();
+	DECLARE_ARGS(_runDirectly(filename, true));
+	if (direct)
+		return execvp_orig(filename, argv);
 	return execvp_orig(args[0], args);
 }
 
 int execvpe(const char *filename, char *const argv[], char *const envp[])
 {
-	DECLARE_ARGS();
+	DECLARE_ARGS(_runDirectly(filename, true));
+	if (direct)
+		return execvpe_orig(filename, argv, envp);
 	return execvpe_orig(args[0], args, envp);
 }
 
 int execve(const char *filename, char *const argv[], char *const envp[])
 {
-	DECLARE_ARGS();
-    return execve_orig(args[0], args, envp);
+	DECLARE_ARGS(_runDirectly(filename, false));
+	if (direct)
+		return execve_orig(filename, argv, envp);
+	return execve_orig(args[0], args, envp);
 }
 
 int execveat(int dirfd, const char *filename, char *const argv[], char *const envp[], int flags)
 {
-	DECLARE_ARGS();
-    return execveat_orig(dirfd, args[0], args, envp, flags);
+	DECLARE_ARGS(_runDirectlyAt(dirfd, filename, flags));
+	if (direct)
+		return execveat_orig(dirfd, filename, argv, envp, flags);
+	return execveat_orig(dirfd, args[0], args, envp, flags);
 }
 
 int fexecve(int fd, char *const argv[], char *const envp[])
 {
-	DECLARE_ARGS();
-    return fexecve_orig(fd, args, envp);
+	DECLARE_ARGS(_runDirectlyAt(fd, "", AT_EMPTY_PATH));
+	if (direct)
+		return fexecve_orig(fd, argv, envp);
+	return fexecve_orig(fd, args, envp);
 }
 
+/*
+ * system() and popen() run their command through /bin/sh. When the shell
+ * itself needs no new sandbox, the commands it executes are still seen by
+ * the exec hooks above.
+ */
 int system(const char *command)
 {
 	DECLARE_CMD();
-    return system_orig(cmd);
+	int ret = system_orig(cmd ? cmd : command);
+	free(cmd);
+	return ret;
 }
 
 FILE *popen(const char *command, const char *type)
 {
 	DECLARE_CMD();
-    return popen_orig(cmd, type);
+	FILE *fp = popen_orig(cmd ? cmd : command, type);
+	free(cmd);
+	return fp;
 }
 
 FILE *_IO_popen(const char *command, const char *type)
 {
 	DECLARE_CMD();
-    return _IO_popen_orig(cmd, type);
+	FILE *fp = _IO_popen_orig(cmd ? cmd : command, type);
+	free(cmd);
+	return fp;
 }
 
 int posix_spawn(pid_t *pid, const char *file,
@@ -182,8 +381,10 @@ int posix_spawn(pid_t *pid, const char *file,
                 const posix_spawnattr_t *attrp,
                 char *const argv[], char *const envp[])
 {
-	DECLARE_ARGS();
-    return posix_spawn_orig(pid, file, file_actions, attrp, args, envp);
+	DECLARE_ARGS(_runDirectly(file, false));
+	if (direct)
+		return posix_spawn_orig(pid, file, file_actions, attrp, argv, envp);
+	return posix_spawn_orig(pid, args[0], file_actions, attrp, args, envp);
 }
 
 int posix_spawnp(pid_t *pid, const char *file,
@@ -191,6 +392,8 @@ int posix_spawnp(pid_t *pid, const char *file,
                 const posix_spawnattr_t *attrp,
                 char *const argv[], char *const envp[])
 {
-	DECLARE_ARGS();
-    return posix_spawnp_orig(pid, file, file_actions, attrp, args, envp);
+	DECLARE_ARGS(_runDirectly(file, true));
+	if (direct)
+		return posix_spawnp_orig(pid, file, file_actions, attrp, argv, envp);
+	return posix_spawnp_orig(pid, args[0], file_actions, attrp, args, envp);
 }